@@ -0,0 +1,547 @@
+#include <satorivideo/opencv/opencv_bot.h>
+#include <satorivideo/video_bot.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <json.hpp>
+#include <map>
+#include <opencv2/opencv.hpp>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define LOGURU_WITH_STREAMS 1
+#include <loguru/loguru.hpp>
+
+#include <bot_common/tracing.h>
+
+#include "background_engines.h"
+
+namespace sv = satori::video;
+
+/*
+ * Bot callbacks. Bot sources are compiled into this binary with BOT_BENCH defined,
+ * which leaves out their own main() functions.
+ */
+namespace empty_bot {
+void process_image(sv::bot_context &context, const sv::image_frame &frame);
+nlohmann::json process_command(sv::bot_context &context, const nlohmann::json &command);
+}  // namespace empty_bot
+
+namespace empty_opencv_bot {
+void process_image(sv::bot_context &context, const cv::Mat &frame);
+nlohmann::json process_command(sv::bot_context &context, const nlohmann::json &command);
+}  // namespace empty_opencv_bot
+
+namespace frame_quality_bot {
+void process_image(sv::bot_context &context, const sv::image_frame &frame);
+nlohmann::json process_command(sv::bot_context &context, const nlohmann::json &config);
+}  // namespace frame_quality_bot
+
+namespace haar_cascades_bot {
+void process_image(sv::bot_context &context, const cv::Mat &image);
+nlohmann::json process_command(sv::bot_context &context, const nlohmann::json &config);
+}  // namespace haar_cascades_bot
+
+namespace motion_detector_bot {
+void process_image(sv::bot_context &context, const cv::Mat &original_image);
+nlohmann::json process_command(sv::bot_context &context,
+                               const nlohmann::json &command_message);
+}  // namespace motion_detector_bot
+
+#ifdef BENCH_WITH_TENSORFLOW
+namespace empty_tensorflow_bot {
+void process_image(sv::bot_context &context, const cv::Mat &frame);
+nlohmann::json process_command(sv::bot_context &ctx, const nlohmann::json &config);
+}  // namespace empty_tensorflow_bot
+#endif
+
+namespace bot_bench {
+namespace {
+
+using clock = std::chrono::steady_clock;
+
+struct stage_samples {
+  std::vector<double> millis;
+
+  void add(clock::duration d) {
+    millis.push_back(std::chrono::duration<double, std::milli>(d).count());
+  }
+
+  // Nearest-rank percentile, samples must be sorted.
+  double percentile(double p) const {
+    if (millis.empty()) {
+      return 0;
+    }
+    const auto rank = static_cast<size_t>(p / 100.0 * (millis.size() - 1) + 0.5);
+    return millis[std::min(rank, millis.size() - 1)];
+  }
+
+  nlohmann::json to_json() {
+    std::sort(millis.begin(), millis.end());
+    return {{"count", millis.size()},
+            {"p50_ms", percentile(50)},
+            {"p99_ms", percentile(99)},
+            {"max_ms", millis.empty() ? 0.0 : millis.back()}};
+  }
+};
+
+struct run_stats {
+  uint64_t warmup_frames{0};
+  uint64_t frames{0};
+  // Time between two process_image() calls: decoding, scaling and pixel conversion
+  // done by the SDK.
+  stage_samples sdk;
+  stage_samples process_image;
+  clock::time_point first_frame_start;
+  clock::time_point last_frame_end;
+};
+
+run_stats stats;
+
+void (*opencv_process_image)(sv::bot_context &, const cv::Mat &) = nullptr;
+void (*raw_process_image)(sv::bot_context &, const sv::image_frame &) = nullptr;
+
+template <typename Fn>
+void timed(Fn &&fn) {
+  const auto start = clock::now();
+  const bool measured = stats.frames >= stats.warmup_frames;
+  if (measured && stats.frames > stats.warmup_frames) {
+    stats.sdk.add(start - stats.last_frame_end);
+  } else if (measured) {
+    stats.first_frame_start = start;
+  }
+
+  fn();
+
+  stats.last_frame_end = clock::now();
+  if (measured) {
+    stats.process_image.add(stats.last_frame_end - start);
+  }
+  stats.frames++;
+}
+
+void timed_opencv_process_image(sv::bot_context &context, const cv::Mat &frame) {
+  timed([&]() { opencv_process_image(context, frame); });
+}
+
+void timed_raw_process_image(sv::bot_context &context, const sv::image_frame &frame) {
+  timed([&]() { raw_process_image(context, frame); });
+}
+
+template <void (*ProcessImage)(sv::bot_context &, const cv::Mat &),
+          nlohmann::json (*ProcessCommand)(sv::bot_context &, const nlohmann::json &)>
+int run_opencv_bot(int argc, char *argv[]) {
+  opencv_process_image = ProcessImage;
+  sv::opencv_bot_register({&timed_opencv_process_image, ProcessCommand});
+  return sv::opencv_bot_main(argc, argv);
+}
+
+template <void (*ProcessImage)(sv::bot_context &, const sv::image_frame &),
+          nlohmann::json (*ProcessCommand)(sv::bot_context &, const nlohmann::json &)>
+int run_raw_bot(int argc, char *argv[]) {
+  raw_process_image = ProcessImage;
+  sv::bot_register(sv::bot_descriptor{sv::image_pixel_format::BGR,
+                                      &timed_raw_process_image, ProcessCommand});
+  return sv::bot_main(argc, argv);
+}
+
+int run_motion_detector_bot(int argc, char *argv[]) {
+  // Same setup as motion-detector-bot's main()
+  cv::setNumThreads(0);
+  loguru::g_colorlogtostderr = false;
+  return run_opencv_bot<&motion_detector_bot::process_image,
+                        &motion_detector_bot::process_command>(argc, argv);
+}
+
+struct bot_entry {
+  const char *name;
+  int (*run)(int argc, char *argv[]);
+};
+
+const bot_entry bots[] = {
+    {"empty-bot", &run_raw_bot<&empty_bot::process_image, &empty_bot::process_command>},
+    {"empty-opencv-bot", &run_opencv_bot<&empty_opencv_bot::process_image,
+                                         &empty_opencv_bot::process_command>},
+    {"frame-quality-bot", &run_raw_bot<&frame_quality_bot::process_image,
+                                       &frame_quality_bot::process_command>},
+    {"haar-cascades-bot", &run_opencv_bot<&haar_cascades_bot::process_image,
+                                          &haar_cascades_bot::process_command>},
+    {"motion-detector-bot", &run_motion_detector_bot},
+#ifdef BENCH_WITH_TENSORFLOW
+    {"empty-tensorflow-bot", &run_opencv_bot<&empty_tensorflow_bot::process_image,
+                                             &empty_tensorflow_bot::process_command>},
+#endif
+};
+
+struct options {
+  std::string bot;
+  std::string output;
+  std::string trace;
+  std::vector<std::string> engines;
+  uint64_t warmup_frames{0};
+  uint64_t synthetic_frames{0};
+  cv::Size synthetic_resolution{1280, 720};
+  std::vector<std::string> forwarded;
+};
+
+bool starts_with(const std::string &s, const std::string &prefix) {
+  return s.compare(0, prefix.size(), prefix) == 0;
+}
+
+void usage() {
+  std::cerr << "Usage: bot-bench --bot=<name> [bench options] [bot options]\n"
+            << "Bench options:\n"
+            << "  --bot=<name>                    bot to benchmark, one of:";
+  for (const auto &b : bots) {
+    std::cerr << " " << b.name;
+  }
+  std::cerr << "\n"
+            << "  --bench-output=<file>           write JSON report to file (default: stdout)\n"
+            << "  --bench-warmup=<n>              exclude first n frames from the report\n"
+            << "  --bench-trace=<file>            write the bots' stage spans to file and "
+               "report them\n"
+            << "  --bench-synthetic-frames=<n>    generate an n-frame clip instead of "
+               "--input-video-file\n"
+            << "  --bench-synthetic-resolution=<WxH>  synthetic clip resolution "
+               "(default: 1280x720)\n"
+            << "  --bench-engines=<a,b,...>       compare motion-detector-bot background "
+               "engines instead\n"
+            << "                                  of running the bot, e.g. mog2,average\n"
+            << "All other options are passed to the bot unchanged.\n";
+}
+
+bool parse_options(int argc, char *argv[], options &opts) {
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    const auto value = arg.substr(arg.find('=') + 1);
+    if (starts_with(arg, "--bot=")) {
+      opts.bot = value;
+    } else if (starts_with(arg, "--bench-output=")) {
+      opts.output = value;
+    } else if (starts_with(arg, "--bench-trace=")) {
+      opts.trace = value;
+    } else if (starts_with(arg, "--bench-engines=")) {
+      std::stringstream list(value);
+      std::string engine;
+      while (std::getline(list, engine, ',')) {
+        opts.engines.push_back(engine);
+      }
+    } else if (starts_with(arg, "--bench-warmup=")) {
+      opts.warmup_frames = std::stoull(value);
+    } else if (starts_with(arg, "--bench-synthetic-frames=")) {
+      opts.synthetic_frames = std::stoull(value);
+    } else if (starts_with(arg, "--bench-synthetic-resolution=")) {
+      int width, height;
+      if (sscanf(value.c_str(), "%dx%d", &width, &height) != 2 || width <= 0
+          || height <= 0) {
+        std::cerr << "Bad resolution: " << value << "\n";
+        return false;
+      }
+      opts.synthetic_resolution = {width, height};
+    } else {
+      opts.forwarded.push_back(arg);
+    }
+  }
+  return !opts.bot.empty();
+}
+
+/*
+ * Writes a deterministic clip of objects moving over a noisy static background,
+ * so that runs are comparable between builds without any external video.
+ */
+std::string write_synthetic_clip(uint64_t frames, const cv::Size &resolution) {
+  const std::string path = "bench_synthetic.avi";
+  cv::VideoWriter writer(path, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'), 25,
+                         resolution);
+  if (!writer.isOpened()) {
+    ABORT_S() << "Can't open " << path << " for writing";
+  }
+
+  cv::RNG rng(42);
+  cv::Mat background(resolution, CV_8UC3);
+  rng.fill(background, cv::RNG::UNIFORM, cv::Scalar::all(0), cv::Scalar::all(64));
+
+  cv::Mat frame;
+  const int side = std::max(8, resolution.height / 8);
+  for (uint64_t i = 0; i < frames; i++) {
+    background.copyTo(frame);
+    for (int object = 0; object < 3; object++) {
+      const int x = static_cast<int>((i * (4 + 3 * object)) % resolution.width);
+      const int y = (resolution.height / 4) * (object + 1) - side / 2;
+      cv::rectangle(frame, cv::Rect(x, y, side, side),
+                    cv::Scalar(255 - 60 * object, 80 * object, 255), cv::FILLED);
+    }
+    writer.write(frame);
+  }
+
+  return path;
+}
+
+/*
+ * Summarizes the stage spans bots record with bot_common::tracing, read back from the
+ * trace file. Only spans starting from measured_since count, so that the stages cover
+ * the same frames as the sdk and process_image stages.
+ */
+nlohmann::json bot_stages(const std::string &trace, clock::time_point measured_since) {
+  // Trace timestamps are in microseconds of the tracing clock, the steady clock
+  const double since_us =
+      measured_since == clock::time_point::max()
+          ? std::numeric_limits<double>::infinity()
+          : std::chrono::duration<double, std::micro>(measured_since.time_since_epoch())
+                .count();
+  std::map<std::string, stage_samples> stages;
+  std::ifstream file(trace);
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.empty() || line[0] != '{') {
+      continue;
+    }
+    if (line.back() == ',') {
+      line.pop_back();
+    }
+    const auto event = nlohmann::json::parse(line);
+    if (event["ts"].get<double>() < since_us) {
+      continue;
+    }
+    stages[event["name"].get<std::string>()].add(std::chrono::duration_cast<clock::duration>(
+        std::chrono::duration<double, std::micro>(event["dur"].get<double>())));
+  }
+
+  nlohmann::json json = nlohmann::json::object();
+  for (auto &stage : stages) {
+    json[stage.first] = stage.second.to_json();
+  }
+  return json;
+}
+
+/*
+ * Motion boxes of one frame with the motion detector pipeline at its default settings,
+ * on a single tile: blur, background engine, morphological opening and contours.
+ */
+struct engine_run {
+  std::string name;
+  motion_detector_bot::engine_kind kind;
+  std::unique_ptr<motion_detector_bot::background_engine> engine;
+  stage_samples frame;
+  double seconds{0};
+  double agreement_sum{0};
+  uint64_t boxes{0};
+  cv::Mat luma, blurred, mask, opened;
+  std::vector<std::vector<cv::Point>> contours;
+  std::vector<cv::Rect> frame_boxes;
+};
+
+void detect_boxes(engine_run &run, const cv::Mat &frame, const cv::Mat &element) {
+  const cv::Mat *image = &frame;
+  if (motion_detector_bot::engine_is_luma(run.kind)) {
+    cv::cvtColor(frame, run.luma, cv::COLOR_BGR2GRAY);
+    image = &run.luma;
+  }
+  cv::GaussianBlur(*image, run.blurred, cv::Size(5, 5), 0);
+  run.engine->apply(run.blurred, run.mask);
+  cv::morphologyEx(run.mask, run.opened, cv::MORPH_OPEN, element);
+  cv::findContours(run.opened, run.contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
+  run.frame_boxes.clear();
+  for (const auto &contour : run.contours) {
+    run.frame_boxes.push_back(cv::boundingRect(contour));
+  }
+}
+
+/*
+ * F1 score of boxes against reference boxes, matched greedily at an intersection over
+ * union of at least 0.3 (the motion detector's minIou). 1 when both are empty.
+ */
+double box_agreement(const std::vector<cv::Rect> &boxes,
+                     const std::vector<cv::Rect> &reference) {
+  if (boxes.empty() && reference.empty()) {
+    return 1;
+  }
+  std::vector<bool> matched(reference.size(), false);
+  size_t matches = 0;
+  for (const auto &box : boxes) {
+    for (size_t i = 0; i < reference.size(); i++) {
+      const double intersection = (box & reference[i]).area();
+      const double iou = intersection / (box.area() + reference[i].area() - intersection);
+      if (!matched[i] && iou >= 0.3) {
+        matched[i] = true;
+        matches++;
+        break;
+      }
+    }
+  }
+  return 2.0 * matches / (boxes.size() + reference.size());
+}
+
+/*
+ * Runs the background engines side by side on every frame of the clip and reports their
+ * throughput, and how well their motion boxes agree with the ones of the KNN engine,
+ * which always runs as the reference.
+ */
+nlohmann::json compare_engines(const options &opts, const std::string &video) {
+  namespace md = motion_detector_bot;
+  std::vector<engine_run> runs;
+  std::vector<std::string> names{"knn"};
+  for (const auto &name : opts.engines) {
+    if (std::find(names.begin(), names.end(), name) == names.end()) {
+      names.push_back(name);
+    }
+  }
+  for (const auto &name : names) {
+    engine_run run;
+    run.name = name;
+    if (!md::parse_engine_kind(name, run.kind)) {
+      ABORT_S() << "Unknown background engine " << name;
+    }
+    // The motion detector's defaults: 7 KNN samples, foregroundThreshold 20
+    run.engine = md::make_engine(run.kind, 7, 20);
+    runs.push_back(std::move(run));
+  }
+
+  cv::VideoCapture capture(video);
+  if (!capture.isOpened()) {
+    ABORT_S() << "Can't open " << video;
+  }
+  const cv::Mat element = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(5, 5));
+  cv::Mat frame;
+  cv::Size resolution;
+  uint64_t frames = 0;
+  for (; capture.read(frame); frames++) {
+    resolution = frame.size();
+    const bool measured = frames >= opts.warmup_frames;
+    for (auto &run : runs) {
+      const auto start = clock::now();
+      detect_boxes(run, frame, element);
+      const auto duration = clock::now() - start;
+      if (measured) {
+        run.frame.add(duration);
+        run.seconds += std::chrono::duration<double>(duration).count();
+        run.boxes += run.frame_boxes.size();
+        run.agreement_sum += box_agreement(run.frame_boxes, runs[0].frame_boxes);
+      }
+    }
+  }
+
+  const uint64_t measured_frames =
+      frames > opts.warmup_frames ? frames - opts.warmup_frames : 0;
+  nlohmann::json engines = nlohmann::json::object();
+  for (auto &run : runs) {
+    engines[run.name] = {
+        {"fps", run.seconds > 0 ? measured_frames / run.seconds : 0},
+        {"frame", run.frame.to_json()},
+        {"boxes", run.boxes},
+        {"agreement", measured_frames > 0 ? run.agreement_sum / measured_frames : 0}};
+  }
+  return {{"bot", opts.bot},
+          {"frames", measured_frames},
+          {"warmup_frames", std::min(frames, opts.warmup_frames)},
+          {"resolution", {resolution.width, resolution.height}},
+          {"engines", std::move(engines)}};
+}
+
+nlohmann::json report(const options &opts) {
+  struct rusage usage {};
+  getrusage(RUSAGE_SELF, &usage);
+
+  const uint64_t measured_frames =
+      stats.frames > stats.warmup_frames ? stats.frames - stats.warmup_frames : 0;
+  const double seconds =
+      measured_frames > 0
+          ? std::chrono::duration<double>(stats.last_frame_end - stats.first_frame_start)
+                .count()
+          : 0;
+
+  nlohmann::json json = {
+      {"bot", opts.bot},
+      {"frames", measured_frames},
+      {"warmup_frames", std::min(stats.frames, stats.warmup_frames)},
+      {"seconds", seconds},
+      {"fps", seconds > 0 ? measured_frames / seconds : 0},
+      {"stages",
+       {{"sdk", stats.sdk.to_json()}, {"process_image", stats.process_image.to_json()}}},
+      // ru_maxrss is in kilobytes on Linux
+      {"peak_rss_bytes", static_cast<uint64_t>(usage.ru_maxrss) * 1024}};
+  if (!opts.trace.empty()) {
+    // No measured frame, no measured span
+    const clock::time_point measured_since =
+        measured_frames > 0 ? stats.first_frame_start : clock::time_point::max();
+    json["bot_stages"] = bot_stages(opts.trace, measured_since);
+  }
+  return json;
+}
+
+}  // namespace
+}  // namespace bot_bench
+
+int main(int argc, char *argv[]) {
+  using namespace bot_bench;
+
+  options opts;
+  if (!parse_options(argc, argv, opts)) {
+    usage();
+    return 1;
+  }
+
+  const auto bot = std::find_if(std::begin(bots), std::end(bots), [&](const bot_entry &b) {
+    return opts.bot == b.name;
+  });
+  if (bot == std::end(bots)) {
+    std::cerr << "Unknown bot: " << opts.bot << "\n";
+    usage();
+    return 1;
+  }
+
+  if (opts.synthetic_frames > 0) {
+    opts.forwarded.push_back("--input-video-file="
+                             + write_synthetic_clip(opts.synthetic_frames,
+                                                    opts.synthetic_resolution));
+  }
+
+  std::vector<char *> bot_argv{argv[0]};
+  for (auto &arg : opts.forwarded) {
+    bot_argv.push_back(&arg[0]);
+  }
+  bot_argv.push_back(nullptr);
+
+  if (!opts.trace.empty()) {
+    // Read by bot_common::tracing when the bot sets up its tracer
+    setenv("BOT_TRACE_FILE", opts.trace.c_str(), 1);
+  }
+
+  int result = 0;
+  nlohmann::json json;
+  if (!opts.engines.empty()) {
+    if (opts.bot != "motion-detector-bot") {
+      std::cerr << "--bench-engines only applies to motion-detector-bot\n";
+      return 1;
+    }
+    const std::string video_option = "--input-video-file=";
+    const auto video = std::find_if(
+        opts.forwarded.begin(), opts.forwarded.end(),
+        [&](const std::string &arg) { return starts_with(arg, video_option); });
+    if (video == opts.forwarded.end()) {
+      std::cerr << "--bench-engines needs --input-video-file or a synthetic clip\n";
+      return 1;
+    }
+    json = compare_engines(opts, video->substr(video_option.size()));
+  } else {
+    stats.warmup_frames = opts.warmup_frames;
+    result = bot->run(static_cast<int>(bot_argv.size() - 1), bot_argv.data());
+    // The spans of the last frame are still waiting for the next one
+    bot_common::tracing::flush_all();
+    json = report(opts);
+  }
+
+  if (opts.output.empty()) {
+    std::cout << json.dump(2) << "\n";
+  } else {
+    std::ofstream(opts.output) << json.dump(2) << "\n";
+  }
+
+  return result;
+}
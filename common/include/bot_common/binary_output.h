@@ -0,0 +1,523 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <json.hpp>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+
+namespace bot_common {
+namespace binary_output {
+
+/*
+ * Compact analysis output. Instead of one JSON message per frame, detected objects are
+ * encoded as CBOR or MessagePack and the frames of up to max_frames frames or max_delay
+ * are published together, each with its own timestamp.
+ *
+ * bot_message() only takes JSON, so the encoded batch travels base64 encoded in a small
+ * envelope:
+ *   {"encoding": "cbor", "frames": 10, "data": "<base64>"}
+ *
+ * The data is a map {"v": 1, "f": [frames]}. Every frame is a map with "t", its
+ * timestamp in milliseconds since the epoch, and "o", its objects as arrays
+ * [id, x, y, width, height, tag]. Rect coordinates are fractions of the frame size in
+ * 16 bit fixed point (0 to 65535). Delta output frames (see object_tracker) also have
+ * "s", the snapshot flag, and "r", the ids of removed objects. decode() reads it back.
+ */
+
+enum class format { cbor, msgpack };
+
+constexpr uint8_t version = 1;
+constexpr double fixed_point_one = 65535;
+
+inline uint16_t to_fixed(double fraction) {
+  const double clamped = std::min(std::max(fraction, 0.0), 1.0);
+  return static_cast<uint16_t>(std::lround(clamped * fixed_point_one));
+}
+
+inline double from_fixed(uint64_t value) { return value / fixed_point_one; }
+
+inline const char *format_name(format f) { return f == format::cbor ? "cbor" : "msgpack"; }
+
+struct object {
+  uint32_t id;
+  cv::Rect rect;
+  // Points to a string outliving the frame, e.g. the tag of a cascade
+  const std::string *tag;
+};
+
+struct frame {
+  uint64_t timestamp_ms{0};
+  cv::Size size;
+  std::vector<object> objects;
+  bool delta{false};
+  bool snapshot{false};
+  std::vector<uint32_t> removed;
+};
+
+// Milliseconds since the epoch, the timestamp of frames.
+inline uint64_t now_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+/*
+ * Appends CBOR (RFC 7049) or MessagePack items to a buffer. Only the types used by the
+ * analysis output: unsigned integers, booleans, strings, arrays and maps.
+ */
+class writer {
+ public:
+  writer(format f, std::vector<uint8_t> &out) : _format(f), _out(out) {}
+
+  void uint(uint64_t value) {
+    if (_format == format::cbor) {
+      cbor_head(0, value);
+    } else if (value < 0x80) {
+      _out.push_back(static_cast<uint8_t>(value));
+    } else {
+      msgpack_sized(0xcc, value);
+    }
+  }
+
+  void boolean(bool value) {
+    if (_format == format::cbor) {
+      _out.push_back(value ? 0xf5 : 0xf4);
+    } else {
+      _out.push_back(value ? 0xc3 : 0xc2);
+    }
+  }
+
+  void text(const std::string &value) {
+    if (_format == format::cbor) {
+      cbor_head(3, value.size());
+    } else if (value.size() < 32) {
+      _out.push_back(static_cast<uint8_t>(0xa0 | value.size()));
+    } else if (value.size() <= 0xff) {
+      _out.push_back(0xd9);
+      _out.push_back(static_cast<uint8_t>(value.size()));
+    } else {
+      msgpack_container(0xda, value.size());
+    }
+    _out.insert(_out.end(), value.begin(), value.end());
+  }
+
+  void array(size_t size) {
+    if (_format == format::cbor) {
+      cbor_head(4, size);
+    } else if (size < 16) {
+      _out.push_back(static_cast<uint8_t>(0x90 | size));
+    } else {
+      msgpack_container(0xdc, size);
+    }
+  }
+
+  void map(size_t size) {
+    if (_format == format::cbor) {
+      cbor_head(5, size);
+    } else if (size < 16) {
+      _out.push_back(static_cast<uint8_t>(0x80 | size));
+    } else {
+      msgpack_container(0xde, size);
+    }
+  }
+
+ private:
+  void big_endian(uint64_t value, int bytes) {
+    for (int shift = (bytes - 1) * 8; shift >= 0; shift -= 8) {
+      _out.push_back(static_cast<uint8_t>(value >> shift));
+    }
+  }
+
+  void cbor_head(uint8_t major, uint64_t value) {
+    const uint8_t type = static_cast<uint8_t>(major << 5);
+    if (value < 24) {
+      _out.push_back(static_cast<uint8_t>(type | value));
+    } else if (value <= 0xff) {
+      _out.push_back(type | 24);
+      big_endian(value, 1);
+    } else if (value <= 0xffff) {
+      _out.push_back(type | 25);
+      big_endian(value, 2);
+    } else if (value <= 0xffffffff) {
+      _out.push_back(type | 26);
+      big_endian(value, 4);
+    } else {
+      _out.push_back(type | 27);
+      big_endian(value, 8);
+    }
+  }
+
+  // uint8/16/32/64 are marker, marker + 1, + 2 and + 3
+  void msgpack_sized(uint8_t marker, uint64_t value) {
+    if (value <= 0xff) {
+      _out.push_back(marker);
+      big_endian(value, 1);
+    } else if (value <= 0xffff) {
+      _out.push_back(marker + 1);
+      big_endian(value, 2);
+    } else if (value <= 0xffffffff) {
+      _out.push_back(marker + 2);
+      big_endian(value, 4);
+    } else {
+      _out.push_back(marker + 3);
+      big_endian(value, 8);
+    }
+  }
+
+  // str16/array16/map16 is marker, the 32 bit variant marker + 1
+  void msgpack_container(uint8_t marker, uint64_t size) {
+    if (size <= 0xffff) {
+      _out.push_back(marker);
+      big_endian(size, 2);
+    } else {
+      _out.push_back(marker + 1);
+      big_endian(size, 4);
+    }
+  }
+
+  const format _format;
+  std::vector<uint8_t> &_out;
+};
+
+// Reads back what writer wrote. Throws std::runtime_error on anything else.
+class reader {
+ public:
+  reader(format f, const uint8_t *data, size_t size)
+      : _format(f), _data(data), _end(data + size) {}
+
+  bool at_end() const { return _data == _end; }
+
+  uint64_t uint() {
+    const uint8_t b = byte();
+    if (_format == format::cbor) {
+      return cbor_value(b, 0);
+    }
+    if (b < 0x80) {
+      return b;
+    }
+    if (b >= 0xcc && b <= 0xcf) {
+      return big_endian(1 << (b - 0xcc));
+    }
+    throw std::runtime_error("expected an unsigned integer");
+  }
+
+  bool boolean() {
+    const uint8_t b = byte();
+    const uint8_t false_byte = _format == format::cbor ? 0xf4 : 0xc2;
+    if (b != false_byte && b != false_byte + 1) {
+      throw std::runtime_error("expected a boolean");
+    }
+    return b == false_byte + 1;
+  }
+
+  std::string text() {
+    const uint8_t b = byte();
+    uint64_t size;
+    if (_format == format::cbor) {
+      size = cbor_value(b, 3);
+    } else if ((b & 0xe0) == 0xa0) {
+      size = b & 0x1f;
+    } else if (b >= 0xd9 && b <= 0xdb) {
+      size = big_endian(1 << (b - 0xd9));
+    } else {
+      throw std::runtime_error("expected a string");
+    }
+    if (size > static_cast<uint64_t>(_end - _data)) {
+      throw std::runtime_error("truncated string");
+    }
+    std::string value(reinterpret_cast<const char *>(_data), size);
+    _data += size;
+    return value;
+  }
+
+  size_t array() { return container(4, 0x90, 0xdc); }
+
+  size_t map() { return container(5, 0x80, 0xde); }
+
+ private:
+  uint8_t byte() {
+    if (_data == _end) {
+      throw std::runtime_error("truncated data");
+    }
+    return *_data++;
+  }
+
+  uint64_t big_endian(int bytes) {
+    if (bytes > _end - _data) {
+      throw std::runtime_error("truncated data");
+    }
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+      value = (value << 8) | *_data++;
+    }
+    return value;
+  }
+
+  uint64_t cbor_value(uint8_t b, uint8_t major) {
+    if (b >> 5 != major) {
+      throw std::runtime_error("unexpected CBOR type");
+    }
+    const uint8_t info = b & 0x1f;
+    if (info < 24) {
+      return info;
+    }
+    if (info > 27) {
+      throw std::runtime_error("unsupported CBOR length");
+    }
+    return big_endian(1 << (info - 24));
+  }
+
+  // Every element takes at least a byte, so sizes beyond the data are rejected early
+  size_t container(uint8_t cbor_major, uint8_t msgpack_fix, uint8_t msgpack_16) {
+    const uint8_t b = byte();
+    uint64_t size;
+    if (_format == format::cbor) {
+      size = cbor_value(b, cbor_major);
+    } else if ((b & 0xf0) == msgpack_fix) {
+      size = b & 0x0f;
+    } else if (b == msgpack_16 || b == msgpack_16 + 1) {
+      size = big_endian(b == msgpack_16 ? 2 : 4);
+    } else {
+      throw std::runtime_error("unexpected MessagePack type");
+    }
+    if (size > static_cast<uint64_t>(_end - _data)) {
+      throw std::runtime_error("truncated data");
+    }
+    return static_cast<size_t>(size);
+  }
+
+  const format _format;
+  const uint8_t *_data;
+  const uint8_t *const _end;
+};
+
+namespace detail {
+
+constexpr char base64_alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+inline std::string base64_encode(const std::vector<uint8_t> &data) {
+  std::string out;
+  out.reserve((data.size() + 2) / 3 * 4);
+  size_t i = 0;
+  for (; i + 2 < data.size(); i += 3) {
+    const uint32_t n = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+    out.push_back(base64_alphabet[n >> 18]);
+    out.push_back(base64_alphabet[(n >> 12) & 63]);
+    out.push_back(base64_alphabet[(n >> 6) & 63]);
+    out.push_back(base64_alphabet[n & 63]);
+  }
+  if (i < data.size()) {
+    const uint32_t n = (data[i] << 16) | (i + 1 < data.size() ? data[i + 1] << 8 : 0);
+    out.push_back(base64_alphabet[n >> 18]);
+    out.push_back(base64_alphabet[(n >> 12) & 63]);
+    out.push_back(i + 1 < data.size() ? base64_alphabet[(n >> 6) & 63] : '=');
+    out.push_back('=');
+  }
+  return out;
+}
+
+inline std::vector<uint8_t> base64_decode(const std::string &text) {
+  std::vector<uint8_t> out;
+  out.reserve(text.size() / 4 * 3);
+  uint32_t n = 0;
+  int bits = 0;
+  for (char c : text) {
+    if (c == '=') {
+      break;
+    }
+    const char *p = std::find(base64_alphabet, base64_alphabet + 64, c);
+    if (p == base64_alphabet + 64) {
+      throw std::runtime_error("bad base64 data");
+    }
+    n = (n << 6) | static_cast<uint32_t>(p - base64_alphabet);
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      out.push_back(static_cast<uint8_t>(n >> bits));
+    }
+  }
+  return out;
+}
+
+}  // namespace detail
+
+/*
+ * Collects encoded frames until a batch is due. Frames are encoded as they are added, so
+ * no JSON tree is built per object.
+ *
+ * The batcher has no timer: the bots check due() when a frame arrives, as bot_message()
+ * may only be called from the SDK callbacks. While the input is stalled, a partial batch
+ * waits for the next frame, so max_delay bounds the latency of a running stream, not of
+ * the last frames before a pause. Bots also publish a partial batch when reconfigured.
+ */
+class batcher {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  batcher(format f, size_t max_frames, std::chrono::milliseconds max_delay)
+      : _format(f), _max_frames(std::max<size_t>(max_frames, 1)), _max_delay(max_delay) {}
+
+  format encoding() const { return _format; }
+
+  size_t frames() const { return _frames; }
+
+  void add(const frame &f) {
+    if (_frames == 0) {
+      _first = clock::now();
+    }
+    writer w(_format, _encoded_frames);
+    w.map(f.delta ? 4 : 2);
+    w.text("t");
+    w.uint(f.timestamp_ms);
+    w.text("o");
+    w.array(f.objects.size());
+    const double width = std::max(f.size.width, 1);
+    const double height = std::max(f.size.height, 1);
+    for (const auto &o : f.objects) {
+      w.array(6);
+      w.uint(o.id);
+      w.uint(to_fixed(o.rect.x / width));
+      w.uint(to_fixed(o.rect.y / height));
+      w.uint(to_fixed(o.rect.width / width));
+      w.uint(to_fixed(o.rect.height / height));
+      w.text(*o.tag);
+    }
+    if (f.delta) {
+      w.text("s");
+      w.boolean(f.snapshot);
+      w.text("r");
+      w.array(f.removed.size());
+      for (uint32_t id : f.removed) {
+        w.uint(id);
+      }
+    }
+    _frames++;
+  }
+
+  // Whether the batch is full or its first frame has waited for max_delay (see above).
+  bool due(clock::time_point now = clock::now()) const {
+    return _frames >= _max_frames || (_frames > 0 && now - _first >= _max_delay);
+  }
+
+  // Returns the envelope of the frames added so far and starts a new batch.
+  nlohmann::json take() {
+    _batch.clear();
+    writer w(_format, _batch);
+    w.map(2);
+    w.text("v");
+    w.uint(version);
+    w.text("f");
+    w.array(_frames);
+    _batch.insert(_batch.end(), _encoded_frames.begin(), _encoded_frames.end());
+
+    nlohmann::json envelope = {{"encoding", format_name(_format)},
+                               {"frames", _frames},
+                               {"data", detail::base64_encode(_batch)}};
+    _encoded_frames.clear();
+    _frames = 0;
+    return envelope;
+  }
+
+ private:
+  const format _format;
+  const size_t _max_frames;
+  const std::chrono::milliseconds _max_delay;
+  size_t _frames{0};
+  clock::time_point _first;
+  // Kept between batches to reuse their memory
+  std::vector<uint8_t> _encoded_frames;
+  std::vector<uint8_t> _batch;
+};
+
+struct decoded_object {
+  uint32_t id;
+  // Fractions of the frame size
+  double x, y, width, height;
+  std::string tag;
+};
+
+struct decoded_frame {
+  uint64_t timestamp_ms{0};
+  std::vector<decoded_object> objects;
+  bool delta{false};
+  bool snapshot{false};
+  std::vector<uint32_t> removed;
+};
+
+// Decodes the data of a batch. Throws std::runtime_error if it is malformed.
+inline std::vector<decoded_frame> decode(format f, const std::vector<uint8_t> &data) {
+  reader r(f, data.data(), data.size());
+  std::vector<decoded_frame> frames;
+  const size_t fields = r.map();
+  for (size_t i = 0; i < fields; i++) {
+    const std::string key = r.text();
+    if (key == "v") {
+      if (r.uint() != version) {
+        throw std::runtime_error("unsupported version");
+      }
+    } else if (key == "f") {
+      frames.resize(r.array());
+      for (auto &frame : frames) {
+        const size_t frame_fields = r.map();
+        for (size_t j = 0; j < frame_fields; j++) {
+          const std::string frame_key = r.text();
+          if (frame_key == "t") {
+            frame.timestamp_ms = r.uint();
+          } else if (frame_key == "o") {
+            frame.objects.resize(r.array());
+            for (auto &o : frame.objects) {
+              if (r.array() != 6) {
+                throw std::runtime_error("bad object");
+              }
+              o.id = static_cast<uint32_t>(r.uint());
+              o.x = from_fixed(r.uint());
+              o.y = from_fixed(r.uint());
+              o.width = from_fixed(r.uint());
+              o.height = from_fixed(r.uint());
+              o.tag = r.text();
+            }
+          } else if (frame_key == "s") {
+            frame.delta = true;
+            frame.snapshot = r.boolean();
+          } else if (frame_key == "r") {
+            frame.removed.resize(r.array());
+            for (auto &id : frame.removed) {
+              id = static_cast<uint32_t>(r.uint());
+            }
+          } else {
+            throw std::runtime_error("unknown frame field " + frame_key);
+          }
+        }
+      }
+    } else {
+      throw std::runtime_error("unknown field " + key);
+    }
+  }
+  if (!r.at_end()) {
+    throw std::runtime_error("trailing data");
+  }
+  return frames;
+}
+
+// Decodes a published envelope.
+inline std::vector<decoded_frame> decode(const nlohmann::json &envelope) {
+  if (!envelope.is_object() || envelope.find("encoding") == envelope.end()
+      || envelope.find("data") == envelope.end()) {
+    throw std::runtime_error("not an encoded analysis message");
+  }
+  const std::string encoding = envelope["encoding"];
+  if (encoding != "cbor" && encoding != "msgpack") {
+    throw std::runtime_error("unknown encoding " + encoding);
+  }
+  return decode(encoding == "cbor" ? format::cbor : format::msgpack,
+                detail::base64_decode(envelope["data"]));
+}
+
+}  // namespace binary_output
+}  // namespace bot_common
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace bot_common {
+
+/*
+ * Fixed capacity lock-free queue for any number of producers and consumers (Dmitry
+ * Vyukov's bounded MPMC queue). Every cell carries a sequence number telling whether it
+ * is ready to be written or read at a given position, so a push or a pop is a single
+ * compare-and-swap on the tail or the head. Memory is allocated once, in the constructor.
+ */
+template <typename T>
+class bounded_queue {
+ public:
+  explicit bounded_queue(size_t capacity) : _cells(capacity > 0 ? capacity : 1) {
+    for (size_t i = 0; i < _cells.size(); i++) {
+      _cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  bounded_queue(const bounded_queue &) = delete;
+  bounded_queue &operator=(const bounded_queue &) = delete;
+
+  size_t capacity() const { return _cells.size(); }
+
+  // Returns false, leaving value untouched, if the queue is full.
+  bool try_push(T &&value) {
+    const size_t capacity = _cells.size();
+    size_t position = _tail.load(std::memory_order_relaxed);
+    cell *c;
+    for (;;) {
+      c = &_cells[position % capacity];
+      const size_t sequence = c->sequence.load(std::memory_order_acquire);
+      const auto difference =
+          static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+      if (difference == 0) {
+        if (_tail.compare_exchange_weak(position, position + 1,
+                                        std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (difference < 0) {
+        return false;
+      } else {
+        position = _tail.load(std::memory_order_relaxed);
+      }
+    }
+    c->value = std::move(value);
+    c->sequence.store(position + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Returns false if the queue is empty.
+  bool try_pop(T &value) {
+    const size_t capacity = _cells.size();
+    size_t position = _head.load(std::memory_order_relaxed);
+    cell *c;
+    for (;;) {
+      c = &_cells[position % capacity];
+      const size_t sequence = c->sequence.load(std::memory_order_acquire);
+      const auto difference =
+          static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+      if (difference == 0) {
+        if (_head.compare_exchange_weak(position, position + 1,
+                                        std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (difference < 0) {
+        return false;
+      } else {
+        position = _head.load(std::memory_order_relaxed);
+      }
+    }
+    value = std::move(c->value);
+    c->value = T{};
+    c->sequence.store(position + capacity, std::memory_order_release);
+    return true;
+  }
+
+  // Number of queued elements. Only a snapshot when other threads use the queue.
+  size_t size() const {
+    const size_t head = _head.load(std::memory_order_acquire);
+    const size_t tail = _tail.load(std::memory_order_acquire);
+    return tail > head ? tail - head : 0;
+  }
+
+  bool empty() const { return size() == 0; }
+
+ private:
+  struct cell {
+    std::atomic<size_t> sequence{0};
+    T value{};
+  };
+
+  std::vector<cell> _cells;
+  std::atomic<size_t> _head{0};
+  // Head and tail are written by different threads, keep them on separate cache lines
+  char _padding[64 - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> _tail{0};
+};
+
+}  // namespace bot_common
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <thread>
+
+namespace bot_common {
+
+namespace cpu_quota_detail {
+
+// Reads "<quota> <period>" (cgroup v2 cpu.max), quota being "max" when unlimited
+inline bool read_cgroup_v2(double &cpus) {
+  std::ifstream file("/sys/fs/cgroup/cpu.max");
+  std::string quota;
+  double period = 0;
+  if (!(file >> quota >> period) || quota == "max" || period <= 0) {
+    return false;
+  }
+  cpus = std::stod(quota) / period;
+  return true;
+}
+
+// Reads cpu.cfs_quota_us and cpu.cfs_period_us (cgroup v1), quota being -1 when unlimited
+inline bool read_cgroup_v1(double &cpus) {
+  std::ifstream quota_file("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+  std::ifstream period_file("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+  double quota = 0;
+  double period = 0;
+  if (!(quota_file >> quota) || !(period_file >> period) || quota <= 0 || period <= 0) {
+    return false;
+  }
+  cpus = quota / period;
+  return true;
+}
+
+}  // namespace cpu_quota_detail
+
+/*
+ * Number of CPUs this process may use: the cgroup CPU quota when running in a container
+ * with a CPU limit, the number of cores otherwise. Fractional quotas (e.g. 0.25 CPU) are
+ * returned as they are.
+ */
+inline double available_cpus() {
+  const double cores = std::max(1u, std::thread::hardware_concurrency());
+  double cpus = 0;
+  if (cpu_quota_detail::read_cgroup_v2(cpus) || cpu_quota_detail::read_cgroup_v1(cpus)) {
+    return std::min(cpus, cores);
+  }
+  return cores;
+}
+
+// Number of threads worth running for CPU bound work: whole CPUs, at least 1.
+inline size_t available_threads() {
+  return std::max<size_t>(1, static_cast<size_t>(std::floor(available_cpus())));
+}
+
+}  // namespace bot_common
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <json.hpp>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "bounded_queue.h"
+
+namespace bot_common {
+
+/*
+ * RCU-style replacement of a bot configuration while frames keep flowing.
+ *
+ * request() hands a new configuration to a background thread which builds it (loading
+ * models, starting threads...) off the hot path. The SDK thread picks the result up with
+ * take(), a single atomic exchange, at the start of a frame, and passes the configuration
+ * it replaces to retire(). Configurations are shared pointers, so anything still using
+ * the old one, e.g. a frame in flight on another thread, keeps it alive; the background
+ * thread drops the last reference of the retired configuration, so that its destruction
+ * (joining threads, freeing models) doesn't land on a frame either.
+ */
+template <typename T>
+class hot_swap {
+ public:
+  using builder = std::function<std::shared_ptr<T>(const nlohmann::json &config)>;
+
+  explicit hot_swap(builder build)
+      : _build(std::move(build)), _retired(retired_capacity), _thread([this]() { work(); }) {}
+
+  ~hot_swap() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stopping = true;
+    }
+    _wake.notify_one();
+    _thread.join();
+    delete _ready.exchange(nullptr);
+  }
+
+  hot_swap(const hot_swap &) = delete;
+  hot_swap &operator=(const hot_swap &) = delete;
+
+  /*
+   * Builds config on the background thread. A request still waiting is replaced, only
+   * the latest configuration matters.
+   */
+  void request(nlohmann::json config) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _request = std::move(config);
+      _has_request = true;
+    }
+    _wake.notify_one();
+  }
+
+  // Returns the configuration built since the previous call, or null. Never blocks.
+  std::shared_ptr<T> take() {
+    std::unique_ptr<std::shared_ptr<T>> ready(_ready.exchange(nullptr));
+    return ready ? std::move(*ready) : nullptr;
+  }
+
+  // Hands a replaced configuration over to the background thread for destruction.
+  void retire(std::shared_ptr<T> &&old) {
+    if (old && _retired.try_push(std::move(old))) {
+      _wake.notify_one();
+    }
+    // Otherwise, with more swaps in flight than the queue holds, old goes away here
+  }
+
+ private:
+  static constexpr size_t retired_capacity = 4;
+
+  void work() {
+    for (;;) {
+      nlohmann::json config;
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        // Retired configurations are pushed without the lock, hence the timeout
+        _wake.wait_for(lock, std::chrono::milliseconds(100),
+                       [this]() { return _stopping || _has_request; });
+        if (_stopping) {
+          break;
+        }
+        if (_has_request) {
+          config = std::move(_request);
+          _has_request = false;
+        }
+      }
+      drop_retired();
+      if (!config.is_null()) {
+        std::unique_ptr<std::shared_ptr<T>> built(new std::shared_ptr<T>(_build(config)));
+        // A configuration built earlier and never taken is dropped here
+        delete _ready.exchange(built.release());
+      }
+    }
+    drop_retired();
+  }
+
+  void drop_retired() {
+    std::shared_ptr<T> old;
+    while (_retired.try_pop(old)) {
+      old.reset();
+    }
+  }
+
+  const builder _build;
+  std::atomic<std::shared_ptr<T> *> _ready{nullptr};
+  bounded_queue<std::shared_ptr<T>> _retired;
+
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  nlohmann::json _request;
+  bool _has_request{false};
+  bool _stopping{false};
+
+  std::thread _thread;
+};
+
+}  // namespace bot_common
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <prometheus/counter.h>
+#include <prometheus/counter_builder.h>
+#include <prometheus/gauge.h>
+#include <prometheus/gauge_builder.h>
+#include <prometheus/registry.h>
+#include <chrono>
+#include <cstdint>
+#include <json.hpp>
+#include <string>
+
+namespace bot_common {
+
+/*
+ * Keeps a bot real-time by degrading its analysis in steps while frames take too long,
+ * and restoring it once there is headroom again.
+ *
+ * The load is the time spent on frames during a window of `window` frames, relative to
+ * the time these frames cover: their number over frame_rate or, without a frame rate,
+ * the wall time of the window, i.e. how busy the SDK thread is. Above `high`, the level
+ * goes up one step per window. Below `low`, and no sooner than `hold` windows after the
+ * last change, it goes down one step. Stepping down adds load, the gap between high and
+ * low keeps the level from flapping.
+ *
+ * Level 1 skips every other frame in every bot; what the levels above do is up to the
+ * bot, e.g. a lower analysis resolution. Metrics: <prefix>_load_level and <prefix>_load
+ * (gauges, the load of the last window) and <prefix>_frames_shed (counter).
+ */
+class load_shedder {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  struct settings {
+    bool enabled{false};
+    double frame_rate{0};
+    double high{0.9};
+    double low{0.5};
+    uint32_t window{25};
+    uint32_t hold{4};
+
+    bool operator==(const settings &other) const {
+      return enabled == other.enabled && frame_rate == other.frame_rate
+             && high == other.high && low == other.low && window == other.window
+             && hold == other.hold;
+    }
+    bool operator!=(const settings &other) const { return !(*this == other); }
+  };
+
+  // Times an admitted frame.
+  class busy {
+   public:
+    explicit busy(load_shedder &shedder) : _shedder(shedder), _start(clock::now()) {}
+    ~busy() { _shedder._busy += clock::now() - _start; }
+
+    busy(const busy &) = delete;
+    busy &operator=(const busy &) = delete;
+
+   private:
+    load_shedder &_shedder;
+    const clock::time_point _start;
+  };
+
+  load_shedder(prometheus::Registry &registry, const std::string &prefix,
+               uint32_t max_level)
+      : _max_level(max_level),
+        _level_gauge(prometheus::BuildGauge()
+                         .Name(prefix + "_load_level")
+                         .Register(registry)
+                         .Add({})),
+        _load_gauge(
+            prometheus::BuildGauge().Name(prefix + "_load").Register(registry).Add({})),
+        _shed_counter(prometheus::BuildCounter()
+                          .Name(prefix + "_frames_shed")
+                          .Register(registry)
+                          .Add({})) {}
+
+  load_shedder(const load_shedder &) = delete;
+  load_shedder &operator=(const load_shedder &) = delete;
+
+  /*
+   * Applies new settings, does nothing if they are the same. The current level is kept
+   * and measured against the new thresholds from a new window, unless shedding is
+   * disabled, which goes back to level 0.
+   */
+  void configure(const settings &settings) {
+    if (settings == _settings) {
+      return;
+    }
+    _settings = settings;
+    _frames = 0;
+    _busy = clock::duration::zero();
+    if (!_settings.enabled && _level > 0) {
+      _previous_level = _level;
+      _level = 0;
+      _changed = true;
+      _windows_since_change = 0;
+      _level_gauge.Set(0);
+    }
+  }
+
+  uint32_t level() const { return _level; }
+
+  /*
+   * Called at the start of every frame. Returns false if the frame is to be skipped,
+   * otherwise the frame is timed with a busy instance.
+   */
+  bool admit() {
+    if (!_settings.enabled) {
+      return true;
+    }
+    const auto now = clock::now();
+    if (_frames == 0) {
+      _window_start = now;
+    } else if (_frames >= _settings.window) {
+      evaluate(now);
+      _frames = 0;
+      _busy = clock::duration::zero();
+      _window_start = now;
+    }
+    _frames++;
+    if (_level >= 1 && _sequence++ % 2 == 1) {
+      _shed_counter.Increment();
+      return false;
+    }
+    return true;
+  }
+
+  /*
+   * Returns true once after each level change, with event set to
+   * {"loadShedding": {"level": 2, "previousLevel": 1, "load": 0.97}}.
+   */
+  bool take_change(nlohmann::json &event) {
+    if (!_changed) {
+      return false;
+    }
+    _changed = false;
+    event = {{"loadShedding",
+              {{"level", _level}, {"previousLevel", _previous_level}, {"load", _load}}}};
+    return true;
+  }
+
+ private:
+  void evaluate(clock::time_point now) {
+    const double covered = _settings.frame_rate > 0
+                               ? _frames / _settings.frame_rate
+                               : std::chrono::duration<double>(now - _window_start).count();
+    _load = covered > 0 ? std::chrono::duration<double>(_busy).count() / covered : 0;
+    _load_gauge.Set(_load);
+    if (_windows_since_change < _settings.hold) {
+      _windows_since_change++;
+    }
+
+    uint32_t next = _level;
+    if (_load > _settings.high && _level < _max_level) {
+      next = _level + 1;
+    } else if (_load < _settings.low && _level > 0
+               && _windows_since_change >= _settings.hold) {
+      next = _level - 1;
+    }
+    if (next == _level) {
+      return;
+    }
+    _previous_level = _level;
+    _level = next;
+    _changed = true;
+    _windows_since_change = 0;
+    _level_gauge.Set(_level);
+  }
+
+  const uint32_t _max_level;
+  settings _settings;
+  uint32_t _level{0};
+  uint32_t _previous_level{0};
+  double _load{0};
+  bool _changed{false};
+
+  // Current window
+  clock::time_point _window_start;
+  uint32_t _frames{0};
+  clock::duration _busy{clock::duration::zero()};
+  uint32_t _windows_since_change{0};
+  // Frames seen while skipping, every other one is skipped
+  uint64_t _sequence{0};
+
+  prometheus::Gauge &_level_gauge;
+  prometheus::Gauge &_load_gauge;
+  prometheus::Counter &_shed_counter;
+};
+
+}  // namespace bot_common
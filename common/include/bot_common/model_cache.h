@@ -0,0 +1,143 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+
+namespace bot_common {
+
+/*
+ * Read-only memory mapping of a whole file. The pages are the page cache pages of the
+ * file, so every process mapping the same file shares one copy of it.
+ */
+class mapped_file {
+ public:
+  explicit mapped_file(const std::string &path) {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *data = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED,
+                          fd, 0);
+      if (data != MAP_FAILED) {
+        _data = static_cast<const uint8_t *>(data);
+        _size = static_cast<size_t>(st.st_size);
+      }
+    }
+    // The mapping keeps the file open
+    ::close(fd);
+  }
+
+  ~mapped_file() {
+    if (_data != nullptr) {
+      ::munmap(const_cast<uint8_t *>(_data), _size);
+    }
+  }
+
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+
+  // False if the file can't be read or is empty.
+  bool is_open() const { return _data != nullptr; }
+
+  const uint8_t *data() const { return _data; }
+  size_t size() const { return _size; }
+
+ private:
+  const uint8_t *_data{nullptr};
+  size_t _size{0};
+};
+
+/*
+ * 64-bit hash of a model file, 8 bytes per step. Tells apart the versions of a model,
+ * it's not meant to resist collisions made on purpose.
+ */
+inline uint64_t content_hash(const uint8_t *data, size_t size) {
+  const uint64_t multiplier = 0x9e3779b97f4a7c15ull;
+  uint64_t hash = size * multiplier;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, data + i, 8);
+    word *= 0xff51afd7ed558ccdull;
+    word ^= word >> 32;
+    hash = (hash ^ word) * multiplier;
+    hash ^= hash >> 29;
+  }
+  uint64_t tail = 0;
+  std::memcpy(&tail, data + i, size - i);
+  hash = (hash ^ tail) * multiplier;
+  hash ^= hash >> 32;
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  hash ^= hash >> 29;
+  return hash;
+}
+
+inline uint64_t content_hash(const mapped_file &file) {
+  return content_hash(file.data(), file.size());
+}
+
+/*
+ * Directory of models converted to a faster loading form, one file per source model
+ * content: a changed model gets a new entry, and the replicas of a bot on a node share
+ * the entries (and, through the page cache, their memory). Stale entries are never
+ * removed, the directory can be wiped at any time.
+ */
+class model_cache {
+ public:
+  explicit model_cache(std::string directory) : _directory(std::move(directory)) {
+    ::mkdir(_directory.c_str(), 0755);
+  }
+
+  const std::string &directory() const { return _directory; }
+
+  // Entry for the model with the given content hash, e.g. path(hash, ".mmpb").
+  std::string path(uint64_t hash, const std::string &extension) const {
+    char name[17];
+    std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash));
+    return _directory + "/" + name + extension;
+  }
+
+  static bool contains(const std::string &entry) {
+    return ::access(entry.c_str(), R_OK) == 0;
+  }
+
+  /*
+   * Creates an entry: write(temporary) writes the converted model to a temporary file,
+   * which is then renamed to entry. Replicas converting the same model at the same time
+   * each write their own file and the last rename wins, so nobody reads a partial entry.
+   * The temporary file is created by mkstemp(), as replicas in separate containers
+   * sharing the directory may well have the same pid.
+   */
+  static bool store(const std::string &entry,
+                    const std::function<bool(const std::string &temporary)> &write) {
+    std::string temporary = entry + ".tmp.XXXXXX";
+    const int fd = ::mkstemp(&temporary[0]);
+    if (fd < 0) {
+      return false;
+    }
+    // mkstemp() creates the file readable by its owner only, entries are for everyone
+    const bool created = ::fchmod(fd, 0644) == 0;
+    ::close(fd);
+    if (!created || !write(temporary)
+        || std::rename(temporary.c_str(), entry.c_str()) != 0) {
+      std::remove(temporary.c_str());
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  const std::string _directory;
+};
+
+}  // namespace bot_common
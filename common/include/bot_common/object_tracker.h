@@ -0,0 +1,194 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <tuple>
+#include <vector>
+#include <opencv2/core.hpp>
+
+namespace bot_common {
+
+// Intersection over union of two boxes, 0 when either is empty.
+inline double iou(const cv::Rect &a, const cv::Rect &b) {
+  const double intersection = (a & b).area();
+  const double united = static_cast<double>(a.area()) + b.area() - intersection;
+  return united > 0 ? intersection / united : 0;
+}
+
+/*
+ * Gives detected objects ids which persist across frames. Detections of a frame are
+ * matched to the known objects of the same label by intersection over union, best
+ * matches first; unmatched detections become new objects. An object which isn't
+ * detected for more than max_missed frames in a row is removed, so an object flickering
+ * for a frame or two keeps its id.
+ *
+ * For delta output, the tracker also remembers where every object was last published
+ * (see changes()).
+ */
+class object_tracker {
+ public:
+  struct detection {
+    cv::Rect rect;
+    // Objects only match detections with the same label, e.g. the cascade index
+    uint32_t label;
+  };
+
+  struct object {
+    uint32_t id;
+    uint32_t label;
+    cv::Rect rect;
+    // Frames since the object was last detected, 0 if detected in the current frame
+    uint32_t missed;
+    // Position last published by changes(), empty before
+    cv::Rect published;
+  };
+
+  explicit object_tracker(double min_iou = 0.3, uint32_t max_missed = 2)
+      : _min_iou(min_iou), _max_missed(max_missed) {}
+
+  void configure(double min_iou, uint32_t max_missed) {
+    _min_iou = min_iou;
+    _max_missed = max_missed;
+  }
+
+  /*
+   * Changes the labels of the known objects, e.g. when the cascades are reconfigured:
+   * an object with label l takes labels[l]. Objects whose label is out of labels or
+   * maps to a negative value are dropped, and reported as removed by the next update().
+   */
+  void relabel(const std::vector<int> &labels) {
+    size_t kept = 0;
+    for (size_t i = 0; i < _objects.size(); i++) {
+      object &o = _objects[i];
+      if (o.label >= labels.size() || labels[o.label] < 0) {
+        _dropped.push_back(o.id);
+        continue;
+      }
+      o.label = static_cast<uint32_t>(labels[o.label]);
+      _objects[kept++] = o;
+    }
+    _objects.resize(kept);
+  }
+
+  // Matches the detections of a new frame.
+  void update(const std::vector<detection> &detections) {
+    _candidates.clear();
+    for (size_t i = 0; i < _objects.size(); i++) {
+      for (size_t j = 0; j < detections.size(); j++) {
+        if (_objects[i].label != detections[j].label) {
+          continue;
+        }
+        const double overlap = iou(_objects[i].rect, detections[j].rect);
+        if (overlap >= _min_iou && overlap > 0) {
+          _candidates.push_back({overlap, i, j});
+        }
+      }
+    }
+    // Ties are broken by index, so that ids don't depend on the sort implementation
+    std::sort(_candidates.begin(), _candidates.end(),
+              [](const candidate &a, const candidate &b) {
+                return std::tie(b.overlap, a.object, a.detection)
+                       < std::tie(a.overlap, b.object, b.detection);
+              });
+
+    _object_matched.assign(_objects.size(), false);
+    _detection_matched.assign(detections.size(), false);
+    for (const auto &c : _candidates) {
+      if (_object_matched[c.object] || _detection_matched[c.detection]) {
+        continue;
+      }
+      _object_matched[c.object] = true;
+      _detection_matched[c.detection] = true;
+      _objects[c.object].rect = detections[c.detection].rect;
+      _objects[c.object].missed = 0;
+    }
+
+    _removed.assign(_dropped.begin(), _dropped.end());
+    _dropped.clear();
+    size_t kept = 0;
+    for (size_t i = 0; i < _objects.size(); i++) {
+      if (!_object_matched[i] && ++_objects[i].missed > _max_missed) {
+        _removed.push_back(_objects[i].id);
+        continue;
+      }
+      _objects[kept++] = _objects[i];
+    }
+    _objects.resize(kept);
+
+    for (size_t j = 0; j < detections.size(); j++) {
+      if (!_detection_matched[j]) {
+        _objects.push_back(
+            object{_next_id++, detections[j].label, detections[j].rect, 0, cv::Rect{}});
+      }
+    }
+  }
+
+  // Known objects, oldest first. Objects with missed > 0 were not seen in this frame.
+  const std::vector<object> &objects() const { return _objects; }
+
+  // Ids of the objects removed by the last update().
+  const std::vector<uint32_t> &removed() const { return _removed; }
+
+  /*
+   * Delta output. Selects the objects of the current frame to publish: all of them on
+   * keyframes (every keyframe_interval frames), otherwise the ones which appeared or
+   * moved a box edge by more than move_threshold of their size since they were last
+   * published. Returns false when there is nothing to publish, i.e. no keyframe, no
+   * selected object and no removed object.
+   */
+  bool changes(double move_threshold, uint32_t keyframe_interval, bool &keyframe,
+               std::vector<size_t> &selected) {
+    keyframe = _frames_to_keyframe == 0;
+    if (keyframe) {
+      _frames_to_keyframe = std::max<uint32_t>(keyframe_interval, 1);
+    }
+    _frames_to_keyframe--;
+    selected.clear();
+    for (size_t i = 0; i < _objects.size(); i++) {
+      object &o = _objects[i];
+      if (o.missed > 0) {
+        continue;
+      }
+      if (keyframe || o.published.area() == 0 || moved(o, move_threshold)) {
+        o.published = o.rect;
+        selected.push_back(i);
+      }
+    }
+    return keyframe || !selected.empty() || !_removed.empty();
+  }
+
+ private:
+  struct candidate {
+    double overlap;
+    size_t object;
+    size_t detection;
+  };
+
+  static bool moved(const object &o, double threshold) {
+    const double limit = threshold * std::max(o.published.width, o.published.height);
+    const cv::Point published_br = o.published.br();
+    const cv::Point br = o.rect.br();
+    return std::abs(o.rect.x - o.published.x) > limit
+           || std::abs(o.rect.y - o.published.y) > limit
+           || std::abs(br.x - published_br.x) > limit
+           || std::abs(br.y - published_br.y) > limit;
+  }
+
+  double _min_iou;
+  uint32_t _max_missed;
+  std::vector<object> _objects;
+  std::vector<uint32_t> _removed;
+  // Objects dropped by relabel(), removed with the next update()
+  std::vector<uint32_t> _dropped;
+  uint32_t _next_id{1};
+  // Calls to changes() left before the next keyframe
+  uint32_t _frames_to_keyframe{0};
+
+  // Kept between frames to reuse their memory
+  std::vector<candidate> _candidates;
+  std::vector<bool> _object_matched;
+  std::vector<bool> _detection_matched;
+};
+
+}  // namespace bot_common
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#define BOT_COMMON_SSSE3_DISPATCH 1
+#endif
+
+namespace bot_common {
+
+/*
+ * Vectorized kernels over 8-bit pixel data. Unless noted otherwise, the instruction set
+ * is picked at compile time (AVX2 when built with -mavx2, SSE2 on any x86-64), other
+ * targets use the scalar loops.
+ */
+
+// Sum of absolute differences between two byte buffers of length n.
+inline uint64_t sum_abs_diff(const uint8_t *a, const uint8_t *b, size_t n) {
+  uint64_t sum = 0;
+  size_t i = 0;
+#if defined(__AVX2__)
+  __m256i acc = _mm256_setzero_si256();
+  for (; i + 32 <= n; i += 32) {
+    const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+    const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(va, vb));
+  }
+  alignas(32) uint64_t lanes[4];
+  _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), acc);
+  sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__SSE2__)
+  __m128i acc = _mm_setzero_si128();
+  for (; i + 16 <= n; i += 16) {
+    const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+    const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+  }
+  alignas(16) uint64_t lanes[2];
+  _mm_store_si128(reinterpret_cast<__m128i *>(lanes), acc);
+  sum = lanes[0] + lanes[1];
+#endif
+  for (; i < n; i++) {
+    sum += static_cast<uint64_t>(std::abs(static_cast<int>(a[i]) - static_cast<int>(b[i])));
+  }
+  return sum;
+}
+
+namespace detail {
+
+inline void bgr_to_rgb_float_scalar(const uint8_t *bgr, float *rgb, size_t pixels,
+                                    float scale, float offset) {
+  for (size_t p = 0; p < pixels; p++) {
+    rgb[3 * p] = bgr[3 * p + 2] * scale + offset;
+    rgb[3 * p + 1] = bgr[3 * p + 1] * scale + offset;
+    rgb[3 * p + 2] = bgr[3 * p] * scale + offset;
+  }
+}
+
+#ifdef BOT_COMMON_SSSE3_DISPATCH
+__attribute__((target("ssse3"))) inline void bgr_to_rgb_float_ssse3(
+    const uint8_t *bgr, float *rgb, size_t pixels, float scale, float offset) {
+  // Swaps B and R of 4 pixels, the last 4 bytes belong to the next pixels
+  const __m128i reorder =
+      _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, -1, -1, -1, -1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128 vscale = _mm_set1_ps(scale);
+  const __m128 voffset = _mm_set1_ps(offset);
+
+  size_t p = 0;
+  // 16 bytes are loaded for 12 used, stop while 16 bytes are still readable
+  for (; p + 6 <= pixels; p += 4) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bgr + 3 * p));
+    bytes = _mm_shuffle_epi8(bytes, reorder);
+    const __m128i low = _mm_unpacklo_epi8(bytes, zero);
+    const __m128i high = _mm_unpackhi_epi8(bytes, zero);
+    const __m128 f0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(low, zero));
+    const __m128 f1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(low, zero));
+    const __m128 f2 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(high, zero));
+    float *out = rgb + 3 * p;
+    _mm_storeu_ps(out, _mm_add_ps(_mm_mul_ps(f0, vscale), voffset));
+    _mm_storeu_ps(out + 4, _mm_add_ps(_mm_mul_ps(f1, vscale), voffset));
+    _mm_storeu_ps(out + 8, _mm_add_ps(_mm_mul_ps(f2, vscale), voffset));
+  }
+  bgr_to_rgb_float_scalar(bgr + 3 * p, rgb + 3 * p, pixels - p, scale, offset);
+}
+#endif
+
+}  // namespace detail
+
+/*
+ * Converts packed 8-bit BGR pixels to packed float RGB, computing value * scale + offset
+ * in the same pass. Picks the SSSE3 version at run time when the CPU supports it.
+ */
+inline void bgr_to_rgb_float(const uint8_t *bgr, float *rgb, size_t pixels, float scale,
+                             float offset) {
+#ifdef BOT_COMMON_SSSE3_DISPATCH
+  static const bool has_ssse3 = __builtin_cpu_supports("ssse3");
+  if (has_ssse3) {
+    detail::bgr_to_rgb_float_ssse3(bgr, rgb, pixels, scale, offset);
+    return;
+  }
+#endif
+  detail::bgr_to_rgb_float_scalar(bgr, rgb, pixels, scale, offset);
+}
+
+}  // namespace bot_common
@@ -0,0 +1,277 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <json.hpp>
+#include <memory>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef LOGURU_WITH_STREAMS
+#define LOGURU_WITH_STREAMS 1
+#endif
+#include <loguru/loguru.hpp>
+
+#include "cpu_quota.h"
+#include "stream_scheduler.h"
+
+namespace bot_common {
+
+/*
+ * Serves many video streams from one process, next to the bot's own input. Every stream
+ * is read by its own capture thread with cv::VideoCapture and its frames are processed on
+ * a shared stream_scheduler, in order within a stream. A frame arriving while max_pending
+ * frames of its stream are still waiting is dropped, so that a slow stream stays live
+ * instead of lagging behind. More workers than streams would stay idle, so there are at
+ * most as many workers as streams.
+ *
+ * Sources are URLs or files opened by OpenCV, not Satori channels: the SDK only
+ * subscribes a bot to its own input channel. A live source, i.e. a URL with a scheme like
+ * rtsp://camera/stream, is reopened when it fails or ends, after 1s and then twice as
+ * long every time it fails again, up to 30s. A file is played once.
+ *
+ * Analysis messages wait in a queue of up to max_results messages, the oldest one is
+ * dropped when it is full. Bots can only publish on the SDK thread, so they take the
+ * messages from their SDK callbacks with take_results().
+ */
+class stream_host {
+ public:
+  struct source {
+    std::string id;
+    std::string url;
+  };
+
+  struct result {
+    size_t stream;
+    nlohmann::json message;
+  };
+
+  /*
+   * The "streams" section of a bot configuration:
+   * {"sources": [{"id": "lobby", "url": "rtsp://..."}], "threads": 4, "maxPending": 2,
+   *  "maxResults": 1000}. Threads default to the available CPUs and never exceed the
+   * sources.
+   */
+  struct settings {
+    std::vector<source> sources;
+    size_t threads{0};
+    size_t max_pending{2};
+    size_t max_results{1000};
+  };
+
+  // Throws std::invalid_argument (or a json exception) if streams is invalid.
+  static settings parse_settings(const nlohmann::json &streams) {
+    check(streams.is_object(), "streams is not an object: " + streams.dump());
+    check(streams.find("sources") != streams.end() && streams["sources"].is_array(),
+          "no sources array in streams: " + streams.dump());
+
+    settings parsed;
+    for (const auto &s : streams["sources"]) {
+      check(s.is_object() && s.find("id") != s.end() && s["id"].is_string()
+                && s.find("url") != s.end() && s["url"].is_string(),
+            "bad stream source: " + s.dump());
+      parsed.sources.push_back({s["id"], s["url"]});
+    }
+    check(!parsed.sources.empty(), "No stream sources provided: " + streams.dump());
+
+    parsed.threads = available_threads();
+    if (streams.find("threads") != streams.end()) {
+      check(streams["threads"].is_number_unsigned() && streams["threads"] > 0,
+            "threads is not a positive integer: " + streams.dump());
+      parsed.threads = streams["threads"];
+    }
+    parsed.threads = std::min(parsed.threads, parsed.sources.size());
+    if (streams.find("maxPending") != streams.end()) {
+      check(streams["maxPending"].is_number_unsigned(),
+            "maxPending is not an unsigned integer: " + streams.dump());
+      parsed.max_pending = streams["maxPending"];
+    }
+    if (streams.find("maxResults") != streams.end()) {
+      check(streams["maxResults"].is_number_unsigned() && streams["maxResults"] > 0,
+            "maxResults is not a positive integer: " + streams.dump());
+      parsed.max_results = streams["maxResults"];
+    }
+    return parsed;
+  }
+
+  /*
+   * Processes one frame of a stream on a worker thread, appending the analysis messages
+   * to publish to messages (empty on every call). Never called concurrently for the same
+   * stream.
+   */
+  using process_fn =
+      std::function<void(size_t stream, size_t worker, const cv::Mat &frame,
+                         std::vector<nlohmann::json> &messages)>;
+
+  stream_host(std::vector<source> sources, size_t workers, size_t max_pending,
+              size_t max_results, process_fn process)
+      : _sources(std::move(sources)),
+        _max_pending(max_pending),
+        _max_results(std::max<size_t>(max_results, 1)),
+        _process(std::move(process)),
+        _messages(std::max<size_t>(std::min(workers, _sources.size()), 1)),
+        _scheduler(new stream_scheduler(_sources.size(), _messages.size())) {
+    _captures.reserve(_sources.size());
+    for (size_t i = 0; i < _sources.size(); i++) {
+      _captures.emplace_back([this, i]() { capture(i); });
+    }
+  }
+
+  ~stream_host() {
+    {
+      std::lock_guard<std::mutex> lock(_stop_mutex);
+      _stopping = true;
+    }
+    _stop.notify_all();
+    for (auto &thread : _captures) {
+      thread.join();
+    }
+    _scheduler.reset();
+  }
+
+  stream_host(settings parsed, process_fn process)
+      : stream_host(std::move(parsed.sources), parsed.threads, parsed.max_pending,
+                    parsed.max_results, std::move(process)) {}
+
+  stream_host(const stream_host &) = delete;
+  stream_host &operator=(const stream_host &) = delete;
+
+  const std::vector<source> &sources() const { return _sources; }
+
+  size_t workers() const { return _scheduler->workers(); }
+
+  // Moves the messages produced since the previous call into results, oldest first.
+  void take_results(std::vector<result> &results) {
+    results.clear();
+    std::lock_guard<std::mutex> lock(_results_mutex);
+    for (auto &r : _results) {
+      results.push_back(std::move(r));
+    }
+    _results.clear();
+  }
+
+  // Frames dropped because their stream was busy.
+  uint64_t dropped_frames() const { return _dropped.load(); }
+
+  // Messages dropped because they weren't taken before max_results more came in.
+  uint64_t dropped_results() const { return _dropped_results.load(); }
+
+  // Whether the source is played once, i.e. isn't a URL.
+  static bool is_file(const std::string &url) {
+    return url.find("://") == std::string::npos;
+  }
+
+ private:
+  static void check(bool condition, const std::string &message) {
+    if (!condition) {
+      throw std::invalid_argument(message);
+    }
+  }
+
+  // Waits for delay, returns false if the host stops meanwhile.
+  bool wait(std::chrono::seconds delay) {
+    std::unique_lock<std::mutex> lock(_stop_mutex);
+    return !_stop.wait_for(lock, delay, [this]() { return _stopping; });
+  }
+
+  bool stopping() {
+    std::lock_guard<std::mutex> lock(_stop_mutex);
+    return _stopping;
+  }
+
+  void capture(size_t stream) {
+    const source &s = _sources[stream];
+    const bool file = is_file(s.url);
+    const std::chrono::seconds first_retry_delay{1};
+    const std::chrono::seconds max_retry_delay{30};
+    std::chrono::seconds retry_delay = first_retry_delay;
+    cv::VideoCapture capture;
+    while (!stopping()) {
+      if (!capture.isOpened()) {
+        if (!capture.open(s.url)) {
+          if (file) {
+            LOG_S(ERROR) << "Can't open stream " << s.id << " (" << s.url << ")";
+            return;
+          }
+          LOG_S(WARNING) << "Can't open stream " << s.id << " (" << s.url
+                         << "), retrying in " << retry_delay.count() << "s";
+          if (!wait(retry_delay)) {
+            return;
+          }
+          retry_delay = std::min(retry_delay * 2, max_retry_delay);
+          continue;
+        }
+        LOG_S(INFO) << "Opened stream " << s.id << " (" << s.url << ")";
+      }
+      // A new Mat every time: queued frames still reference the previous buffers
+      cv::Mat frame;
+      if (!capture.read(frame) || frame.empty()) {
+        capture.release();
+        if (file) {
+          LOG_S(INFO) << "Stream " << s.id << " ended";
+          return;
+        }
+        LOG_S(WARNING) << "Stream " << s.id << " ended, reopening in "
+                       << retry_delay.count() << "s";
+        if (!wait(retry_delay)) {
+          return;
+        }
+        retry_delay = std::min(retry_delay * 2, max_retry_delay);
+        continue;
+      }
+      retry_delay = first_retry_delay;
+      const bool queued = _scheduler->submit(
+          stream,
+          [this, stream, frame](size_t worker) { process(stream, worker, frame); },
+          _max_pending);
+      if (!queued) {
+        _dropped++;
+      }
+    }
+  }
+
+  void process(size_t stream, size_t worker, const cv::Mat &frame) {
+    std::vector<nlohmann::json> &messages = _messages[worker];
+    messages.clear();
+    _process(stream, worker, frame, messages);
+    if (messages.empty()) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(_results_mutex);
+    for (auto &message : messages) {
+      if (_results.size() == _max_results) {
+        _results.pop_front();
+        _dropped_results++;
+      }
+      _results.push_back({stream, std::move(message)});
+    }
+  }
+
+  const std::vector<source> _sources;
+  const size_t _max_pending;
+  const size_t _max_results;
+  const process_fn _process;
+  // Messages of the frame running on each worker, kept to reuse their memory
+  std::vector<std::vector<nlohmann::json>> _messages;
+
+  std::mutex _results_mutex;
+  std::deque<result> _results;
+  std::atomic<uint64_t> _dropped{0};
+  std::atomic<uint64_t> _dropped_results{0};
+
+  std::mutex _stop_mutex;
+  std::condition_variable _stop;
+  bool _stopping{false};
+  std::unique_ptr<stream_scheduler> _scheduler;
+  std::vector<std::thread> _captures;
+};
+
+}  // namespace bot_common
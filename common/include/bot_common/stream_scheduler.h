@@ -0,0 +1,170 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace bot_common {
+
+/*
+ * Runs the tasks of many streams on a fixed set of worker threads.
+ * Tasks of one stream run one at a time, in submission order, so per-stream state needs
+ * no locking; different streams run in parallel. A stream with pending tasks sits in the
+ * ready queue of one worker and idle workers steal ready streams from the others, so a
+ * slow stream doesn't hold up the streams queued behind it. After each task a stream goes
+ * to the back of its worker's queue, which keeps busy streams from starving the others.
+ */
+class stream_scheduler {
+ public:
+  // Tasks get the index of the worker running them, e.g. to pick per-worker resources.
+  using task = std::function<void(size_t worker)>;
+
+  stream_scheduler(size_t streams, size_t workers) : _workers(workers > 0 ? workers : 1) {
+    _streams.reserve(streams);
+    for (size_t i = 0; i < streams; i++) {
+      _streams.emplace_back(new stream);
+    }
+    _threads.reserve(_workers.size());
+    for (size_t i = 0; i < _workers.size(); i++) {
+      _threads.emplace_back([this, i]() { work(i); });
+    }
+  }
+
+  ~stream_scheduler() {
+    {
+      std::lock_guard<std::mutex> lock(_sleep_mutex);
+      _stopping = true;
+    }
+    _wake.notify_all();
+    for (auto &thread : _threads) {
+      thread.join();
+    }
+  }
+
+  stream_scheduler(const stream_scheduler &) = delete;
+  stream_scheduler &operator=(const stream_scheduler &) = delete;
+
+  size_t workers() const { return _workers.size(); }
+
+  /*
+   * Queues a task of `stream`. Returns false, dropping the task, if the stream already
+   * has max_pending tasks waiting (0 means no limit).
+   */
+  bool submit(size_t stream_index, task t, size_t max_pending = 0) {
+    stream &s = *_streams[stream_index];
+    {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      if (max_pending > 0 && s.tasks.size() >= max_pending) {
+        return false;
+      }
+      s.tasks.push_back(std::move(t));
+      if (s.scheduled) {
+        return true;
+      }
+      s.scheduled = true;
+    }
+    make_ready(stream_index, _next_worker.fetch_add(1) % _workers.size());
+    return true;
+  }
+
+  // Number of tasks of `stream` waiting to run.
+  size_t pending(size_t stream_index) {
+    stream &s = *_streams[stream_index];
+    std::lock_guard<std::mutex> lock(s.mutex);
+    return s.tasks.size();
+  }
+
+ private:
+  struct stream {
+    std::mutex mutex;
+    std::deque<task> tasks;
+    // Whether the stream is in a ready queue or running, i.e. owned by a worker
+    bool scheduled{false};
+  };
+
+  struct worker {
+    std::mutex mutex;
+    std::deque<size_t> ready;
+  };
+
+  void make_ready(size_t stream_index, size_t worker_index) {
+    {
+      std::lock_guard<std::mutex> lock(_workers[worker_index].mutex);
+      _workers[worker_index].ready.push_back(stream_index);
+    }
+    _ready.fetch_add(1);
+    // Taking the lock orders the push before a worker going to sleep
+    { std::lock_guard<std::mutex> lock(_sleep_mutex); }
+    _wake.notify_one();
+  }
+
+  // Takes a ready stream from the worker's own queue, or steals one from another worker.
+  bool take(size_t worker_index, size_t &stream_index) {
+    for (size_t i = 0; i < _workers.size(); i++) {
+      worker &w = _workers[(worker_index + i) % _workers.size()];
+      std::lock_guard<std::mutex> lock(w.mutex);
+      if (w.ready.empty()) {
+        continue;
+      }
+      if (i == 0) {
+        stream_index = w.ready.front();
+        w.ready.pop_front();
+      } else {
+        stream_index = w.ready.back();
+        w.ready.pop_back();
+      }
+      _ready.fetch_sub(1);
+      return true;
+    }
+    return false;
+  }
+
+  void work(size_t worker_index) {
+    for (;;) {
+      size_t stream_index;
+      if (!take(worker_index, stream_index)) {
+        std::unique_lock<std::mutex> lock(_sleep_mutex);
+        _wake.wait(lock, [this]() { return _stopping || _ready.load() > 0; });
+        if (_stopping) {
+          return;
+        }
+        continue;
+      }
+
+      stream &s = *_streams[stream_index];
+      task t;
+      {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        t = std::move(s.tasks.front());
+        s.tasks.pop_front();
+      }
+      t(worker_index);
+      bool more;
+      {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        more = !s.tasks.empty();
+        s.scheduled = more;
+      }
+      if (more) {
+        make_ready(stream_index, worker_index);
+      }
+    }
+  }
+
+  std::vector<std::unique_ptr<stream>> _streams;
+  std::vector<worker> _workers;
+  std::atomic<size_t> _next_worker{0};
+  std::atomic<size_t> _ready{0};
+  std::mutex _sleep_mutex;
+  std::condition_variable _wake;
+  bool _stopping{false};
+  std::vector<std::thread> _threads;
+};
+
+}  // namespace bot_common
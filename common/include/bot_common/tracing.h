@@ -0,0 +1,318 @@
+#pragma once
+
+#include <prometheus/histogram.h>
+#include <prometheus/histogram_builder.h>
+#include <prometheus/registry.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <initializer_list>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace bot_common {
+namespace tracing {
+
+/*
+ * Stage timing for process_image() and the threads it uses.
+ *
+ * Spans are recorded into a per-thread ring buffer with two relaxed atomic stores, no
+ * lock and no shared cache line. flush(), called on the SDK thread once per frame,
+ * drains the buffers into Prometheus histograms (in seconds) of the bot context registry
+ * and, if the BOT_TRACE_FILE environment variable names a file, appends the spans to it
+ * in Chrome trace event format (open with chrome://tracing or ui.perfetto.dev).
+ */
+
+// Monotonic clock, read without a syscall through the vDSO on Linux.
+using clock = std::chrono::steady_clock;
+
+// Histogram buckets, in seconds: 50us to 5s.
+constexpr std::initializer_list<double> default_buckets = {
+    0.00005, 0.0001, 0.0002, 0.0005, 0.001, 0.002, 0.005, 0.01,
+    0.02,    0.05,   0.1,    0.2,    0.5,   1,     2,     5};
+
+namespace detail {
+
+struct event {
+  uint32_t stage;
+  int64_t start_ns;
+  int64_t duration_ns;
+};
+
+// Single producer (the owning thread), single consumer (flush) ring of events.
+struct thread_buffer {
+  static constexpr size_t capacity = 1024;
+
+  explicit thread_buffer(size_t thread) : thread(thread) {}
+
+  bool push(const event &e) {
+    const size_t tail = _tail.load(std::memory_order_relaxed);
+    if (tail - _head.load(std::memory_order_acquire) == capacity) {
+      return false;
+    }
+    _events[tail % capacity] = e;
+    _tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  template <typename Fn>
+  void drain(Fn &&fn) {
+    const size_t head = _head.load(std::memory_order_relaxed);
+    const size_t tail = _tail.load(std::memory_order_acquire);
+    for (size_t i = head; i < tail; i++) {
+      fn(_events[i % capacity]);
+    }
+    _head.store(tail, std::memory_order_release);
+  }
+
+  const size_t thread;
+
+ private:
+  std::array<event, capacity> _events;
+  std::atomic<size_t> _head{0};
+  // Keeps the head and the tail, written by different threads, on separate cache lines
+  char _padding[64 - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> _tail{0};
+};
+
+/*
+ * Small process-wide numbers of the running threads, used as buffer slots and trace
+ * tids. A thread takes the lowest free number the first time it records a span and
+ * gives it back when it exits, so threads started and stopped over the life of the bot
+ * (e.g. worker pools rebuilt on reconfiguration) keep reusing the same slots. In traces,
+ * a tid can stand for successive threads.
+ */
+class thread_numbers {
+ public:
+  // Never destroyed, threads may exit after static destructors have run
+  static thread_numbers &instance() {
+    static thread_numbers *numbers = new thread_numbers();
+    return *numbers;
+  }
+
+  size_t acquire() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_free.empty()) {
+      return _next++;
+    }
+    std::pop_heap(_free.begin(), _free.end(), std::greater<size_t>());
+    const size_t number = _free.back();
+    _free.pop_back();
+    return number;
+  }
+
+  // The lock also orders the last spans of the exiting thread before those of the next
+  // thread getting its number, which then writes to the same buffer.
+  void release(size_t number) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _free.push_back(number);
+    std::push_heap(_free.begin(), _free.end(), std::greater<size_t>());
+  }
+
+ private:
+  std::mutex _mutex;
+  size_t _next{0};
+  // Min-heap of the numbers of exited threads
+  std::vector<size_t> _free;
+};
+
+struct thread_number {
+  thread_number() : value(thread_numbers::instance().acquire()) {}
+  ~thread_number() { thread_numbers::instance().release(value); }
+  const size_t value;
+};
+
+inline size_t thread_index() {
+  thread_local const thread_number number;
+  return number.value;
+}
+
+inline int64_t to_nanoseconds(clock::time_point t) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+}
+
+}  // namespace detail
+
+class tracer;
+
+namespace detail {
+
+// Live tracers of the process, for flush_all()
+class tracer_list {
+ public:
+  // Never destroyed, like thread_numbers
+  static tracer_list &instance() {
+    static tracer_list *list = new tracer_list();
+    return *list;
+  }
+
+  void add(tracer *t) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _tracers.push_back(t);
+  }
+
+  void remove(tracer *t) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _tracers.erase(std::remove(_tracers.begin(), _tracers.end(), t), _tracers.end());
+  }
+
+  template <typename Fn>
+  void for_each(Fn &&fn) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (tracer *t : _tracers) {
+      fn(*t);
+    }
+  }
+
+ private:
+  std::mutex _mutex;
+  std::vector<tracer *> _tracers;
+};
+
+}  // namespace detail
+
+class tracer {
+ public:
+  explicit tracer(prometheus::Registry &registry) : _registry(registry) {
+    for (auto &buffer : _buffers) {
+      buffer.store(nullptr, std::memory_order_relaxed);
+    }
+    detail::tracer_list::instance().add(this);
+    const char *trace_file = std::getenv("BOT_TRACE_FILE");
+    if (trace_file != nullptr && *trace_file != '\0') {
+      _trace = std::fopen(trace_file, "w");
+      if (_trace != nullptr) {
+        // The closing bracket is optional in the trace event format
+        std::fputs("[\n", _trace);
+      }
+    }
+  }
+
+  ~tracer() {
+    detail::tracer_list::instance().remove(this);
+    if (_trace != nullptr) {
+      std::fclose(_trace);
+    }
+    for (auto &buffer : _buffers) {
+      delete buffer.load(std::memory_order_acquire);
+    }
+  }
+
+  tracer(const tracer &) = delete;
+  tracer &operator=(const tracer &) = delete;
+
+  /*
+   * Registers a stage, reported as the histogram `metric` and as `name` in traces.
+   * Stages must be added before any span is recorded.
+   */
+  uint32_t add_stage(const std::string &name, const std::string &metric,
+                     std::initializer_list<double> buckets = default_buckets) {
+    prometheus::Histogram &histogram = prometheus::BuildHistogram()
+                                           .Name(metric)
+                                           .Register(_registry)
+                                           .Add({}, std::vector<double>(buckets));
+    _stages.push_back({name, &histogram});
+    return static_cast<uint32_t>(_stages.size() - 1);
+  }
+
+  // Records a span of `stage`. Can be called from any thread.
+  void record(uint32_t stage, clock::time_point start, clock::time_point end) {
+    const size_t thread = detail::thread_index();
+    const detail::event e{stage, detail::to_nanoseconds(start),
+                          std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+                              .count()};
+    if (thread >= max_threads) {
+      // Rare: more live threads than slots. Histograms are thread-safe, only tracing is
+      // lost.
+      _stages[stage].histogram->Observe(e.duration_ns / 1e9);
+      return;
+    }
+    detail::thread_buffer *buffer = _buffers[thread].load(std::memory_order_acquire);
+    if (buffer == nullptr) {
+      buffer = new detail::thread_buffer(thread);
+      _buffers[thread].store(buffer, std::memory_order_release);
+    }
+    if (!buffer->push(e)) {
+      _dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  /*
+   * Moves recorded spans into the histograms and the trace file. Must be called from one
+   * thread at a time, normally the SDK thread at the end of process_image().
+   */
+  void flush() {
+    for (auto &slot : _buffers) {
+      detail::thread_buffer *buffer = slot.load(std::memory_order_acquire);
+      if (buffer == nullptr) {
+        continue;
+      }
+      buffer->drain([&](const detail::event &e) {
+        const auto &stage = _stages[e.stage];
+        stage.histogram->Observe(e.duration_ns / 1e9);
+        if (_trace != nullptr) {
+          std::fprintf(_trace,
+                       "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                       "\"pid\":%d,\"tid\":%zu},\n",
+                       stage.name.c_str(), e.start_ns / 1e3, e.duration_ns / 1e3,
+                       static_cast<int>(getpid()), buffer->thread);
+        }
+      });
+    }
+    if (_trace != nullptr) {
+      std::fflush(_trace);
+    }
+  }
+
+  // Spans lost because a thread recorded more than a buffer holds between two flushes.
+  uint64_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+ private:
+  // Threads recording at the same time, slots of exited threads are reused
+  static constexpr size_t max_threads = 64;
+
+  struct stage_info {
+    std::string name;
+    prometheus::Histogram *histogram;
+  };
+
+  prometheus::Registry &_registry;
+  std::vector<stage_info> _stages;
+  std::array<std::atomic<detail::thread_buffer *>, max_threads> _buffers;
+  std::atomic<uint64_t> _dropped{0};
+  std::FILE *_trace{nullptr};
+};
+
+/*
+ * Flushes every live tracer of the process. Bots flush at the start of each frame, so
+ * the spans of their last frame stay buffered: tools running a bot, like the bench,
+ * call this once it has stopped.
+ */
+inline void flush_all() {
+  detail::tracer_list::instance().for_each([](tracer &t) { t.flush(); });
+}
+
+// Records the time from its construction to its destruction as a span of `stage`.
+class span {
+ public:
+  span(tracer &t, uint32_t stage) : _tracer(t), _stage(stage), _start(clock::now()) {}
+  ~span() { _tracer.record(_stage, _start, clock::now()); }
+
+  span(const span &) = delete;
+  span &operator=(const span &) = delete;
+
+ private:
+  tracer &_tracer;
+  const uint32_t _stage;
+  const clock::time_point _start;
+};
+
+}  // namespace tracing
+}  // namespace bot_common
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "cpu_quota.h"
+
+namespace bot_common {
+
+/*
+ * Fixed set of worker threads running fork-join loops.
+ * parallel_for() hands out indices to the workers and to the calling thread, and returns
+ * once every index is done. A pool with zero workers runs everything on the calling
+ * thread, in index order.
+ */
+class worker_pool {
+ public:
+  explicit worker_pool(size_t workers) {
+    _threads.reserve(workers);
+    for (size_t i = 0; i < workers; i++) {
+      _threads.emplace_back([this]() { work(); });
+    }
+  }
+
+  ~worker_pool() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stopping = true;
+    }
+    _job_ready.notify_all();
+    for (auto &thread : _threads) {
+      thread.join();
+    }
+  }
+
+  worker_pool(const worker_pool &) = delete;
+  worker_pool &operator=(const worker_pool &) = delete;
+
+  // Number of worker threads, not counting the calling thread.
+  size_t size() const { return _threads.size(); }
+
+  // Runs fn(0) ... fn(count - 1) and waits for all of them. Not reentrant.
+  // fn is passed to the workers by pointer, so calling this doesn't allocate.
+  template <typename Fn>
+  void parallel_for(size_t count, Fn &&fn) {
+    if (_threads.empty() || count <= 1) {
+      for (size_t i = 0; i < count; i++) {
+        fn(i);
+      }
+      return;
+    }
+
+    using fn_type = typename std::remove_reference<Fn>::type;
+    const task t{[](void *fn, size_t i) { (*static_cast<fn_type *>(fn))(i); },
+                 const_cast<void *>(static_cast<const void *>(&fn))};
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _task = &t;
+      _count = count;
+      _next.store(0);
+      _pending = count;
+      _generation++;
+    }
+    _job_ready.notify_all();
+
+    const size_t done = run_indices(t, count);
+
+    // Also waits for workers which joined late and found nothing left to do, so that
+    // none of them is still holding fn when the next job resets the index counter.
+    std::unique_lock<std::mutex> lock(_mutex);
+    _pending -= done;
+    _job_done.wait(lock, [this]() { return _pending == 0 && _active == 0; });
+    _task = nullptr;
+  }
+
+  // Worker count for running `tasks` tasks concurrently: one less than the number of
+  // tasks because the caller takes part, never more than the container has CPUs for.
+  static size_t workers_for(size_t tasks) {
+    return std::min(tasks, available_threads()) - (tasks > 0 ? 1 : 0);
+  }
+
+ private:
+  struct task {
+    void (*run)(void *fn, size_t i);
+    void *fn;
+  };
+
+  size_t run_indices(const task &t, size_t count) {
+    size_t done = 0;
+    for (size_t i = _next.fetch_add(1); i < count; i = _next.fetch_add(1)) {
+      t.run(t.fn, i);
+      done++;
+    }
+    return done;
+  }
+
+  void work() {
+    uint64_t seen_generation = 0;
+    for (;;) {
+      const task *t;
+      size_t count;
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _job_ready.wait(lock, [&]() {
+          return _stopping || (_task != nullptr && _generation != seen_generation);
+        });
+        if (_stopping) {
+          return;
+        }
+        seen_generation = _generation;
+        t = _task;
+        count = _count;
+        _active++;
+      }
+      const size_t done = run_indices(*t, count);
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _pending -= done;
+        _active--;
+        if (_pending == 0 && _active == 0) {
+          _job_done.notify_all();
+        }
+      }
+    }
+  }
+
+  std::vector<std::thread> _threads;
+  std::mutex _mutex;
+  std::condition_variable _job_ready;
+  std::condition_variable _job_done;
+  const task *_task{nullptr};
+  size_t _count{0};
+  std::atomic<size_t> _next{0};
+  size_t _pending{0};
+  size_t _active{0};
+  uint64_t _generation{0};
+  bool _stopping{false};
+};
+
+}  // namespace bot_common
@@ -0,0 +1,246 @@
+#include <bot_common/binary_output.h>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace bo = bot_common::binary_output;
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition, ...)                                  \
+  do {                                                         \
+    if (!(condition)) {                                        \
+      std::fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);     \
+      std::fprintf(stderr, __VA_ARGS__);                       \
+      std::fputc('\n', stderr);                                \
+      failures++;                                              \
+    }                                                          \
+  } while (false)
+
+// Tags of every length encoding: fixed, 8, 16 bit sizes
+const std::string tags[] = {"", "face", std::string(23, 'a'), std::string(24, 'b'),
+                            std::string(31, 'c'), std::string(32, 'd'),
+                            std::string(255, 'e'), std::string(256, 'f'),
+                            std::string(70000, 'g')};
+
+// Values around every integer size boundary of both formats
+const uint64_t boundaries[] = {0,          1,          23,         24,        127,
+                               128,        255,        256,        65535,     65536,
+                               4294967295, 4294967296, 1508452245123};
+
+std::vector<bo::frame> sample_frames() {
+  std::vector<bo::frame> frames;
+
+  bo::frame empty;
+  empty.timestamp_ms = 0;
+  empty.size = cv::Size(640, 480);
+  frames.push_back(empty);
+
+  for (uint64_t timestamp : boundaries) {
+    bo::frame f;
+    f.timestamp_ms = timestamp;
+    f.size = cv::Size(1920, 1080);
+    for (size_t i = 0; i < sizeof(tags) / sizeof(tags[0]); i++) {
+      f.objects.push_back(
+          {static_cast<uint32_t>(timestamp + i),
+           cv::Rect(static_cast<int>(i * 37), static_cast<int>(i * 11), 100, 50 + i),
+           &tags[i]});
+    }
+    frames.push_back(f);
+  }
+
+  // Container sizes of 15, 16 and above 65535 elements
+  for (size_t count : {15, 16, 70000}) {
+    bo::frame f;
+    f.timestamp_ms = count;
+    f.size = cv::Size(320, 240);
+    f.delta = true;
+    f.snapshot = count % 2 == 0;
+    for (size_t i = 0; i < count; i++) {
+      f.objects.push_back({static_cast<uint32_t>(i), cv::Rect(0, 0, 320, 240), &tags[1]});
+      f.removed.push_back(static_cast<uint32_t>(boundaries[i % 10]));
+    }
+    frames.push_back(f);
+  }
+
+  // Boxes sticking out of the frame are clamped to it
+  bo::frame clamped;
+  clamped.timestamp_ms = 7;
+  clamped.size = cv::Size(100, 100);
+  clamped.delta = true;
+  clamped.objects.push_back({1, cv::Rect(-10, 90, 200, 20), &tags[1]});
+  frames.push_back(clamped);
+  return frames;
+}
+
+bool near(double decoded, double expected) {
+  const double clamped = std::min(std::max(expected, 0.0), 1.0);
+  return std::fabs(decoded - clamped) <= 0.5 / bo::fixed_point_one + 1e-12;
+}
+
+void compare(const char *name, const bo::frame &expected, const bo::decoded_frame &actual) {
+  CHECK(actual.timestamp_ms == expected.timestamp_ms, "%s: timestamp %llu instead of %llu",
+        name, static_cast<unsigned long long>(actual.timestamp_ms),
+        static_cast<unsigned long long>(expected.timestamp_ms));
+  CHECK(actual.delta == expected.delta, "%s: delta flag differs", name);
+  CHECK(actual.snapshot == (expected.delta && expected.snapshot),
+        "%s: snapshot flag differs", name);
+  CHECK(actual.removed == expected.removed, "%s: removed ids differ", name);
+  if (actual.objects.size() != expected.objects.size()) {
+    CHECK(false, "%s: %zu objects instead of %zu", name, actual.objects.size(),
+          expected.objects.size());
+    return;
+  }
+  const double width = expected.size.width;
+  const double height = expected.size.height;
+  for (size_t i = 0; i < expected.objects.size(); i++) {
+    const auto &e = expected.objects[i];
+    const auto &a = actual.objects[i];
+    CHECK(a.id == e.id, "%s: object %zu has id %u instead of %u", name, i, a.id, e.id);
+    CHECK(a.tag == *e.tag, "%s: object %zu has another tag", name, i);
+    CHECK(near(a.x, e.rect.x / width) && near(a.y, e.rect.y / height)
+              && near(a.width, e.rect.width / width)
+              && near(a.height, e.rect.height / height),
+          "%s: object %zu has box %g %g %g %g", name, i, a.x, a.y, a.width, a.height);
+  }
+}
+
+void test_round_trip(bo::format format) {
+  const char *name = bo::format_name(format);
+  const std::vector<bo::frame> frames = sample_frames();
+  bo::batcher batch(format, frames.size(), std::chrono::hours(1));
+
+  // Twice, the second batch reuses the buffers of the first
+  for (int round = 0; round < 2; round++) {
+    for (const auto &f : frames) {
+      CHECK(!batch.due(), "%s: batch due before it is full", name);
+      batch.add(f);
+    }
+    CHECK(batch.due(), "%s: full batch isn't due", name);
+    const nlohmann::json envelope = batch.take();
+    CHECK(batch.frames() == 0, "%s: take() didn't start a new batch", name);
+    CHECK(envelope["encoding"] == name, "%s: wrong encoding in the envelope", name);
+    CHECK(envelope["frames"] == frames.size(), "%s: wrong frame count", name);
+
+    // As published: serialized to JSON text and parsed by the receiver
+    std::vector<bo::decoded_frame> decoded;
+    try {
+      decoded = bo::decode(nlohmann::json::parse(envelope.dump()));
+    } catch (const std::exception &e) {
+      CHECK(false, "%s: decode failed: %s", name, e.what());
+      return;
+    }
+    if (decoded.size() != frames.size()) {
+      CHECK(false, "%s: %zu frames decoded instead of %zu", name, decoded.size(),
+            frames.size());
+      return;
+    }
+    for (size_t i = 0; i < frames.size(); i++) {
+      compare(name, frames[i], decoded[i]);
+    }
+
+    // A standard decoder reads the same data
+    const std::vector<uint8_t> data =
+        bo::detail::base64_decode(envelope["data"].get<std::string>());
+    try {
+      const nlohmann::json standard = format == bo::format::cbor
+                                          ? nlohmann::json::from_cbor(data)
+                                          : nlohmann::json::from_msgpack(data);
+      CHECK(standard["v"] == bo::version, "%s: wrong version", name);
+      CHECK(standard["f"].size() == frames.size(), "%s: standard decoder frame count",
+            name);
+      CHECK(standard["f"][1]["t"] == frames[1].timestamp_ms,
+            "%s: standard decoder timestamp", name);
+      CHECK(standard["f"][1]["o"][8][5] == tags[8], "%s: standard decoder tag", name);
+    } catch (const std::exception &e) {
+      CHECK(false, "%s: standard decoder failed: %s", name, e.what());
+    }
+  }
+}
+
+void test_max_delay() {
+  bo::frame f;
+  f.size = cv::Size(10, 10);
+  bo::batcher batch(bo::format::cbor, 100, std::chrono::milliseconds(50));
+  const auto start = bo::batcher::clock::now();
+  CHECK(!batch.due(start + std::chrono::hours(1)), "empty batch is due");
+  batch.add(f);
+  CHECK(!batch.due(start), "batch due before max_delay");
+  CHECK(batch.due(start + std::chrono::seconds(1)), "batch not due after max_delay");
+}
+
+void test_malformed() {
+  for (bo::format format : {bo::format::cbor, bo::format::msgpack}) {
+    const char *name = bo::format_name(format);
+    bo::batcher batch(format, 1, std::chrono::hours(1));
+    batch.add(sample_frames()[1]);
+    const nlohmann::json envelope = batch.take();
+    const std::vector<uint8_t> data =
+        bo::detail::base64_decode(envelope["data"].get<std::string>());
+
+    // Every truncation is rejected, never read past the end
+    for (size_t size = 0; size < data.size(); size++) {
+      bool thrown = false;
+      try {
+        bo::decode(format, std::vector<uint8_t>(data.begin(), data.begin() + size));
+      } catch (const std::runtime_error &) {
+        thrown = true;
+      }
+      CHECK(thrown, "%s: data truncated to %zu bytes decoded", name, size);
+    }
+
+    std::vector<uint8_t> trailing = data;
+    trailing.push_back(0);
+    bool thrown = false;
+    try {
+      bo::decode(format, trailing);
+    } catch (const std::runtime_error &) {
+      thrown = true;
+    }
+    CHECK(thrown, "%s: trailing data decoded", name);
+  }
+
+  bool thrown = false;
+  try {
+    bo::decode(nlohmann::json{{"encoding", "protobuf"}, {"data", ""}});
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  CHECK(thrown, "unknown encoding decoded");
+}
+
+void test_base64() {
+  for (size_t size = 0; size < 10; size++) {
+    std::vector<uint8_t> data;
+    for (size_t i = 0; i < size; i++) {
+      data.push_back(static_cast<uint8_t>(0xfa + i * 71));
+    }
+    const std::string text = bo::detail::base64_encode(data);
+    CHECK(text.size() == (size + 2) / 3 * 4, "base64 of %zu bytes has %zu characters",
+          size, text.size());
+    CHECK(bo::detail::base64_decode(text) == data, "base64 round trip of %zu bytes",
+          size);
+  }
+  CHECK(bo::detail::base64_encode({'f', 'o', 'o', 'b'}) == "Zm9vYg==",
+        "base64 test vector");
+}
+
+}  // namespace
+
+int main() {
+  test_round_trip(bo::format::cbor);
+  test_round_trip(bo::format::msgpack);
+  test_max_delay();
+  test_malformed();
+  test_base64();
+  if (failures > 0) {
+    std::fprintf(stderr, "%d failures\n", failures);
+    return 1;
+  }
+  return 0;
+}
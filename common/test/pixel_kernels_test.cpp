@@ -0,0 +1,90 @@
+#include <bot_common/pixel_kernels.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition, ...)                                  \
+  do {                                                         \
+    if (!(condition)) {                                        \
+      std::fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);     \
+      std::fprintf(stderr, __VA_ARGS__);                       \
+      std::fputc('\n', stderr);                                \
+      failures++;                                              \
+    }                                                          \
+  } while (false)
+
+using convert_fn = void (*)(const uint8_t *, float *, size_t, float, float);
+
+// Converts `pixels` random pixels with fn and with the scalar loop and compares them.
+// The input vector holds exactly the pixels, so a vector loop reading past the end of
+// the row shows up under AddressSanitizer.
+void compare(const char *name, convert_fn fn, size_t pixels, float scale, float offset) {
+  std::vector<uint8_t> bgr(3 * pixels);
+  for (auto &b : bgr) {
+    b = static_cast<uint8_t>(std::rand());
+  }
+  // The guard value after the row checks that nothing is written past its end
+  std::vector<float> expected(3 * pixels + 1, -12345.f);
+  std::vector<float> actual(3 * pixels + 1, -12345.f);
+  bot_common::detail::bgr_to_rgb_float_scalar(bgr.data(), expected.data(), pixels, scale,
+                                              offset);
+  fn(bgr.data(), actual.data(), pixels, scale, offset);
+  for (size_t i = 0; i < expected.size(); i++) {
+    // Tolerates a fused multiply-add in one of the versions
+    const float tolerance = 1e-5f * (std::fabs(expected[i]) + 1);
+    if (std::fabs(expected[i] - actual[i]) > tolerance) {
+      CHECK(false, "%s: %zu pixels, scale %g, offset %g: value %zu is %g instead of %g",
+            name, pixels, scale, offset, i, actual[i], expected[i]);
+      return;
+    }
+  }
+}
+
+void test_bgr_to_rgb_float() {
+  // Widths around the 4 pixel step and the 6 pixel tail of the SSSE3 loop, then rows
+  // of common frame sizes and of odd ones
+  std::vector<size_t> widths;
+  for (size_t w = 0; w <= 41; w++) {
+    widths.push_back(w);
+  }
+  for (size_t w : {227, 299, 320, 321, 639, 640, 641, 1279, 1920}) {
+    widths.push_back(w);
+  }
+  const struct {
+    float scale, offset;
+  } transforms[] = {{1, 0}, {1 / 127.5f, -1}, {1 / 255.f, 0}, {2.5f, 3}, {-0.25f, 17}};
+
+  for (const auto &t : transforms) {
+    for (size_t w : widths) {
+      compare("bgr_to_rgb_float", bot_common::bgr_to_rgb_float, w, t.scale, t.offset);
+#ifdef BOT_COMMON_SSSE3_DISPATCH
+      if (__builtin_cpu_supports("ssse3")) {
+        compare("bgr_to_rgb_float_ssse3", bot_common::detail::bgr_to_rgb_float_ssse3, w,
+                t.scale, t.offset);
+      }
+#endif
+    }
+  }
+}
+
+}  // namespace
+
+int main() {
+  std::srand(42);
+  test_bgr_to_rgb_float();
+#ifdef BOT_COMMON_SSSE3_DISPATCH
+  if (!__builtin_cpu_supports("ssse3")) {
+    std::fprintf(stderr, "SSSE3 is not supported, only the scalar version was tested\n");
+  }
+#endif
+  if (failures > 0) {
+    std::fprintf(stderr, "%d failures\n", failures);
+    return 1;
+  }
+  return 0;
+}
@@ -18,9 +18,11 @@ nlohmann::json process_command(sv::bot_context & /*context*/,
 
 }  // namespace empty_bot
 
+#ifndef BOT_BENCH
 int main(int argc, char *argv[]) {
   sv::bot_register(sv::bot_descriptor{sv::image_pixel_format::BGR,
                                       &empty_bot::process_image,
                                       &empty_bot::process_command});
   return sv::bot_main(argc, argv);
 }
+#endif
@@ -17,8 +17,10 @@ nlohmann::json process_command(sv::bot_context & /*context*/,
 
 }  // namespace empty_opencv_bot
 
+#ifndef BOT_BENCH
 int main(int argc, char *argv[]) {
   sv::opencv_bot_register(
       {&empty_opencv_bot::process_image, &empty_opencv_bot::process_command});
   return sv::opencv_bot_main(argc, argv);
 }
+#endif
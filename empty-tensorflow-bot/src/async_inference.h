@@ -0,0 +1,188 @@
+#pragma once
+
+#include <bot_common/bounded_queue.h>
+#include <bot_common/tracing.h>
+#include <tensorflow/core/framework/tensor.h>
+#include <tensorflow/core/public/session.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef LOGURU_WITH_STREAMS
+#define LOGURU_WITH_STREAMS 1
+#endif
+#include <loguru/loguru.hpp>
+
+namespace empty_tensorflow_bot {
+
+/*
+ * What happens to a frame arriving while the inference queue is full
+ */
+enum class queue_policy {
+  // The oldest queued frame is dropped
+  drop_oldest,
+  // Every queued frame is dropped, the model only sees the newest one
+  keep_latest,
+  // The caller waits for the inference thread to take a frame
+  block
+};
+
+/*
+ * Frame id and timestamp the SDK gave a frame (see satori::video::image_metadata), so
+ * that results published later can be matched with their frame
+ */
+struct frame_origin {
+  int64_t id1{0};
+  int64_t id2{0};
+  std::chrono::system_clock::time_point timestamp;
+};
+
+struct inference_request {
+  tensorflow::Tensor input;
+  uint64_t sequence{0};
+  frame_origin origin;
+  std::chrono::steady_clock::time_point received;
+  // Model to run, kept alive by the request when the bot switches to another one
+  std::shared_ptr<tensorflow::Session> session;
+};
+
+struct inference_result {
+  uint64_t sequence{0};
+  frame_origin origin;
+  std::chrono::steady_clock::time_point received;
+  // Empty if the model failed
+  tensorflow::Tensor output;
+};
+
+/*
+ * Runs the model on a dedicated thread, so that a slow model doesn't hold up decoding.
+ * Frames go through a bounded lock-free queue, results are collected by the caller with
+ * take_results().
+ */
+class async_inference {
+ public:
+  // Model runs are recorded as spans of run_stage.
+  async_inference(std::string output_name, size_t queue_size, queue_policy policy,
+                  bot_common::tracing::tracer &tracer, uint32_t run_stage)
+      : _output_name(std::move(output_name)),
+        _policy(policy),
+        _tracer(tracer),
+        _run_stage(run_stage),
+        _requests(queue_size),
+        _thread([this]() { work(); }) {}
+
+  ~async_inference() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stopping = true;
+    }
+    _request_ready.notify_all();
+    _space_ready.notify_all();
+    _thread.join();
+  }
+
+  async_inference(const async_inference &) = delete;
+  async_inference &operator=(const async_inference &) = delete;
+
+  // Queues a frame according to the policy. Returns the number of frames dropped.
+  size_t submit(inference_request &&request) {
+    size_t dropped = 0;
+    inference_request discarded;
+    if (_policy == queue_policy::keep_latest) {
+      while (_requests.try_pop(discarded)) {
+        dropped++;
+      }
+    }
+    while (!_requests.try_push(std::move(request))) {
+      if (_policy == queue_policy::block) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _space_ready.wait(lock, [this]() {
+          return _stopping || _requests.size() < _requests.capacity();
+        });
+        if (_stopping) {
+          return dropped + 1;
+        }
+      } else if (_requests.try_pop(discarded)) {
+        dropped++;
+      }
+    }
+    // Taking the lock orders the push before a consumer going to sleep
+    { std::lock_guard<std::mutex> lock(_mutex); }
+    _request_ready.notify_one();
+    return dropped;
+  }
+
+  size_t queue_depth() const { return _requests.size(); }
+
+  // Moves the results which are ready into results, oldest first.
+  void take_results(std::vector<inference_result> &results) {
+    results.clear();
+    std::lock_guard<std::mutex> lock(_results_mutex);
+    results.swap(_results);
+  }
+
+ private:
+  void work() {
+    inference_request request;
+    std::vector<tensorflow::Tensor> outputs;
+    for (;;) {
+      if (!_requests.try_pop(request)) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _request_ready.wait(lock, [this]() { return _stopping || !_requests.empty(); });
+        if (_stopping) {
+          return;
+        }
+        // The queue may be non-empty while the producer is still writing the frame
+        lock.unlock();
+        std::this_thread::yield();
+        continue;
+      }
+      if (_policy == queue_policy::block) {
+        { std::lock_guard<std::mutex> lock(_mutex); }
+        _space_ready.notify_one();
+      }
+
+      outputs.clear();
+      tensorflow::Status run_status;
+      {
+        bot_common::tracing::span span(_tracer, _run_stage);
+        run_status = request.session->Run({{"input", request.input}}, {_output_name}, {},
+                                          &outputs);
+      }
+      request.input = tensorflow::Tensor();
+      // May free a replaced model, here rather than on the SDK thread
+      request.session.reset();
+      if (!run_status.ok()) {
+        LOG_S(ERROR) << "Running model failed: " << run_status;
+        outputs.clear();
+      }
+
+      std::lock_guard<std::mutex> lock(_results_mutex);
+      _results.push_back({request.sequence, request.origin, request.received,
+                          outputs.empty() ? tensorflow::Tensor() : outputs[0]});
+    }
+  }
+
+  const std::string _output_name;
+  const queue_policy _policy;
+  bot_common::tracing::tracer &_tracer;
+  const uint32_t _run_stage;
+  bot_common::bounded_queue<inference_request> _requests;
+
+  std::mutex _mutex;
+  std::condition_variable _request_ready;
+  std::condition_variable _space_ready;
+  bool _stopping{false};
+
+  std::mutex _results_mutex;
+  std::vector<inference_result> _results;
+
+  std::thread _thread;
+};
+
+}  // namespace empty_tensorflow_bot
@@ -1,3 +1,15 @@
+#include <bot_common/cpu_quota.h>
+#include <bot_common/hot_swap.h>
+#include <bot_common/model_cache.h>
+#include <bot_common/pixel_kernels.h>
+#include <bot_common/stream_host.h>
+#include <bot_common/tracing.h>
+#include <pthread.h>
+#include <sched.h>
+#include <prometheus/counter.h>
+#include <prometheus/counter_builder.h>
+#include <prometheus/gauge.h>
+#include <prometheus/gauge_builder.h>
 #include <satorivideo/opencv/opencv_bot.h>
 #include <tensorflow/cc/ops/const_op.h>
 #include <tensorflow/cc/ops/image_ops.h>
@@ -8,74 +20,753 @@
 #include <tensorflow/core/platform/logging.h>
 #include <tensorflow/core/platform/types.h>
 #include <tensorflow/core/public/session.h>
-#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <string>
 
 #define LOGURU_WITH_STREAMS 1
 #include <loguru/loguru.hpp>
 
+#include "async_inference.h"
+#include "memmapped_graph.h"
+#include "tensor_pool.h"
+
 namespace sv = satori::video;
 namespace tf = tensorflow;
 
 namespace empty_tensorflow_bot {
 namespace {
+using clock = std::chrono::steady_clock;
+
+constexpr char output_layer[] = "InceptionV3/Predictions/Reshape_1";
+
+// Thrown while parsing a configuration which can't be applied
+struct config_error : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+void check_config(bool condition, const std::string &message) {
+  if (!condition) {
+    throw config_error(message);
+  }
+}
+
+// Frame waiting in a batch for inference
+struct pending_frame {
+  sv::bot_context *context;
+  uint64_t sequence;
+  frame_origin origin;
+};
+
+/*
+ * Frames are converted straight into their slot of the input tensor and the model runs
+ * once the batch is full or its oldest frame has waited max_wait.
+ */
+struct frame_batch {
+  size_t max_size{1};
+  clock::duration max_wait{0};
+  tf::Tensor input;
+  std::vector<pending_frame> frames;
+  clock::time_point oldest_frame_time;
+};
+
+/*
+ * Model input normalization, (value - mean) / std per channel. Defaults match the
+ * InceptionV3 graph, which expects RGB values in [0, 1].
+ */
+struct input_normalization {
+  float mean{0};
+  float std{255};
+};
+
 struct state {
-  std::unique_ptr<tf::Session> session;
+  explicit state(sv::bot_context &context)
+      : queue_depth(prometheus::BuildGauge()
+                        .Name("inference_queue_depth")
+                        .Register(context.metrics.registry)
+                        .Add({})),
+        frames_dropped(prometheus::BuildCounter()
+                           .Name("inference_frames_dropped")
+                           .Register(context.metrics.registry)
+                           .Add({})),
+        tracer(context.metrics.registry),
+        frame_stage(tracer.add_stage("frame", "inference_frame_seconds")),
+        convert_stage(tracer.add_stage("convert", "inference_convert_seconds")),
+        run_stage(tracer.add_stage("run", "inference_run_seconds")),
+        latency_stage(tracer.add_stage("latency", "inference_latency_seconds")) {}
+
+  /*
+   * Shared with the asynchronous requests and the host workers using it, see hot_swap.
+   * Replaced on the SDK thread with std::atomic_store, host workers read it with
+   * std::atomic_load.
+   */
+  std::shared_ptr<tf::Session> session;
+  input_normalization normalization;
+  tensor_pool inputs;
+  frame_batch batch;
+  uint64_t frame_sequence{0};
+
+  prometheus::Gauge &queue_depth;
+  prometheus::Counter &frames_dropped;
+
+  // Stage timers, spans of a frame are reported at the start of the next one
+  bot_common::tracing::tracer tracer;
+  const uint32_t frame_stage;
+  const uint32_t convert_stage;
+  const uint32_t run_stage;
+  // From the frame's arrival to the publication of its result, in asynchronous mode
+  const uint32_t latency_stage;
+
+  // Set in asynchronous mode, the model then runs on its own thread. Declared after
+  // them, so that the thread stops before the session and the tracer go away.
+  std::unique_ptr<async_inference> async;
+  std::vector<inference_result> results;
+  // Loads the models of later configurations
+  std::unique_ptr<bot_common::hot_swap<tf::Session>> sessions;
+
+  /*
+   * Host mode: more streams, classified on the host workers with the same session.
+   * Session::Run can be called concurrently; every worker converts frames into tensors
+   * of its own pool. Declared last, so that the workers stop before what they use.
+   */
+  std::vector<tensor_pool> host_inputs;
+  // Frame sequence numbers of every hosted stream
+  std::vector<uint64_t> host_sequences;
+  std::vector<bot_common::stream_host::result> host_results;
+  uint64_t host_dropped_results{0};
+  std::unique_ptr<bot_common::stream_host> host;
 };
 }  // namespace
 
-tf::Tensor mat_to_tensor(const cv::Mat &frame) {
-  tf::Tensor image_tensor(tf::DT_FLOAT, tf::TensorShape({1, frame.cols, frame.rows, 3}));
-  float *new_buffer = image_tensor.flat<float>().data();
-  cv::Mat new_img(frame.rows, frame.cols, CV_32FC3, new_buffer);
-  frame.convertTo(new_img, CV_32FC3);
+// Converts BGR frame into slot `index` of a {N, height, width, 3} RGB float tensor
+void mat_to_tensor_slot(const cv::Mat &frame, const input_normalization &normalization,
+                        tf::Tensor &tensor, size_t index) {
+  CHECK_EQ_S(frame.type(), CV_8UC3) << "unexpected frame type";
+  const size_t row_pixels = static_cast<size_t>(frame.cols);
+  float *slot = tensor.flat<float>().data() + index * frame.rows * row_pixels * 3;
+  const float scale = 1.0f / normalization.std;
+  const float offset = -normalization.mean / normalization.std;
+
+  if (frame.isContinuous()) {
+    bot_common::bgr_to_rgb_float(frame.data, slot, frame.rows * row_pixels, scale,
+                                 offset);
+    return;
+  }
+  for (int row = 0; row < frame.rows; row++) {
+    bot_common::bgr_to_rgb_float(frame.ptr<uint8_t>(row), slot + row * row_pixels * 3,
+                                 row_pixels, scale, offset);
+  }
+}
+
+tf::Tensor mat_to_tensor(state &s, const cv::Mat &frame) {
+  bot_common::tracing::span span(s.tracer, s.convert_stage);
+  tf::Tensor image_tensor =
+      s.inputs.acquire(tf::TensorShape({1, frame.rows, frame.cols, 3}));
+  mat_to_tensor_slot(frame, s.normalization, image_tensor, 0);
   return image_tensor;
 }
 
-void process_image(sv::bot_context &context, const cv::Mat &frame) {
-  auto *s = (state *)context.instance_data;
-  tf::Tensor image_tensor = mat_to_tensor(frame);
-  // use image_tensor
+// Id and timestamp of the frame the SDK is currently processing
+frame_origin current_frame(const sv::bot_context &context) {
+  const sv::image_metadata &metadata = *context.frame_metadata;
+  return {metadata.id.i1, metadata.id.i2, metadata.timestamp};
+}
+
+/*
+ * Analysis message of a frame: its sequence number and the most likely class, e.g.
+ * {"frame": 42, "class": 282, "score": 0.93}. Null if the output is empty.
+ */
+nlohmann::json classification(uint64_t sequence, const tf::Tensor &output) {
+  if (output.NumElements() == 0) {
+    return nullptr;
+  }
+  const auto scores = output.flat<float>();
+  tf::int64 best = 0;
+  for (tf::int64 i = 1; i < scores.size(); i++) {
+    if (scores(i) > scores(best)) {
+      best = i;
+    }
+  }
+  return {{"frame", sequence}, {"class", best}, {"score", scores(best)}};
+}
+
+/*
+ * Adds the SDK id and timestamp of the frame to its analysis message, e.g.
+ * "frameId": [51900, 51900], "frameTimestampMs": 1514764800000. Results of batched and
+ * queued frames are published while the SDK processes a later frame.
+ */
+void add_origin(nlohmann::json &message, const frame_origin &origin) {
+  message["frameId"] = {origin.id1, origin.id2};
+  message["frameTimestampMs"] = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                    origin.timestamp.time_since_epoch())
+                                    .count();
+}
+
+// Publishes the model output for one frame
+void process_result(sv::bot_context &context, uint64_t sequence,
+                    const frame_origin &origin, const tf::Tensor &output) {
+  nlohmann::json message = classification(sequence, output);
+  if (!message.is_null()) {
+    add_origin(message, origin);
+    sv::bot_message(context, sv::bot_message_kind::ANALYSIS, std::move(message));
+  }
+}
+
+/*
+ * Runs the model on every frame of the batch with a single Session::Run call and
+ * splits the output back per frame.
+ */
+void run_batch(state &s) {
+  frame_batch &b = s.batch;
+  if (b.frames.empty()) {
+    return;
+  }
+
+  const tf::Tensor input = b.input.Slice(0, b.frames.size());
   std::vector<tf::Tensor> outputs;
-  tf::Status run_status = s->session->Run(
-      {{"input", image_tensor}}, {"InceptionV3/Predictions/Reshape_1"}, {}, &outputs);
+  tf::Status run_status;
+  {
+    bot_common::tracing::span span(s.tracer, s.run_stage);
+    run_status = s.session->Run({{"input", input}}, {output_layer}, {}, &outputs);
+  }
   if (!run_status.ok()) {
-    std::cerr << "Running model failed: " << run_status << "\n";
+    LOG_S(ERROR) << "Running model failed: " << run_status;
+  } else {
+    for (size_t i = 0; i < b.frames.size(); i++) {
+      process_result(*b.frames[i].context, b.frames[i].sequence, b.frames[i].origin,
+                     outputs[0].Slice(i, i + 1));
+    }
+  }
+  b.frames.clear();
+  b.input = tf::Tensor();
+}
+
+// Runs a partial batch whose oldest frame has waited max_wait, without a new frame.
+void run_overdue_batch(state &s) {
+  const frame_batch &b = s.batch;
+  if (!b.frames.empty() && clock::now() - b.oldest_frame_time >= b.max_wait) {
+    run_batch(s);
+  }
+}
+
+/*
+ * Publishes the results the inference thread has finished since the previous frame,
+ * as the most likely class of each frame. Runs on the SDK thread, like every other
+ * callback touching the context.
+ */
+void publish_async_results(sv::bot_context &context, state &s) {
+  s.async->take_results(s.results);
+  const auto now = clock::now();
+  for (const auto &result : s.results) {
+    s.tracer.record(s.latency_stage, result.received, now);
+    nlohmann::json message = classification(result.sequence, result.output);
+    if (message.is_null()) {
+      continue;
+    }
+    add_origin(message, result.origin);
+    message["latencyMs"] =
+        std::chrono::duration<double, std::milli>(now - result.received).count();
+    sv::bot_message(context, sv::bot_message_kind::ANALYSIS, std::move(message));
+  }
+}
+
+// Classifies a frame of a hosted stream, on a host worker.
+void process_hosted(state &s, size_t stream, size_t worker, const cv::Mat &frame,
+                    std::vector<nlohmann::json> &messages) {
+  const uint64_t sequence = s.host_sequences[stream]++;
+  const std::shared_ptr<tf::Session> session = std::atomic_load(&s.session);
+  tf::Tensor input;
+  {
+    bot_common::tracing::span span(s.tracer, s.convert_stage);
+    const tf::TensorShape shape({1, frame.rows, frame.cols, 3});
+    input = s.host_inputs[worker].acquire(shape);
+    mat_to_tensor_slot(frame, s.normalization, input, 0);
+  }
+  std::vector<tf::Tensor> outputs;
+  tf::Status run_status;
+  {
+    bot_common::tracing::span span(s.tracer, s.run_stage);
+    run_status = session->Run({{"input", input}}, {output_layer}, {}, &outputs);
+  }
+  if (!run_status.ok()) {
+    LOG_S(ERROR) << "Running model failed: " << run_status;
+    return;
+  }
+  nlohmann::json message = classification(sequence, outputs[0]);
+  if (!message.is_null()) {
+    messages.push_back(std::move(message));
+  }
+}
+
+/*
+ * Publishes the results of the hosted streams, with the stream id. Runs on the SDK
+ * thread like publish_async_results().
+ */
+void publish_hosted_results(sv::bot_context &context, state &s) {
+  s.host->take_results(s.host_results);
+  for (auto &result : s.host_results) {
+    result.message["stream"] = s.host->sources()[result.stream].id;
+    sv::bot_message(context, sv::bot_message_kind::ANALYSIS, std::move(result.message));
+  }
+  const uint64_t dropped = s.host->dropped_results();
+  if (dropped != s.host_dropped_results) {
+    LOG_S(WARNING) << "Dropped " << dropped - s.host_dropped_results
+                   << " results of hosted streams, the input is too slow to publish them";
+    s.host_dropped_results = dropped;
+  }
+}
+
+/*
+ * Session threading: "threads": {"intraOp": 2, "interOp": 1, "affinity": [0, 1]}.
+ * Thread counts default to the whole CPUs the container may use, so that a fractional
+ * CPU limit doesn't get one thread per host core.
+ *
+ * Threads only apply at startup: sessions share the process thread pools, which are sized
+ * by the first one, and the affinity is set on the SDK thread before the other threads of
+ * the bot start. A model loaded later ignores them.
+ */
+tf::SessionOptions session_options(const nlohmann::json &body, bool startup) {
+  tf::SessionOptions options;
+  if (!startup) {
+    if (body.find("threads") != body.end()) {
+      LOG_S(WARNING) << "threads only apply at startup, ignored: " << body["threads"];
+    }
+    return options;
+  }
+
+  size_t cpus = bot_common::available_threads();
+  int64_t intra_op = 0;
+  int64_t inter_op = 1;
+
+  if (body.find("threads") != body.end()) {
+    auto &threads = body["threads"];
+    check_config(threads.is_object(), "threads is not an object: " + body.dump());
+    if (threads.find("affinity") != threads.end()) {
+      auto &affinity = threads["affinity"];
+      check_config(affinity.is_array() && !affinity.empty(),
+                   "affinity is not a list of CPUs: " + body.dump());
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (auto &cpu : affinity) {
+        check_config(cpu.is_number_unsigned() && cpu < CPU_SETSIZE,
+                     "affinity is not a list of CPUs: " + body.dump());
+        CPU_SET(cpu.get<int>(), &set);
+      }
+      // Threads inherit the affinity of the thread creating them, so this also pins
+      // the session thread pools, the inference thread and the model loading thread.
+      const int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+      CHECK_EQ_S(error, 0) << "can't set CPU affinity: " << std::strerror(error);
+      cpus = std::min(cpus, static_cast<size_t>(CPU_COUNT(&set)));
+    }
+    if (threads.find("intraOp") != threads.end()) {
+      check_config(threads["intraOp"].is_number_unsigned() && threads["intraOp"] > 0,
+                   "intraOp is not a positive integer: " + body.dump());
+      intra_op = threads["intraOp"];
+    }
+    if (threads.find("interOp") != threads.end()) {
+      check_config(threads["interOp"].is_number_unsigned() && threads["interOp"] > 0,
+                   "interOp is not a positive integer: " + body.dump());
+      inter_op = threads["interOp"];
+    }
+  }
+  if (intra_op == 0) {
+    intra_op = static_cast<int64_t>(cpus);
+  }
+
+  LOG_S(INFO) << "session threads: intra-op " << intra_op << ", inter-op " << inter_op;
+  options.config.set_intra_op_parallelism_threads(static_cast<tf::int32>(intra_op));
+  options.config.set_inter_op_parallelism_threads(static_cast<tf::int32>(inter_op));
+  return options;
+}
+
+/*
+ * Warm-up before reporting ready: "warmup": {"runs": 1, "width": 299, "height": 299}.
+ * The size should be the input resolution of the bot; "runs": 0 disables warm-up.
+ */
+struct warmup_settings {
+  int runs{1};
+  int width{299};
+  int height{299};
+};
+
+warmup_settings parse_warmup(const nlohmann::json &body) {
+  warmup_settings settings;
+  if (body.find("warmup") != body.end()) {
+    auto &warmup = body["warmup"];
+    check_config(warmup.is_object(), "warmup is not an object: " + body.dump());
+    if (warmup.find("runs") != warmup.end()) {
+      check_config(warmup["runs"].is_number_unsigned(),
+                   "runs is not a positive integer: " + body.dump());
+      settings.runs = warmup["runs"];
+    }
+    if (warmup.find("width") != warmup.end()) {
+      check_config(warmup["width"].is_number_unsigned() && warmup["width"] > 0,
+                   "width is not a positive integer: " + body.dump());
+      settings.width = warmup["width"];
+    }
+    if (warmup.find("height") != warmup.end()) {
+      check_config(warmup["height"].is_number_unsigned() && warmup["height"] > 0,
+                   "height is not a positive integer: " + body.dump());
+      settings.height = warmup["height"];
+    }
+  }
+  return settings;
+}
+
+/*
+ * Runs the model on blank frames before the first live one, so that graph optimizations
+ * and the first allocations don't land on a live frame.
+ */
+void warm_up(tf::Session &session, tf::Tensor input, int runs) {
+  const auto start = clock::now();
+  input.flat<float>().setZero();
+  std::vector<tf::Tensor> outputs;
+  for (int i = 0; i < runs; i++) {
+    outputs.clear();
+    tf::Status run_status = session.Run({{"input", input}}, {output_layer}, {}, &outputs);
+    if (!run_status.ok()) {
+      LOG_S(WARNING) << "warm-up failed: " << run_status;
+      return;
+    }
+  }
+  LOG_S(INFO) << "warm-up took "
+              << std::chrono::duration<double, std::milli>(clock::now() - start).count()
+              << "ms";
+}
+
+/*
+ * Optional model cache: "modelCache": "/var/cache/bots" converts graph_path to a memory
+ * mapped package (see memmapped_graph.h) stored under the hash of its content, and loads
+ * the package instead. Only the first replica starting a new model pays the conversion.
+ * Returns false, leaving env unused, if the package can't be made.
+ */
+bool load_cached_graph(const std::string &directory, const std::string &graph_path,
+                       tf::MemmappedEnv &env, tf::GraphDef &graph_def) {
+  std::string entry;
+  {
+    bot_common::mapped_file source(graph_path);
+    if (!source.is_open()) {
+      return false;
+    }
+    entry = bot_common::model_cache(directory).path(bot_common::content_hash(source),
+                                                    ".mmpb");
+  }
+  if (!bot_common::model_cache::contains(entry)) {
+    LOG_S(INFO) << "caching graph " << graph_path << " as " << entry;
+    tf::GraphDef frozen;
+    tf::Status status = tf::ReadBinaryProto(tf::Env::Default(), graph_path, &frozen);
+    const bool stored =
+        bot_common::model_cache::store(entry, [&](const std::string &temporary) {
+          if (status.ok()) {
+            status = write_memmapped_graph(frozen, temporary);
+          }
+          return status.ok();
+        });
+    if (!stored) {
+      LOG_S(WARNING) << "can't cache graph " << graph_path << ": "
+                     << (status.ok() ? "can't write to " + directory : status.ToString());
+      return false;
+    }
+  }
+  tf::Status status = read_memmapped_graph(entry, env, graph_def);
+  if (!status.ok()) {
+    LOG_S(WARNING) << "can't read cached graph " << entry << ": " << status;
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Loads graph_path into a new session. Returns null if the graph can't be loaded, throws
+ * config_error (or a json exception) if the settings are invalid.
+ */
+std::shared_ptr<tf::Session> load_session(const nlohmann::json &body, bool startup) {
+  tf::SessionOptions options = session_options(body, startup);
+  tf::GraphDef graph_def;
+  check_config(body.find("graph_path") == body.end() || body["graph_path"].is_string(),
+               "graph_path is not a string: " + body.dump());
+  const std::string graph_path = (body.find("graph_path") != body.end())
+                                     ? body["graph_path"]
+                                     : "inception_v3_2016_08_28_frozen.pb";
+  // Holds the weight mappings of a cached graph, released with the session
+  std::shared_ptr<tf::MemmappedEnv> env;
+  if (body.find("modelCache") != body.end()) {
+    check_config(body["modelCache"].is_string(),
+                 "modelCache is not a directory: " + body.dump());
+    env = std::make_shared<tf::MemmappedEnv>(tf::Env::Default());
+    if (load_cached_graph(body["modelCache"], graph_path, *env, graph_def)) {
+      options.env = env.get();
+      // Constant folding would copy the mapped weights into every replica
+      options.config.mutable_graph_options()->mutable_optimizer_options()->set_opt_level(
+          tf::OptimizerOptions::L0);
+    } else {
+      env.reset();
+    }
+  }
+  if (!env) {
+    tf::Status load_graph_status =
+        tf::ReadBinaryProto(tf::Env::Default(), graph_path, &graph_def);
+    if (!load_graph_status.ok()) {
+      LOG_S(ERROR) << "Failed to load graph at '" << graph_path
+                   << "': " << load_graph_status;
+      return nullptr;
+    }
+  }
+  std::shared_ptr<tf::Session> session(tf::NewSession(options),
+                                       [env](tf::Session *created) { delete created; });
+  tf::Status create_status = session->Create(graph_def);
+  if (!create_status.ok()) {
+    LOG_S(ERROR) << "Failed to create graph: " << create_status;
+    return nullptr;
+  }
+  LOG_S(INFO) << "loaded graph " << graph_path << (env ? " from the model cache" : "");
+  return session;
+}
+
+/*
+ * Builds the session of a new configuration on the hot_swap thread, warm-up included, so
+ * that frames keep running on the current model meanwhile. A graph which can't be
+ * loaded or invalid settings leave the current model in place.
+ */
+std::shared_ptr<tf::Session> reload_session(const nlohmann::json &body) {
+  std::shared_ptr<tf::Session> session;
+  warmup_settings warmup;
+  try {
+    warmup = parse_warmup(body);
+    session = load_session(body, false);
+  } catch (const std::exception &e) {
+    LOG_S(ERROR) << "Invalid configuration, keeping the current model: " << e.what();
+    return nullptr;
+  }
+  if (session && warmup.runs > 0) {
+    warm_up(*session, tf::Tensor(tf::DT_FLOAT, tf::TensorShape({1, warmup.height,
+                                                               warmup.width, 3})),
+            warmup.runs);
+  }
+  return session;
+}
+
+void process_image(sv::bot_context &context, const cv::Mat &frame) {
+  const auto received = clock::now();
+  auto *s = (state *)context.instance_data;
+  s->tracer.flush();
+  bot_common::tracing::span frame_span(s->tracer, s->frame_stage);
+  frame_batch &b = s->batch;
+  run_overdue_batch(*s);
+  if (auto next = s->sessions->take()) {
+    // Frames already queued or batched still run on the model they were converted for
+    run_batch(*s);
+    s->sessions->retire(std::atomic_exchange(&s->session, std::move(next)));
+    LOG_S(INFO) << "model replaced";
+  }
+
+  if (s->host) {
+    publish_hosted_results(context, *s);
+  }
+
+  if (s->async) {
+    publish_async_results(context, *s);
+    const size_t dropped = s->async->submit(
+        {mat_to_tensor(*s, frame), s->frame_sequence++, current_frame(context), received,
+         s->session});
+    s->frames_dropped.Increment(dropped);
+    s->queue_depth.Set(s->async->queue_depth());
     return;
   }
-  std::cout << "output tensor size = " << outputs[0].TotalBytes() << "\n";
+
+  if (b.max_size == 1) {
+    tf::Tensor image_tensor = mat_to_tensor(*s, frame);
+    // use image_tensor
+    std::vector<tf::Tensor> outputs;
+    tf::Status run_status;
+    {
+      bot_common::tracing::span span(s->tracer, s->run_stage);
+      run_status =
+          s->session->Run({{"input", image_tensor}}, {output_layer}, {}, &outputs);
+    }
+    if (!run_status.ok()) {
+      LOG_S(ERROR) << "Running model failed: " << run_status;
+      return;
+    }
+    process_result(context, s->frame_sequence++, current_frame(context), outputs[0]);
+    return;
+  }
+
+  const tf::TensorShape shape(
+      {static_cast<tf::int64>(b.max_size), frame.rows, frame.cols, 3});
+  if (!b.input.shape().IsSameSize(shape)) {
+    run_batch(*s);
+  }
+
+  if (b.frames.empty()) {
+    b.input = s->inputs.acquire(shape);
+    b.oldest_frame_time = clock::now();
+  }
+  {
+    bot_common::tracing::span span(s->tracer, s->convert_stage);
+    mat_to_tensor_slot(frame, s->normalization, b.input, b.frames.size());
+  }
+  b.frames.push_back({&context, s->frame_sequence++, current_frame(context)});
+
+  if (b.frames.size() == b.max_size || clock::now() - b.oldest_frame_time >= b.max_wait) {
+    run_batch(*s);
+  }
 }
 
 nlohmann::json process_command(sv::bot_context &ctx, const nlohmann::json &config) {
   CHECK_S(config.is_object()) << "config is not an object: " << config;
+  if (config.find("ack") != config.end()) {
+    // Our own acknowledgement, back from the control channel
+    return nullptr;
+  }
   CHECK_S(config.find("action") != config.end()) << "no action in config: " << config;
 
   auto &action = config["action"];
   CHECK_S(action.is_string()) << "action is not a string: " << config;
 
+  auto *running = static_cast<state *>(ctx.instance_data);
+  if (running != nullptr) {
+    run_overdue_batch(*running);
+    if (running->host) {
+      publish_hosted_results(ctx, *running);
+    }
+  }
+  if (action == "shutdown") {
+    // The input is over: the last partial batch and finished requests go out now
+    if (running != nullptr) {
+      run_batch(*running);
+      if (running->async) {
+        publish_async_results(ctx, *running);
+      }
+    }
+    return nullptr;
+  }
+
   if (action == "configure") {
     CHECK_S(config.find("body") != config.end()) << "no body in config: " << config;
     auto &body = config["body"];
     CHECK_S(body.is_object()) << "body is not an object: " << body;
 
-    auto *s = new state;
-    tf::GraphDef graph_def;
-    s->session.reset(tf::NewSession(tf::SessionOptions()));
+    if (running != nullptr) {
+      /*
+       * Reconfiguration: the model of graph_path (with "threads" and "warmup") is loaded
+       * in the background and replaces the current one between two frames. Other
+       * settings only apply at startup.
+       */
+      running->sessions->request(body);
+      LOG_S(INFO) << "Reloading model: " << body;
+      if (config.find("to") != config.end()) {
+        return {{"ack", true}, {"to", config["to"]}, {"action", "configure"}};
+      }
+      return nullptr;
+    }
 
-    const std::string graph_path = (body.find("graph_path") != body.end())
-                                       ? body["graph_path"]
-                                       : "inception_v3_2016_08_28_frozen.pb";
-    tf::Status load_graph_status =
-        tf::ReadBinaryProto(tf::Env::Default(), graph_path, &graph_def);
-    if (!load_graph_status.ok()) {
-      std::cerr << "Failed to load graph at '" << graph_path << "'" << load_graph_status
-                << "\n";
-      exit(1);
+    auto *s = new state(ctx);
+    warmup_settings warmup;
+    try {
+      warmup = parse_warmup(body);
+      s->session = load_session(body, true);
+    } catch (const std::exception &e) {
+      ABORT_S() << "Invalid configuration: " << e.what();
     }
-    tf::Status create_status = s->session->Create(graph_def);
-    if (!create_status.ok()) {
-      std::cerr << "Failed to create graph " << create_status << "\n";
+    if (!s->session) {
       exit(1);
     }
+    if (body.find("inputMean") != body.end()) {
+      CHECK_S(body["inputMean"].is_number()) << "inputMean is not a number: " << body;
+      s->normalization.mean = body["inputMean"];
+    }
+    if (body.find("inputStd") != body.end()) {
+      CHECK_S(body["inputStd"].is_number() && body["inputStd"] > 0)
+          << "inputStd is not a positive number: " << body;
+      s->normalization.std = body["inputStd"];
+    }
+    /*
+     * Optional batching: "batch": {"maxSize": 8, "maxWaitMs": 50} runs the model once for
+     * up to 8 frames, or for the frames received within 50ms of the oldest one.
+     */
+    if (body.find("batch") != body.end()) {
+      auto &batch = body["batch"];
+      CHECK_S(batch.is_object()) << "batch is not an object: " << body;
+      if (batch.find("maxSize") != batch.end()) {
+        CHECK_S(batch["maxSize"].is_number_unsigned() && batch["maxSize"] > 0)
+            << "maxSize is not a positive integer: " << body;
+        s->batch.max_size = batch["maxSize"];
+      }
+      if (batch.find("maxWaitMs") != batch.end()) {
+        CHECK_S(batch["maxWaitMs"].is_number_unsigned())
+            << "maxWaitMs is not a positive integer: " << body;
+        s->batch.max_wait = std::chrono::milliseconds(batch["maxWaitMs"].get<int64_t>());
+      }
+    }
+    /*
+     * Warm-up runs on a whole batch, the shape of the live runs. Its input tensor goes
+     * back to the pool, so if the warm-up size is the input resolution, the first frames
+     * reuse it; frames of another size start a new pool.
+     */
+    if (warmup.runs > 0) {
+      const tf::TensorShape shape({static_cast<tf::int64>(s->batch.max_size),
+                                   warmup.height, warmup.width, 3});
+      warm_up(*s->session, s->inputs.acquire(shape), warmup.runs);
+    }
+    /*
+     * Optional asynchronous mode: "async": {"queueSize": 2, "policy": "keepLatest"} runs
+     * the model on a dedicated thread fed through a queue of up to 2 frames. The policy
+     * decides what happens to a frame arriving while the queue is full: "dropOldest",
+     * "keepLatest" (drop every queued frame) or "block" (wait for room).
+     */
+    if (body.find("async") != body.end()) {
+      auto &async = body["async"];
+      CHECK_S(async.is_object()) << "async is not an object: " << body;
+      CHECK_S(s->batch.max_size == 1) << "async and batch can't be combined: " << body;
+      size_t queue_size = 2;
+      if (async.find("queueSize") != async.end()) {
+        CHECK_S(async["queueSize"].is_number_unsigned() && async["queueSize"] > 0)
+            << "queueSize is not a positive integer: " << body;
+        queue_size = async["queueSize"];
+      }
+      queue_policy policy = queue_policy::keep_latest;
+      if (async.find("policy") != async.end()) {
+        const auto &name = async["policy"];
+        if (name == "dropOldest") {
+          policy = queue_policy::drop_oldest;
+        } else if (name == "keepLatest") {
+          policy = queue_policy::keep_latest;
+        } else if (name == "block") {
+          policy = queue_policy::block;
+        } else {
+          ABORT_S() << "unknown async policy: " << body;
+        }
+      }
+      s->async = std::make_unique<async_inference>(output_layer, queue_size, policy,
+                                                   s->tracer, s->run_stage);
+    }
+    s->sessions = std::make_unique<bot_common::hot_swap<tf::Session>>(&reload_session);
+    /*
+     * Optional host mode: "streams": {"sources": [{"id": "lobby", "url": "rtsp://..."}],
+     * "threads": 4, "maxPending": 2, "maxResults": 1000} classifies more streams with
+     * the same model, see stream_host.
+     */
+    if (body.find("streams") != body.end()) {
+      bot_common::stream_host::settings settings;
+      try {
+        settings = bot_common::stream_host::parse_settings(body["streams"]);
+      } catch (const std::exception &e) {
+        ABORT_S() << "Invalid configuration: " << e.what();
+      }
+      s->host_inputs.resize(settings.threads);
+      s->host_sequences.assign(settings.sources.size(), 0);
+      s->host.reset(new bot_common::stream_host(
+          std::move(settings),
+          [s](size_t stream, size_t worker, const cv::Mat &frame,
+              std::vector<nlohmann::json> &messages) {
+            process_hosted(*s, stream, worker, frame, messages);
+          }));
+      LOG_S(INFO) << "Hosting " << s->host->sources().size() << " streams on "
+                  << s->host->workers() << " threads";
+    }
     ctx.instance_data = s;
   }
   return nullptr;
@@ -83,9 +774,11 @@ nlohmann::json process_command(sv::bot_context &ctx, const nlohmann::json &confi
 
 }  // namespace empty_tensorflow_bot
 
+#ifndef BOT_BENCH
 int main(int argc, char *argv[]) {
   tf::port::InitMain(argv[0], &argc, &argv);
   sv::opencv_bot_register(
       {&empty_tensorflow_bot::process_image, &empty_tensorflow_bot::process_command});
   return sv::opencv_bot_main(argc, argv);
 }
+#endif
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <tensorflow/core/framework/graph.pb.h>
+#include <tensorflow/core/framework/node_def.pb.h>
+#include <tensorflow/core/framework/tensor.h>
+#include <tensorflow/core/framework/tensor_shape.pb.h>
+#include <tensorflow/core/platform/env.h>
+#include <tensorflow/core/util/memmapped_file_system.h>
+#include <tensorflow/core/util/memmapped_file_system_writer.h>
+#include <cctype>
+#include <string>
+
+namespace empty_tensorflow_bot {
+
+/*
+ * Frozen graphs in TensorFlow's memory mapped package format, as made by
+ * convert_graphdef_memmapped_format: the weights of large Const nodes are stored as raw
+ * tensors and the nodes become ImmutableConst nodes pointing at them. Loading such a
+ * graph parses a protobuf without weights and maps the weights instead of copying them,
+ * so bot replicas running the same model share them through the page cache.
+ */
+
+// Const tensors smaller than this stay in the graph.
+constexpr size_t memmapped_min_tensor_bytes = 10000;
+
+/*
+ * Region names may only hold letters, digits, '_' and '.'; the node index keeps names
+ * which only differed by other characters apart.
+ */
+inline std::string memmapped_region_name(const std::string &node_name, int index) {
+  std::string region = tensorflow::MemmappedFileSystem::kMemmappedPackagePrefix;
+  for (const char c : node_name) {
+    region += (std::isalnum(static_cast<unsigned char>(c)) || c == '.') ? c : '_';
+  }
+  return region + "_" + std::to_string(index);
+}
+
+// Writes graph (modified in place) to path as a memory mapped package.
+inline tensorflow::Status write_memmapped_graph(tensorflow::GraphDef &graph,
+                                                const std::string &path) {
+  tensorflow::MemmappedFileSystemWriter writer;
+  TF_RETURN_IF_ERROR(writer.InitializeToFile(tensorflow::Env::Default(), path));
+  for (int i = 0; i < graph.node_size(); i++) {
+    tensorflow::NodeDef &node = *graph.mutable_node(i);
+    if (node.op() != "Const") {
+      continue;
+    }
+    const auto value = node.attr().find("value");
+    if (value == node.attr().end()) {
+      continue;
+    }
+    tensorflow::Tensor tensor;
+    if (!tensor.FromProto(value->second.tensor())
+        || tensor.dtype() == tensorflow::DT_STRING
+        || tensor.TotalBytes() < memmapped_min_tensor_bytes) {
+      continue;
+    }
+    const std::string region = memmapped_region_name(node.name(), i);
+    TF_RETURN_IF_ERROR(writer.SaveTensor(tensor, region));
+
+    const tensorflow::AttrValue dtype = node.attr().at("dtype");
+    node.set_op("ImmutableConst");
+    node.mutable_attr()->clear();
+    (*node.mutable_attr())["dtype"] = dtype;
+    tensor.shape().AsProto((*node.mutable_attr())["shape"].mutable_shape());
+    (*node.mutable_attr())["memory_region_name"].set_s(region);
+  }
+  TF_RETURN_IF_ERROR(writer.SaveProtobuf(
+      graph, tensorflow::MemmappedFileSystem::kMemmappedPackageDefaultGraphDef));
+  return writer.FlushAndClose();
+}
+
+/*
+ * Opens a memory mapped package. The session running graph must use env (see
+ * SessionOptions::env), which must outlive it.
+ */
+inline tensorflow::Status read_memmapped_graph(const std::string &path,
+                                               tensorflow::MemmappedEnv &env,
+                                               tensorflow::GraphDef &graph) {
+  TF_RETURN_IF_ERROR(env.InitializeFromFile(path));
+  return tensorflow::ReadBinaryProto(
+      &env, tensorflow::MemmappedFileSystem::kMemmappedPackageDefaultGraphDef, &graph);
+}
+
+}  // namespace empty_tensorflow_bot
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <tensorflow/core/framework/tensor.h>
+#include <vector>
+
+namespace empty_tensorflow_bot {
+
+/*
+ * Input tensors reused from frame to frame. A tensor is handed out again once every copy
+ * returned by acquire() (including slices) is gone, so the pool grows to the number of
+ * tensors in flight and then stops allocating. Changing the shape drops the pool.
+ */
+class tensor_pool {
+ public:
+  tensorflow::Tensor acquire(const tensorflow::TensorShape &shape) {
+    if (!_shape.IsSameSize(shape)) {
+      _tensors.clear();
+      _shape = shape;
+    }
+    for (const auto &tensor : _tensors) {
+      if (tensor.RefCountIsOne()) {
+        return tensor;
+      }
+    }
+    _tensors.emplace_back(tensorflow::DT_FLOAT, shape);
+    return _tensors.back();
+  }
+
+  size_t size() const { return _tensors.size(); }
+
+ private:
+  tensorflow::TensorShape _shape;
+  std::vector<tensorflow::Tensor> _tensors;
+};
+
+}  // namespace empty_tensorflow_bot
@@ -0,0 +1,318 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define FRAME_QUALITY_X86_DISPATCH 1
+#endif
+
+namespace frame_quality_bot {
+
+/*
+ * Kernels over rows of 8-bit pixels, in the style of bot_common/pixel_kernels.h: the
+ * luma conversion picks AVX2 or SSSE3 at run time, the sums are compiled for AVX2 when
+ * built with -mavx2 and for SSE2 on any x86-64. Other targets use the scalar loops.
+ *
+ * Luma is BT.601, (29 B + 150 G + 77 R + 128) >> 8, exact in 16-bit integers.
+ */
+
+namespace detail {
+
+inline void bgr_to_luma_scalar(const uint8_t *bgr, uint8_t *luma, size_t pixels) {
+  for (size_t p = 0; p < pixels; p++) {
+    luma[p] = static_cast<uint8_t>(
+        (29 * bgr[3 * p] + 150 * bgr[3 * p + 1] + 77 * bgr[3 * p + 2] + 128) >> 8);
+  }
+}
+
+#ifdef FRAME_QUALITY_X86_DISPATCH
+/*
+ * Shuffle gathering channel `channel` of the pixels of a 48-byte block out of its part
+ * `part` (bytes 16 * part to 16 * part + 15).
+ */
+__attribute__((target("ssse3"))) inline __m128i deinterleave_mask(int channel, int part) {
+  alignas(16) int8_t mask[16];
+  for (int i = 0; i < 16; i++) {
+    const int source = 3 * i + channel - 16 * part;
+    mask[i] = static_cast<int8_t>(source >= 0 && source < 16 ? source : -1);
+  }
+  return _mm_load_si128(reinterpret_cast<const __m128i *>(mask));
+}
+
+__attribute__((target("ssse3"))) inline void bgr_to_luma_ssse3(const uint8_t *bgr,
+                                                               uint8_t *luma,
+                                                               size_t pixels) {
+  __m128i masks[3][3];
+  for (int channel = 0; channel < 3; channel++) {
+    for (int part = 0; part < 3; part++) {
+      masks[channel][part] = deinterleave_mask(channel, part);
+    }
+  }
+  const __m128i weights[3] = {_mm_set1_epi16(29), _mm_set1_epi16(150),
+                              _mm_set1_epi16(77)};
+  const __m128i zero = _mm_setzero_si128();
+
+  size_t p = 0;
+  for (; p + 16 <= pixels; p += 16) {
+    const __m128i *src = reinterpret_cast<const __m128i *>(bgr + 3 * p);
+    const __m128i parts[3] = {_mm_loadu_si128(src), _mm_loadu_si128(src + 1),
+                              _mm_loadu_si128(src + 2)};
+    __m128i low = _mm_set1_epi16(128);
+    __m128i high = low;
+    for (int channel = 0; channel < 3; channel++) {
+      const __m128i values =
+          _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(parts[0], masks[channel][0]),
+                                    _mm_shuffle_epi8(parts[1], masks[channel][1])),
+                       _mm_shuffle_epi8(parts[2], masks[channel][2]));
+      low = _mm_add_epi16(
+          low, _mm_mullo_epi16(_mm_unpacklo_epi8(values, zero), weights[channel]));
+      high = _mm_add_epi16(
+          high, _mm_mullo_epi16(_mm_unpackhi_epi8(values, zero), weights[channel]));
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(luma + p),
+                     _mm_packus_epi16(_mm_srli_epi16(low, 8), _mm_srli_epi16(high, 8)));
+  }
+  bgr_to_luma_scalar(bgr + 3 * p, luma + p, pixels - p);
+}
+
+/*
+ * Same as the SSSE3 version on 32 pixels: each 128-bit lane holds a 48-byte block, and
+ * the in-lane unpack and pack keep the pixels in order.
+ */
+__attribute__((target("avx2"))) inline void bgr_to_luma_avx2(const uint8_t *bgr,
+                                                             uint8_t *luma,
+                                                             size_t pixels) {
+  __m256i masks[3][3];
+  for (int channel = 0; channel < 3; channel++) {
+    for (int part = 0; part < 3; part++) {
+      const __m128i mask = deinterleave_mask(channel, part);
+      masks[channel][part] =
+          _mm256_inserti128_si256(_mm256_castsi128_si256(mask), mask, 1);
+    }
+  }
+  const __m256i weights[3] = {_mm256_set1_epi16(29), _mm256_set1_epi16(150),
+                              _mm256_set1_epi16(77)};
+  const __m256i zero = _mm256_setzero_si256();
+
+  size_t p = 0;
+  for (; p + 32 <= pixels; p += 32) {
+    const __m128i *src = reinterpret_cast<const __m128i *>(bgr + 3 * p);
+    __m256i parts[3];
+    for (int part = 0; part < 3; part++) {
+      parts[part] = _mm256_inserti128_si256(
+          _mm256_castsi128_si256(_mm_loadu_si128(src + part)),
+          _mm_loadu_si128(src + 3 + part), 1);
+    }
+    __m256i low = _mm256_set1_epi16(128);
+    __m256i high = low;
+    for (int channel = 0; channel < 3; channel++) {
+      const __m256i values = _mm256_or_si256(
+          _mm256_or_si256(_mm256_shuffle_epi8(parts[0], masks[channel][0]),
+                          _mm256_shuffle_epi8(parts[1], masks[channel][1])),
+          _mm256_shuffle_epi8(parts[2], masks[channel][2]));
+      low = _mm256_add_epi16(
+          low, _mm256_mullo_epi16(_mm256_unpacklo_epi8(values, zero), weights[channel]));
+      high = _mm256_add_epi16(
+          high, _mm256_mullo_epi16(_mm256_unpackhi_epi8(values, zero), weights[channel]));
+    }
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i *>(luma + p),
+        _mm256_packus_epi16(_mm256_srli_epi16(low, 8), _mm256_srli_epi16(high, 8)));
+  }
+  bgr_to_luma_ssse3(bgr + 3 * p, luma + p, pixels - p);
+}
+#endif
+
+}  // namespace detail
+
+// Converts packed 8-bit BGR pixels to luma.
+inline void bgr_to_luma(const uint8_t *bgr, uint8_t *luma, size_t pixels) {
+#ifdef FRAME_QUALITY_X86_DISPATCH
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  static const bool has_ssse3 = __builtin_cpu_supports("ssse3");
+  if (has_avx2) {
+    detail::bgr_to_luma_avx2(bgr, luma, pixels);
+    return;
+  }
+  if (has_ssse3) {
+    detail::bgr_to_luma_ssse3(bgr, luma, pixels);
+    return;
+  }
+#endif
+  detail::bgr_to_luma_scalar(bgr, luma, pixels);
+}
+
+struct luma_sums {
+  uint64_t sum{0};
+  uint64_t squares{0};
+};
+
+// Adds the values and the squared values of n luma pixels to sums.
+inline void add_luma_sums(const uint8_t *luma, size_t n, luma_sums &sums) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i sum = zero;
+  __m256i squares = zero;
+  for (; i + 32 <= n; i += 32) {
+    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(luma + i));
+    sum = _mm256_add_epi64(sum, _mm256_sad_epu8(v, zero));
+    const __m256i low = _mm256_unpacklo_epi8(v, zero);
+    const __m256i high = _mm256_unpackhi_epi8(v, zero);
+    // Pairs of squares fit 32 bits, their sums are widened right away
+    const __m256i pairs =
+        _mm256_add_epi32(_mm256_madd_epi16(low, low), _mm256_madd_epi16(high, high));
+    squares = _mm256_add_epi64(
+        squares, _mm256_add_epi64(_mm256_unpacklo_epi32(pairs, zero),
+                                  _mm256_unpackhi_epi32(pairs, zero)));
+  }
+  alignas(32) uint64_t lanes[8];
+  _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), sum);
+  _mm256_store_si256(reinterpret_cast<__m256i *>(lanes + 4), squares);
+  sums.sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  sums.squares += lanes[4] + lanes[5] + lanes[6] + lanes[7];
+#elif defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  __m128i sum = zero;
+  __m128i squares = zero;
+  for (; i + 16 <= n; i += 16) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(luma + i));
+    sum = _mm_add_epi64(sum, _mm_sad_epu8(v, zero));
+    const __m128i low = _mm_unpacklo_epi8(v, zero);
+    const __m128i high = _mm_unpackhi_epi8(v, zero);
+    // Pairs of squares fit 32 bits, their sums are widened right away
+    const __m128i pairs =
+        _mm_add_epi32(_mm_madd_epi16(low, low), _mm_madd_epi16(high, high));
+    squares = _mm_add_epi64(squares, _mm_add_epi64(_mm_unpacklo_epi32(pairs, zero),
+                                                   _mm_unpackhi_epi32(pairs, zero)));
+  }
+  alignas(16) uint64_t lanes[4];
+  _mm_store_si128(reinterpret_cast<__m128i *>(lanes), sum);
+  _mm_store_si128(reinterpret_cast<__m128i *>(lanes + 2), squares);
+  sums.sum += lanes[0] + lanes[1];
+  sums.squares += lanes[2] + lanes[3];
+#endif
+  for (; i < n; i++) {
+    sums.sum += luma[i];
+    sums.squares += static_cast<uint64_t>(luma[i]) * luma[i];
+  }
+}
+
+/*
+ * Gradient energy of a luma row: the sum of the squared differences between horizontal
+ * neighbours and with the pixel above, in previous. A blurred image has weak gradients.
+ */
+inline uint64_t gradient_energy(const uint8_t *row, const uint8_t *previous, size_t n) {
+  uint64_t energy = 0;
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i acc = zero;
+  // The horizontal difference reads one pixel ahead
+  for (; i + 33 <= n; i += 32) {
+    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row + i));
+    const __m256i right =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row + i + 1));
+    const __m256i up =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(previous + i));
+    const __m256i vl = _mm256_unpacklo_epi8(v, zero);
+    const __m256i vh = _mm256_unpackhi_epi8(v, zero);
+    const __m256i dx_low = _mm256_sub_epi16(_mm256_unpacklo_epi8(right, zero), vl);
+    const __m256i dx_high = _mm256_sub_epi16(_mm256_unpackhi_epi8(right, zero), vh);
+    const __m256i dy_low = _mm256_sub_epi16(_mm256_unpacklo_epi8(up, zero), vl);
+    const __m256i dy_high = _mm256_sub_epi16(_mm256_unpackhi_epi8(up, zero), vh);
+    // Each 32-bit lane sums 8 squares of at most 255^2
+    const __m256i squares =
+        _mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(dx_low, dx_low),
+                                          _mm256_madd_epi16(dx_high, dx_high)),
+                         _mm256_add_epi32(_mm256_madd_epi16(dy_low, dy_low),
+                                          _mm256_madd_epi16(dy_high, dy_high)));
+    acc = _mm256_add_epi64(acc, _mm256_add_epi64(_mm256_unpacklo_epi32(squares, zero),
+                                                 _mm256_unpackhi_epi32(squares, zero)));
+  }
+  alignas(32) uint64_t lanes[4];
+  _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), acc);
+  energy = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc = zero;
+  // The horizontal difference reads one pixel ahead
+  for (; i + 17 <= n; i += 16) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + i));
+    const __m128i right = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + i + 1));
+    const __m128i up = _mm_loadu_si128(reinterpret_cast<const __m128i *>(previous + i));
+    const __m128i vl = _mm_unpacklo_epi8(v, zero);
+    const __m128i vh = _mm_unpackhi_epi8(v, zero);
+    const __m128i dx_low = _mm_sub_epi16(_mm_unpacklo_epi8(right, zero), vl);
+    const __m128i dx_high = _mm_sub_epi16(_mm_unpackhi_epi8(right, zero), vh);
+    const __m128i dy_low = _mm_sub_epi16(_mm_unpacklo_epi8(up, zero), vl);
+    const __m128i dy_high = _mm_sub_epi16(_mm_unpackhi_epi8(up, zero), vh);
+    // Each 32-bit lane sums 8 squares of at most 255^2
+    const __m128i squares = _mm_add_epi32(
+        _mm_add_epi32(_mm_madd_epi16(dx_low, dx_low), _mm_madd_epi16(dx_high, dx_high)),
+        _mm_add_epi32(_mm_madd_epi16(dy_low, dy_low), _mm_madd_epi16(dy_high, dy_high)));
+    acc = _mm_add_epi64(acc, _mm_add_epi64(_mm_unpacklo_epi32(squares, zero),
+                                           _mm_unpackhi_epi32(squares, zero)));
+  }
+  alignas(16) uint64_t lanes[2];
+  _mm_store_si128(reinterpret_cast<__m128i *>(lanes), acc);
+  energy = lanes[0] + lanes[1];
+#endif
+  for (; i < n; i++) {
+    const int dy = static_cast<int>(previous[i]) - row[i];
+    energy += static_cast<uint64_t>(dy * dy);
+    if (i + 1 < n) {
+      const int dx = static_cast<int>(row[i + 1]) - row[i];
+      energy += static_cast<uint64_t>(dx * dx);
+    }
+  }
+  return energy;
+}
+
+/*
+ * Luma histogram. Histograms don't vectorize, but counting into 4 tables in turn keeps
+ * runs of equal pixels (flat areas) from waiting on the previous increment of a bin.
+ */
+class luma_histogram {
+ public:
+  void clear() {
+    for (auto &table : _tables) {
+      for (auto &bin : table) {
+        bin = 0;
+      }
+    }
+  }
+
+  void add(const uint8_t *luma, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+      _tables[0][luma[i]]++;
+      _tables[1][luma[i + 1]]++;
+      _tables[2][luma[i + 2]]++;
+      _tables[3][luma[i + 3]]++;
+    }
+    for (; i < n; i++) {
+      _tables[0][luma[i]]++;
+    }
+  }
+
+  // Pixels of value `value`.
+  uint64_t count(int value) const {
+    return static_cast<uint64_t>(_tables[0][value]) + _tables[1][value]
+           + _tables[2][value] + _tables[3][value];
+  }
+
+ private:
+  uint32_t _tables[4][256]{};
+};
+
+}  // namespace frame_quality_bot
@@ -0,0 +1,266 @@
+#include <bot_common/pixel_kernels.h>
+#include <bot_common/tracing.h>
+#include <prometheus/counter.h>
+#include <prometheus/counter_builder.h>
+#include <prometheus/gauge.h>
+#include <prometheus/gauge_builder.h>
+#include <satorivideo/video_bot.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#define LOGURU_WITH_STREAMS 1
+#include <loguru/loguru.hpp>
+
+#include "luma_kernels.h"
+
+namespace sv = satori::video;
+
+namespace frame_quality_bot {
+namespace {
+
+struct settings {
+  // Analyses one frame out of `interval`
+  uint32_t interval{25};
+  uint32_t histogram_bins{16};
+  // A frame is black when black_fraction of its pixels have a luma <= black_level
+  int black_level{16};
+  double black_fraction{0.98};
+  /*
+   * The picture is frozen when frozen_frames analysed frames in a row differ from the
+   * previous one by less than frozen_threshold luma levels per pixel, on average.
+   */
+  double frozen_threshold{0.5};
+  uint32_t frozen_frames{3};
+};
+
+// Rows compared by frozen picture detection, one out of frozen_row_step
+constexpr int frozen_row_step = 8;
+
+struct state {
+  explicit state(sv::bot_context &context)
+      : brightness_gauge(prometheus::BuildGauge()
+                             .Name("frame_brightness")
+                             .Register(context.metrics.registry)
+                             .Add({})),
+        contrast_gauge(prometheus::BuildGauge()
+                           .Name("frame_contrast")
+                           .Register(context.metrics.registry)
+                           .Add({})),
+        sharpness_gauge(prometheus::BuildGauge()
+                            .Name("frame_sharpness")
+                            .Register(context.metrics.registry)
+                            .Add({})),
+        black_frames(prometheus::BuildCounter()
+                         .Name("black_frames")
+                         .Register(context.metrics.registry)
+                         .Add({})),
+        frozen_frames(prometheus::BuildCounter()
+                          .Name("frozen_frames")
+                          .Register(context.metrics.registry)
+                          .Add({})),
+        tracer(context.metrics.registry),
+        frame_stage(tracer.add_stage("frame", "frame_quality_frame_seconds")) {}
+
+  struct settings settings;
+  uint64_t frames{0};
+
+  // Luma of the current and the previous row. Frames are read in place, never copied.
+  std::vector<uint8_t> rows[2];
+  luma_histogram histogram;
+  // Sampled luma rows of the current and the previous analysed frame
+  std::vector<uint8_t> samples;
+  std::vector<uint8_t> previous_samples;
+  uint32_t unchanged_frames{0};
+
+  prometheus::Gauge &brightness_gauge;
+  prometheus::Gauge &contrast_gauge;
+  prometheus::Gauge &sharpness_gauge;
+  prometheus::Counter &black_frames;
+  prometheus::Counter &frozen_frames;
+
+  // Stage timers, spans of a frame are reported at the start of the next analysed one
+  bot_common::tracing::tracer tracer;
+  const uint32_t frame_stage;
+};
+
+state &get_state(sv::bot_context &context) {
+  if (context.instance_data == nullptr) {
+    context.instance_data = new state(context);
+  }
+  return *static_cast<state *>(context.instance_data);
+}
+
+/*
+ * Measures a packed BGR frame in a single pass over its rows:
+ * - brightness: mean luma, 0 to 255,
+ * - contrast: standard deviation of the luma,
+ * - sharpness: mean squared difference between neighbouring pixels, which drops when
+ *   the picture is out of focus, dirty or fogged,
+ * - histogram: fractions of the pixels in histogram_bins luma ranges of equal width,
+ * - black: almost every pixel is dark (lens covered, no signal),
+ * - frozen: the picture hasn't changed for frozen_frames analysed frames.
+ */
+nlohmann::json analyse(state &s, const uint8_t *plane, size_t stride, size_t width,
+                       size_t height) {
+  for (auto &row : s.rows) {
+    row.resize(width);
+  }
+  s.histogram.clear();
+  s.samples.clear();
+  luma_sums sums;
+  uint64_t gradient = 0;
+  for (size_t y = 0; y < height; y++) {
+    uint8_t *luma = s.rows[y & 1].data();
+    bgr_to_luma(plane + y * stride, luma, width);
+    add_luma_sums(luma, width, sums);
+    s.histogram.add(luma, width);
+    if (y > 0) {
+      gradient += gradient_energy(luma, s.rows[(y - 1) & 1].data(), width);
+    }
+    if (y % frozen_row_step == 0) {
+      s.samples.insert(s.samples.end(), luma, luma + width);
+    }
+  }
+
+  const double pixels = static_cast<double>(width) * height;
+  const double brightness = sums.sum / pixels;
+  const double contrast =
+      std::sqrt(std::max(0.0, sums.squares / pixels - brightness * brightness));
+  // Differences with the right neighbour and the pixel above
+  const double differences = static_cast<double>(height - 1) * (2 * width - 1);
+  const double sharpness = differences > 0 ? gradient / differences : 0;
+
+  nlohmann::json histogram = nlohmann::json::array();
+  const int bin_width = 256 / static_cast<int>(s.settings.histogram_bins);
+  uint64_t dark = 0;
+  for (int bin = 0; bin < 256; bin += bin_width) {
+    uint64_t count = 0;
+    for (int value = bin; value < bin + bin_width; value++) {
+      count += s.histogram.count(value);
+      if (value <= s.settings.black_level) {
+        dark += s.histogram.count(value);
+      }
+    }
+    histogram.push_back(count / pixels);
+  }
+  const bool black = dark >= s.settings.black_fraction * pixels;
+
+  if (s.samples.size() == s.previous_samples.size()) {
+    const uint64_t difference = bot_common::sum_abs_diff(
+        s.samples.data(), s.previous_samples.data(), s.samples.size());
+    const bool unchanged = difference < s.settings.frozen_threshold * s.samples.size();
+    s.unchanged_frames = unchanged ? s.unchanged_frames + 1 : 0;
+  } else {
+    s.unchanged_frames = 0;
+  }
+  s.samples.swap(s.previous_samples);
+  const bool frozen = s.unchanged_frames >= s.settings.frozen_frames;
+
+  s.brightness_gauge.Set(brightness);
+  s.contrast_gauge.Set(contrast);
+  s.sharpness_gauge.Set(sharpness);
+  if (black) {
+    s.black_frames.Increment();
+  }
+  if (frozen) {
+    s.frozen_frames.Increment();
+  }
+  return {{"brightness", brightness}, {"contrast", contrast},
+          {"sharpness", sharpness},   {"histogram", std::move(histogram)},
+          {"black", black},           {"frozen", frozen}};
+}
+
+/*
+ * Configuration, every field is optional:
+ * {"interval": 25, "histogramBins": 16, "blackLevel": 16, "blackFraction": 0.98,
+ *  "frozenThreshold": 0.5, "frozenFrames": 3}
+ */
+settings parse_settings(const nlohmann::json &body) {
+  settings settings;
+  if (body.find("interval") != body.end()) {
+    CHECK_S(body["interval"].is_number_unsigned() && body["interval"] > 0)
+        << "interval is not a positive integer: " << body;
+    settings.interval = body["interval"];
+  }
+  if (body.find("histogramBins") != body.end()) {
+    auto &bins = body["histogramBins"];
+    CHECK_S(bins.is_number_unsigned() && bins > 0 && bins <= 256
+            && (bins.get<uint32_t>() & (bins.get<uint32_t>() - 1)) == 0)
+        << "histogramBins is not a power of 2 up to 256: " << body;
+    settings.histogram_bins = bins;
+  }
+  if (body.find("blackLevel") != body.end()) {
+    CHECK_S(body["blackLevel"].is_number_unsigned() && body["blackLevel"] < 256)
+        << "blackLevel is not a luma level: " << body;
+    settings.black_level = body["blackLevel"];
+  }
+  if (body.find("blackFraction") != body.end()) {
+    CHECK_S(body["blackFraction"].is_number() && body["blackFraction"] > 0
+            && body["blackFraction"] <= 1)
+        << "blackFraction is not in (0, 1]: " << body;
+    settings.black_fraction = body["blackFraction"];
+  }
+  if (body.find("frozenThreshold") != body.end()) {
+    CHECK_S(body["frozenThreshold"].is_number() && body["frozenThreshold"] >= 0)
+        << "frozenThreshold is not a positive number: " << body;
+    settings.frozen_threshold = body["frozenThreshold"];
+  }
+  if (body.find("frozenFrames") != body.end()) {
+    CHECK_S(body["frozenFrames"].is_number_unsigned() && body["frozenFrames"] > 0)
+        << "frozenFrames is not a positive integer: " << body;
+    settings.frozen_frames = body["frozenFrames"];
+  }
+  return settings;
+}
+
+}  // namespace
+
+void process_image(sv::bot_context &context, const sv::image_frame &frame) {
+  state &s = get_state(context);
+  if (s.frames++ % s.settings.interval != 0) {
+    return;
+  }
+  s.tracer.flush();
+  bot_common::tracing::span frame_span(s.tracer, s.frame_stage);
+
+  nlohmann::json message =
+      analyse(s, frame.plane_data[0], frame.plane_strides[0],
+              context.frame_metadata->width, context.frame_metadata->height);
+  sv::bot_message(context, sv::bot_message_kind::ANALYSIS, std::move(message));
+}
+
+/*
+ * Settings come with the configure action, at startup or later on the control channel:
+ * {"to": "<bot id>", "action": "configure", "body": {"interval": 5}}.
+ */
+nlohmann::json process_command(sv::bot_context &context, const nlohmann::json &config) {
+  state &s = get_state(context);
+  if (!config.is_object() || config.find("ack") != config.end()) {
+    // Nothing to configure, or our own acknowledgement back from the control channel
+    return nullptr;
+  }
+  if (config.find("action") == config.end() || config["action"] != "configure") {
+    return nullptr;
+  }
+  CHECK_S(config.find("body") != config.end() && config["body"].is_object())
+      << "body is not an object: " << config;
+  s.settings = parse_settings(config["body"]);
+  LOG_S(INFO) << "Configured: " << config["body"];
+  if (config.find("to") != config.end()) {
+    return {{"ack", true}, {"to", config["to"]}, {"action", "configure"}};
+  }
+  return nullptr;
+}
+
+}  // namespace frame_quality_bot
+
+#ifndef BOT_BENCH
+int main(int argc, char *argv[]) {
+  loguru::g_colorlogtostderr = false;
+  sv::bot_register(sv::bot_descriptor{sv::image_pixel_format::BGR,
+                                      &frame_quality_bot::process_image,
+                                      &frame_quality_bot::process_command});
+  return sv::bot_main(argc, argv);
+}
+#endif
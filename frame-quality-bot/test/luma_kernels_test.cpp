@@ -0,0 +1,156 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "luma_kernels.h"
+
+namespace fqb = frame_quality_bot;
+
+/*
+ * Compares the luma kernels, as vectorized for the instruction set this file is built for,
+ * with straightforward scalar versions. The luma conversion is also checked in each of its
+ * run-time versions the CPU supports. CMakeLists.txt builds it for the default target
+ * (SSE2 on x86-64), for AVX2 and without SIMD.
+ */
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition, ...)                                  \
+  do {                                                         \
+    if (!(condition)) {                                        \
+      std::fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);     \
+      std::fprintf(stderr, __VA_ARGS__);                       \
+      std::fputc('\n', stderr);                                \
+      failures++;                                              \
+    }                                                          \
+  } while (false)
+
+std::vector<uint8_t> reference_luma(const std::vector<uint8_t> &bgr) {
+  std::vector<uint8_t> luma(bgr.size() / 3);
+  for (size_t p = 0; p < luma.size(); p++) {
+    luma[p] = static_cast<uint8_t>(
+        (29 * bgr[3 * p] + 150 * bgr[3 * p + 1] + 77 * bgr[3 * p + 2] + 128) >> 8);
+  }
+  return luma;
+}
+
+fqb::luma_sums reference_sums(const std::vector<uint8_t> &luma) {
+  fqb::luma_sums sums;
+  for (uint8_t l : luma) {
+    sums.sum += l;
+    sums.squares += static_cast<uint64_t>(l) * l;
+  }
+  return sums;
+}
+
+uint64_t reference_gradient(const std::vector<uint8_t> &row,
+                            const std::vector<uint8_t> &previous) {
+  uint64_t energy = 0;
+  for (size_t i = 0; i < row.size(); i++) {
+    const int dy = previous[i] - row[i];
+    energy += static_cast<uint64_t>(dy * dy);
+    if (i + 1 < row.size()) {
+      const int dx = row[i + 1] - row[i];
+      energy += static_cast<uint64_t>(dx * dx);
+    }
+  }
+  return energy;
+}
+
+// Row lengths around the 16 and 32 pixel vector widths, and frame widths
+const size_t lengths[] = {0,  1,  15, 16, 17,  31,  32,  33,  47,  48,
+                          49, 63, 64, 65, 100, 320, 959, 1920, 4096};
+
+/*
+ * Random pixels, or only 0 and 255 so that differences and squares take their
+ * largest values
+ */
+void fill(std::vector<uint8_t> &pixels, std::mt19937 &rng, bool extremes) {
+  for (auto &p : pixels) {
+    p = extremes ? static_cast<uint8_t>(rng() % 2 == 0 ? 0 : 255)
+                 : static_cast<uint8_t>(rng());
+  }
+}
+
+void test_bgr_to_luma(std::mt19937 &rng) {
+  for (size_t n : lengths) {
+    for (bool extremes : {false, true}) {
+      std::vector<uint8_t> bgr(3 * n);
+      fill(bgr, rng, extremes);
+      const std::vector<uint8_t> expected = reference_luma(bgr);
+      // One more pixel, which the kernels must not write
+      std::vector<uint8_t> luma(n + 1, 7);
+      fqb::bgr_to_luma(bgr.data(), luma.data(), n);
+      CHECK(std::equal(expected.begin(), expected.end(), luma.begin()) && luma[n] == 7,
+            "bgr_to_luma differs: %zu pixels", n);
+#ifdef FRAME_QUALITY_X86_DISPATCH
+      if (__builtin_cpu_supports("ssse3")) {
+        luma.assign(n + 1, 7);
+        fqb::detail::bgr_to_luma_ssse3(bgr.data(), luma.data(), n);
+        CHECK(std::equal(expected.begin(), expected.end(), luma.begin()) && luma[n] == 7,
+              "bgr_to_luma_ssse3 differs: %zu pixels", n);
+      }
+      if (__builtin_cpu_supports("avx2")) {
+        luma.assign(n + 1, 7);
+        fqb::detail::bgr_to_luma_avx2(bgr.data(), luma.data(), n);
+        CHECK(std::equal(expected.begin(), expected.end(), luma.begin()) && luma[n] == 7,
+              "bgr_to_luma_avx2 differs: %zu pixels", n);
+      }
+#endif
+    }
+  }
+}
+
+void test_luma_sums(std::mt19937 &rng) {
+  for (size_t n : lengths) {
+    for (bool extremes : {false, true}) {
+      std::vector<uint8_t> luma(n);
+      fill(luma, rng, extremes);
+      const fqb::luma_sums expected = reference_sums(luma);
+      // Sums add up over the rows of a frame
+      fqb::luma_sums sums;
+      sums.sum = 1000;
+      sums.squares = 2000;
+      fqb::add_luma_sums(luma.data(), n, sums);
+      CHECK(sums.sum == expected.sum + 1000 && sums.squares == expected.squares + 2000,
+            "add_luma_sums differs: %zu pixels", n);
+    }
+  }
+}
+
+void test_gradient_energy(std::mt19937 &rng) {
+  for (size_t n : lengths) {
+    for (bool extremes : {false, true}) {
+      std::vector<uint8_t> row(n), previous(n);
+      fill(row, rng, extremes);
+      fill(previous, rng, extremes);
+      CHECK(fqb::gradient_energy(row.data(), previous.data(), n)
+                == reference_gradient(row, previous),
+            "gradient_energy differs: %zu pixels", n);
+    }
+  }
+}
+
+}  // namespace
+
+int main() {
+#if defined(__AVX2__) && defined(__GNUC__)
+  if (!__builtin_cpu_supports("avx2")) {
+    std::fprintf(stderr, "AVX2 is not supported, skipped\n");
+    return 0;
+  }
+#endif
+  std::mt19937 rng(42);
+  test_bgr_to_luma(rng);
+  test_luma_sums(rng);
+  test_gradient_energy(rng);
+  if (failures > 0) {
+    std::fprintf(stderr, "%d failures\n", failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <utility>
+#include <vector>
+#include <opencv2/core.hpp>
+
+namespace haar_cascades_bot {
+
+/*
+ * Narrows detectMultiScale search to where and at which sizes a cascade recently found
+ * objects. Fixed cameras see objects in a narrow band of sizes and places, so most of the
+ * image pyramid and most of the frame can be skipped.
+ * Every widen_interval detection passes, and on the first one, a full search runs so that
+ * new objects are found; in between, passes with no recent detections search nothing.
+ */
+class adaptive_search {
+ public:
+  // Number of detection passes whose detections are taken into account
+  uint32_t history{30};
+  // Number of detection passes between full searches
+  uint32_t widen_interval{30};
+  // Extra room around recent detections, relative to their size
+  double margin{0.5};
+
+  /*
+   * Starts a detection pass. Returns false if this pass must search the whole frame at
+   * all sizes. Otherwise narrows region, min_size and max_size (max_size may be empty,
+   * meaning unbounded) to recent detections; region is empty if there are none.
+   */
+  bool narrow(const cv::Size &frame_size, cv::Rect &region, cv::Size &min_size,
+              cv::Size &max_size) {
+    _pass++;
+    while (!_recent.empty() && _recent.front().first + history < _pass) {
+      _recent.pop_front();
+    }
+
+    if (_pass == 1 || _pass - _last_full_pass >= widen_interval) {
+      _last_full_pass = _pass;
+      return false;
+    }
+
+    region = cv::Rect{};
+    if (_recent.empty()) {
+      return true;
+    }
+
+    int min_width = std::numeric_limits<int>::max();
+    int min_height = std::numeric_limits<int>::max();
+    int max_width = 0;
+    int max_height = 0;
+    for (const auto &detection : _recent) {
+      const auto &box = detection.second;
+      min_width = std::min(min_width, box.width);
+      min_height = std::min(min_height, box.height);
+      max_width = std::max(max_width, box.width);
+      max_height = std::max(max_height, box.height);
+
+      const int dx = cvRound(box.width * margin);
+      const int dy = cvRound(box.height * margin);
+      const cv::Rect inflated{box.x - dx, box.y - dy, box.width + 2 * dx,
+                              box.height + 2 * dy};
+      region = region.area() == 0 ? inflated : (region | inflated);
+    }
+    region &= cv::Rect{cv::Point{0, 0}, frame_size};
+
+    min_size.width = std::max(min_size.width, cvRound(min_width * (1 - margin)));
+    min_size.height = std::max(min_size.height, cvRound(min_height * (1 - margin)));
+    const cv::Size narrowed_max{cvRound(max_width * (1 + margin)),
+                                cvRound(max_height * (1 + margin))};
+    if (max_size.area() == 0) {
+      max_size = narrowed_max;
+    } else {
+      max_size.width = std::min(max_size.width, narrowed_max.width);
+      max_size.height = std::min(max_size.height, narrowed_max.height);
+    }
+    return true;
+  }
+
+  // Records the detections of the current pass, in frame coordinates.
+  void record(const std::vector<cv::Rect> &detections) {
+    for (const auto &detection : detections) {
+      _recent.emplace_back(_pass, detection);
+    }
+  }
+
+ private:
+  uint64_t _pass{0};
+  uint64_t _last_full_pass{0};
+  std::deque<std::pair<uint64_t, cv::Rect>> _recent;
+};
+
+}  // namespace haar_cascades_bot
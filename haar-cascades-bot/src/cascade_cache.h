@@ -0,0 +1,63 @@
+#pragma once
+
+#include <bot_common/model_cache.h>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <opencv2/opencv.hpp>
+
+namespace haar_cascades_bot {
+
+/*
+ * Cascade files parsed once per content, within one process. The bot needs a classifier
+ * per cascade and per thread running it, and new ones for every configuration; they are
+ * all read from the parsed tree instead of parsing the XML again. Entries are keyed by a
+ * hash of the content, an updated model file is parsed again, and stay for the life of
+ * the bot. OpenCV has no compact binary form of a cascade to cache on disk, so unlike
+ * TensorFlow graphs (see model_cache.h) nothing is shared between replicas.
+ */
+class cascade_cache {
+ public:
+  // Returns false if the file can't be read or isn't a cascade.
+  bool load(const std::string &path, cv::CascadeClassifier &classifier) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const cv::FileStorage *storage = parse(path);
+    if (storage != nullptr && classifier.read(storage->getFirstTopLevelNode())) {
+      return true;
+    }
+    // Cascades in the old format can only be loaded from their file
+    return classifier.load(path);
+  }
+
+  size_t size() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _parsed.size();
+  }
+
+ private:
+  const cv::FileStorage *parse(const std::string &path) {
+    bot_common::mapped_file file(path);
+    if (!file.is_open()) {
+      return nullptr;
+    }
+    const uint64_t hash = bot_common::content_hash(file);
+    auto it = _parsed.find(hash);
+    if (it == _parsed.end()) {
+      std::unique_ptr<cv::FileStorage> storage(new cv::FileStorage(
+          std::string(reinterpret_cast<const char *>(file.data()), file.size()),
+          cv::FileStorage::READ | cv::FileStorage::MEMORY));
+      if (!storage->isOpened()) {
+        return nullptr;
+      }
+      it = _parsed.emplace(hash, std::move(storage)).first;
+    }
+    return it->second.get();
+  }
+
+  std::mutex _mutex;
+  std::map<uint64_t, std::unique_ptr<cv::FileStorage>> _parsed;
+};
+
+}  // namespace haar_cascades_bot
@@ -1,24 +1,236 @@
 #include <satorivideo/opencv/opencv_bot.h>
 #include <satorivideo/opencv/opencv_utils.h>
 #include <satorivideo/video_bot.h>
+#include <bot_common/binary_output.h>
+#include <bot_common/cpu_quota.h>
+#include <bot_common/hot_swap.h>
+#include <bot_common/load_shedder.h>
+#include <bot_common/object_tracker.h>
+#include <bot_common/stream_host.h>
+#include <bot_common/tracing.h>
+#include <bot_common/worker_pool.h>
 #include <json.hpp>
 #include <opencv2/opencv.hpp>
+#include <stdexcept>
 
 #define LOGURU_WITH_STREAMS 1
 #include <loguru/loguru.hpp>
 
+#include "adaptive_search.h"
+#include "cascade_cache.h"
+#include "tracking.h"
+
 namespace sv = satori::video;
 
 namespace haar_cascades_bot {
 
+// Thrown while building a configuration which can't be applied, see build_state
+struct config_error : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+void check_config(bool condition, const std::string &message) {
+  if (!condition) {
+    throw config_error(message);
+  }
+}
+
+/*
+ * Cascade model and its settings. Read-only once configured, shared by all streams.
+ */
 struct cascade {
-  cv::CascadeClassifier classifier;
+  // Model file, loaded once per thread running the cascade (see load_classifiers)
+  std::string file;
   std::string tag;
+
+  // detectMultiScale parameters, empty max_size means unbounded
+  double scale_factor{1.1};
+  int min_neighbors{3};
+  cv::Size min_size;
+  cv::Size max_size;
+  bool adaptive{false};
+  // Settings of the adaptive search, copied into every stream
+  adaptive_search search;
+
+  /*
+   * Child cascades only run inside the detections of their parent cascades (the ones
+   * tagged parent_tag), looking for objects between min_relative_size and
+   * max_relative_size of the parent detection size.
+   */
+  std::string parent_tag;
+  std::vector<size_t> parents;
+  double min_relative_size{0.1};
+  double max_relative_size{1.0};
+};
+
+// What a cascade keeps between frames of one stream
+struct cascade_run {
+  // Detections of the current frame, kept to reuse memory
+  std::vector<cv::Rect> detections;
+  std::vector<cv::Rect> roi_detections;
+  adaptive_search search;
+};
+
+/*
+ * Objects keep their id while they match a detection of the next frames (see
+ * object_tracker). In delta mode, a frame is only published if an object appeared,
+ * disappeared or moved by more than move_threshold of its size, and then only with
+ * these objects. Every snapshot_interval frames, all objects are published.
+ *
+ * With binary output, frames are encoded as CBOR or MessagePack and published in batches
+ * of up to batch_frames frames or batch_delay (see binary_output).
+ */
+struct output_settings {
+  bool delta{false};
+  double move_threshold{0.1};
+  uint32_t snapshot_interval{30};
+  double min_iou{0.3};
+  uint32_t max_missed{2};
+
+  bool binary{false};
+  bot_common::binary_output::format encoding{bot_common::binary_output::format::cbor};
+  size_t batch_frames{10};
+  std::chrono::milliseconds batch_delay{500};
+};
+
+/*
+ * Per-stream state: the bot's own input, or one of the streams of host mode. Streams
+ * outlive configurations, rebind() carries them over to a new one.
+ */
+struct stream_state {
+  std::vector<cascade_run> runs;
+  // Detections of the current frame, labelled with their cascade, and their ids
+  std::vector<bot_common::object_tracker::detection> detections;
+  bot_common::object_tracker objects;
+  // Objects to publish for the current frame
+  std::vector<size_t> published_objects;
+  // Binary output batch, null with JSON output
+  std::unique_ptr<bot_common::binary_output::batcher> batch;
+  bot_common::binary_output::frame encoded_frame;
+  // Grayscale frame shared by all cascades, downscaled by analysis_scale
+  cv::Mat gray;
+  cv::Mat full_gray;
+  double analysis_scale{1.0};
+  // Runs detectMultiScale on every other level of the image pyramid
+  bool coarse_pyramid{false};
+
+  std::vector<track> tracks;
+  cv::Mat previous_gray;
+  uint32_t frames_since_keyframe{0};
+
+  // Configuration the stream is bound to, its cascade tags and output settings
+  uint64_t generation{0};
+  std::vector<std::string> tags;
+  output_settings output;
 };
 
 struct state {
-  std::list<cascade> cascades;
-  uint32_t detection_id{0};
+  std::vector<cascade> cascades;
+  // Cascade indices by depth in the parent hierarchy, top level cascades first
+  std::vector<std::vector<size_t>> levels;
+  // Whether to equalize the grayscale frame histogram before detection
+  bool equalize{false};
+  output_settings output;
+
+  /*
+   * Detect-then-track mode: cascades only run on keyframes, every keyframe_interval
+   * frames or when the confidence of a track drops below min_confidence. Detections are
+   * followed with optical flow in between.
+   */
+  bool tracking{false};
+  uint32_t keyframe_interval{10};
+  double min_confidence{0.5};
+
+  // Applied to the instance load shedder when the configuration is installed
+  bot_common::load_shedder::settings load_shedding;
+  // Numbers the configurations of the instance, from 1
+  uint64_t generation{0};
+
+  // Stage timers, owned by the instance (see below) as they outlive configurations
+  bot_common::tracing::tracer *tracer{nullptr};
+  uint32_t detect_stage{0};
+  uint32_t track_stage{0};
+
+  // Classifiers of the bot's own input, its cascades run in parallel on workers
+  std::vector<cv::CascadeClassifier> classifiers;
+  std::unique_ptr<bot_common::worker_pool> workers;
+
+  /*
+   * Host mode settings, null without host mode, and the classifiers of the host workers.
+   * A CascadeClassifier keeps its detection buffers next to the model and can't be used
+   * by two threads at once, copies included, so every worker has its own instances,
+   * built from the parsed cascade files.
+   */
+  nlohmann::json streams;
+  std::vector<std::vector<cv::CascadeClassifier>> worker_classifiers;
+};
+
+/*
+ * Host mode: more streams, processed on the host workers. The host and its streams
+ * outlive configurations with the same "streams" settings, so that sources stay open and
+ * objects keep their ids; workers pick the current configuration up at every frame.
+ */
+struct hosted_streams {
+  nlohmann::json settings;
+  std::vector<stream_state> streams;
+  // Configuration the workers run with, accessed with std::atomic_load/atomic_store
+  std::shared_ptr<struct state> state;
+  std::vector<bot_common::stream_host::result> results;
+  uint64_t dropped_results{0};
+  // Declared last, so that its threads stop before the streams go away
+  std::unique_ptr<bot_common::stream_host> host;
+};
+
+// What a configuration command builds
+struct configuration {
+  std::shared_ptr<struct state> state;
+  // Null without host mode
+  std::shared_ptr<hosted_streams> hosted;
+};
+
+struct instance;
+std::shared_ptr<configuration> reload_configuration(const nlohmann::json &body,
+                                                    instance &instance);
+
+/*
+ * What lives as long as the bot. The configured state is replaced as a whole when a new
+ * configuration arrives, without stopping frames: the new state is built on the
+ * hot_swap thread and swapped in at the start of the next frame. Streams, the bot's input
+ * and the hosted ones, carry over.
+ */
+struct instance {
+  explicit instance(sv::bot_context &context)
+      : tracer(context.metrics.registry),
+        frame_stage(tracer.add_stage("frame", "haar_cascades_frame_seconds")),
+        detect_stage(tracer.add_stage("detect", "haar_cascades_detect_seconds")),
+        track_stage(tracer.add_stage("track", "haar_cascades_track_seconds")),
+        shedder(context.metrics.registry, "haar_cascades", 3),
+        configurations([this](const nlohmann::json &body) {
+          return reload_configuration(body, *this);
+        }) {}
+
+  // Stage timers, spans of a frame are reported at the start of the next one
+  bot_common::tracing::tracer tracer;
+  const uint32_t frame_stage;
+  const uint32_t detect_stage;
+  const uint32_t track_stage;
+  // Degrades the analysis of the bot's own input while it can't keep up with the frames
+  bot_common::load_shedder shedder;
+  // From the "to" field of the last configuration, empty until one has it. Addresses the
+  // load shedding events on the control channel.
+  std::string bot_id;
+
+  // Parsed model files, shared by the configurations
+  cascade_cache cascades;
+  // Only used while building configurations, one at a time
+  uint64_t generations{0};
+  // Only used on the SDK thread
+  std::shared_ptr<struct state> state;
+  stream_state input;
+  // Replaced on the SDK thread with std::atomic_store, read by the hot_swap thread
+  std::shared_ptr<hosted_streams> hosted;
+  // Declared last, so that its thread stops before the tracer goes away
+  bot_common::hot_swap<configuration> configurations;
 };
 
 nlohmann::json build_object(const cv::Rect &detection, uint32_t id,
@@ -38,29 +250,666 @@ nlohmann::json build_analysis_message(nlohmann::json &&objects) {
   return analysis_message;
 }
 
-void process_image(sv::bot_context &context, const cv::Mat &image) {
-  auto state = static_cast<struct state *>(context.instance_data);
+// Appends detections inside roi to run.detections, in stream.gray coordinates.
+void detect_in_roi(const stream_state &stream, const cascade &cascade,
+                   cv::CascadeClassifier &classifier, cascade_run &run,
+                   const cv::Rect &roi, const cv::Size &min_size,
+                   const cv::Size &max_size) {
+  // Skipping every other pyramid level is the same as squaring the step between levels
+  const double scale_factor = stream.coarse_pyramid
+                                  ? cascade.scale_factor * cascade.scale_factor
+                                  : cascade.scale_factor;
+  classifier.detectMultiScale(stream.gray(roi), run.roi_detections, scale_factor,
+                              cascade.min_neighbors, 0, min_size, max_size);
+  for (const auto &detection : run.roi_detections) {
+    run.detections.emplace_back(detection + roi.tl());
+  }
+}
 
-  const cv::Size image_size{image.cols, image.rows};
+void run_cascade(const struct state &state, size_t index,
+                 cv::CascadeClassifier &classifier, stream_state &stream) {
+  bot_common::tracing::span span(*state.tracer, state.detect_stage);
+  const cascade &cascade = state.cascades[index];
+  cascade_run &run = stream.runs[index];
+  run.detections.clear();
+
+  if (cascade.parents.empty()) {
+    cv::Rect roi{cv::Point{0, 0}, stream.gray.size()};
+    // Sizes are given in frame pixels, an empty max_size stays empty
+    const double scale = stream.analysis_scale;
+    cv::Size min_size{cvRound(cascade.min_size.width * scale),
+                      cvRound(cascade.min_size.height * scale)};
+    cv::Size max_size{cvRound(cascade.max_size.width * scale),
+                      cvRound(cascade.max_size.height * scale)};
+    const bool narrowed =
+        cascade.adaptive
+        && run.search.narrow(stream.gray.size(), roi, min_size, max_size);
+    if (!narrowed || roi.area() > 0) {
+      detect_in_roi(stream, cascade, classifier, run, roi, min_size, max_size);
+    }
+    if (cascade.adaptive) {
+      run.search.record(run.detections);
+    }
+    return;
+  }
 
+  for (size_t parent : cascade.parents) {
+    for (const auto &roi : stream.runs[parent].detections) {
+      const cv::Size min_size{cvRound(roi.width * cascade.min_relative_size),
+                              cvRound(roi.height * cascade.min_relative_size)};
+      const cv::Size max_size{cvRound(roi.width * cascade.max_relative_size),
+                              cvRound(roi.height * cascade.max_relative_size)};
+      detect_in_roi(stream, cascade, classifier, run, roi, min_size, max_size);
+    }
+  }
+}
+
+/*
+ * Runs the cascades level by level, so that parent detections are ready before their
+ * children run. Cascades of the same level run in parallel on workers, if given.
+ */
+void detect(const struct state &state, stream_state &stream,
+            std::vector<cv::CascadeClassifier> &classifiers,
+            bot_common::worker_pool *workers) {
+  for (const auto &level : state.levels) {
+    const auto run = [&](size_t i) {
+      run_cascade(state, level[i], classifiers[level[i]], stream);
+    };
+    if (workers != nullptr) {
+      workers->parallel_for(level.size(), run);
+    } else {
+      for (size_t i = 0; i < level.size(); i++) {
+        run(i);
+      }
+    }
+  }
+}
+
+/*
+ * Moves the tracks to the current frame, or replaces them with new detections on
+ * keyframes.
+ */
+void track_or_detect(const struct state &state, stream_state &stream,
+                     std::vector<cv::CascadeClassifier> &classifiers,
+                     bot_common::worker_pool *workers) {
+  bool keyframe = stream.previous_gray.size() != stream.gray.size()
+                  || ++stream.frames_since_keyframe >= state.keyframe_interval;
+  if (!keyframe) {
+    bot_common::tracing::span span(*state.tracer, state.track_stage);
+    const double confidence =
+        update_tracks(stream.previous_gray, stream.gray, stream.tracks);
+    keyframe = confidence < state.min_confidence;
+  }
+  if (!keyframe) {
+    return;
+  }
+
+  detect(state, stream, classifiers, workers);
+  stream.tracks.clear();
+  for (size_t i = 0; i < stream.runs.size(); i++) {
+    for (const auto &detection : stream.runs[i].detections) {
+      stream.tracks.push_back(track{cv::Rect2f(detection), i});
+    }
+  }
+  start_tracks(stream.gray, stream.tracks);
+  stream.frames_since_keyframe = 0;
+}
+
+/*
+ * Selects the tracked objects to publish for the current frame. Returns false if there is
+ * nothing to publish.
+ */
+bool select_objects(const struct state &state, stream_state &stream, bool &snapshot) {
+  if (state.output.delta) {
+    return stream.objects.changes(state.output.move_threshold,
+                                  state.output.snapshot_interval, snapshot,
+                                  stream.published_objects);
+  }
+  const auto &tracked = stream.objects.objects();
+  stream.published_objects.clear();
+  for (size_t i = 0; i < tracked.size(); i++) {
+    if (tracked[i].missed == 0) {
+      stream.published_objects.push_back(i);
+    }
+  }
+  return !stream.published_objects.empty();
+}
+
+void encode_frame(const struct state &state, stream_state &stream,
+                  const cv::Size &image_size, bool snapshot) {
+  const auto &tracked = stream.objects.objects();
+  auto &frame = stream.encoded_frame;
+  frame.timestamp_ms = bot_common::binary_output::now_ms();
+  frame.size = image_size;
+  frame.objects.clear();
+  for (size_t i : stream.published_objects) {
+    const auto &o = tracked[i];
+    frame.objects.push_back({o.id, o.rect, &state.cascades[o.label].tag});
+  }
+  frame.delta = state.output.delta;
+  frame.snapshot = snapshot;
+  frame.removed = stream.objects.removed();
+  stream.batch->add(frame);
+}
+
+/*
+ * Builds the analysis message of the current frame from the tracked objects, or returns
+ * null if there is nothing to publish. With binary output, returns the batch when due.
+ */
+nlohmann::json build_message(const struct state &state, stream_state &stream,
+                             const cv::Size &image_size) {
+  bool snapshot = false;
+  const bool publish = select_objects(state, stream, snapshot);
+  if (stream.batch) {
+    if (publish) {
+      encode_frame(state, stream, image_size, snapshot);
+    }
+    return stream.batch->due() ? stream.batch->take() : nullptr;
+  }
+  if (!publish) {
+    return nullptr;
+  }
+
+  const auto &tracked = stream.objects.objects();
   nlohmann::json objects = nlohmann::json::array();
+  for (size_t i : stream.published_objects) {
+    const auto &o = tracked[i];
+    objects.emplace_back(
+        build_object(o.rect, o.id, image_size, state.cascades[o.label].tag));
+  }
+  nlohmann::json message = build_analysis_message(std::move(objects));
+  if (state.output.delta) {
+    message["snapshot"] = snapshot;
+    if (!stream.objects.removed().empty()) {
+      message["removed"] = stream.objects.removed();
+    }
+  }
+  return message;
+}
+
+/*
+ * Sets how much the analysis of a stream is degraded by load shedding: level 2 detects
+ * on a half size frame, level 3 also skips every other level of the image pyramid.
+ * Level 1 only skips frames, see process_image.
+ */
+void set_shed_level(const struct state &state, stream_state &stream, uint32_t level) {
+  const double scale = level >= 2 ? 0.5 : 1.0;
+  if (scale != stream.analysis_scale) {
+    // What the adaptive search learnt is in the coordinates of the previous scale
+    for (size_t i = 0; i < stream.runs.size(); i++) {
+      stream.runs[i].search = state.cascades[i].search;
+    }
+  }
+  stream.analysis_scale = scale;
+  stream.coarse_pyramid = level >= 3;
+}
+
+// Maps a rectangle of the analysed grayscale frame to the frame.
+cv::Rect to_frame(const stream_state &stream, const cv::Rect &rect) {
+  if (stream.analysis_scale == 1.0) {
+    return rect;
+  }
+  const double scale = stream.analysis_scale;
+  return cv::Rect{cvRound(rect.x / scale), cvRound(rect.y / scale),
+                  cvRound(rect.width / scale), cvRound(rect.height / scale)};
+}
+
+/*
+ * Carries a stream over to a new configuration. Objects keep their ids if a cascade with
+ * the same tag is still configured, the others are reported as removed with the next
+ * frame. Tracks and the adaptive search start over. A binary batch is kept if the batch
+ * settings are the same, otherwise the frames it holds are returned for publication
+ * (null if there are none).
+ */
+nlohmann::json rebind(const struct state &state, stream_state &stream) {
+  std::vector<int> labels(stream.tags.size(), -1);
+  for (size_t i = 0; i < stream.tags.size(); i++) {
+    for (size_t j = 0; j < state.cascades.size(); j++) {
+      if (state.cascades[j].tag == stream.tags[i]) {
+        labels[i] = static_cast<int>(j);
+        break;
+      }
+    }
+  }
+  stream.objects.relabel(labels);
+  stream.objects.configure(state.output.min_iou, state.output.max_missed);
+  stream.tags.clear();
+  stream.runs.clear();
+  for (const auto &cascade : state.cascades) {
+    stream.tags.push_back(cascade.tag);
+    stream.runs.push_back(cascade_run{{}, {}, cascade.search});
+  }
+  stream.tracks.clear();
+  stream.previous_gray.release();
+  stream.frames_since_keyframe = 0;
+
+  const output_settings &old = stream.output;
+  const output_settings &output = state.output;
+  nlohmann::json flushed;
+  if (!stream.batch || !output.binary || output.encoding != old.encoding
+      || output.batch_frames != old.batch_frames
+      || output.batch_delay != old.batch_delay) {
+    if (stream.batch && stream.batch->frames() > 0) {
+      flushed = stream.batch->take();
+    }
+    stream.batch.reset(output.binary
+                           ? new bot_common::binary_output::batcher(
+                                 output.encoding, output.batch_frames, output.batch_delay)
+                           : nullptr);
+  }
+  stream.output = output;
+  stream.generation = state.generation;
+  return flushed;
+}
+
+/*
+ * Runs detection (or tracking) on a frame of a stream, matches the detections with the
+ * objects of the previous frames and returns the analysis message to publish, or null.
+ */
+nlohmann::json analyse(const struct state &state, stream_state &stream,
+                       const cv::Mat &image,
+                       std::vector<cv::CascadeClassifier> &classifiers,
+                       bot_common::worker_pool *workers) {
+  const cv::Size image_size{image.cols, image.rows};
+
+  // detectMultiScale would convert the frame to grayscale for every cascade
+  if (stream.analysis_scale < 1.0) {
+    cv::cvtColor(image, stream.full_gray, cv::COLOR_BGR2GRAY);
+    cv::resize(stream.full_gray, stream.gray, cv::Size(), stream.analysis_scale,
+               stream.analysis_scale, cv::INTER_AREA);
+  } else {
+    cv::cvtColor(image, stream.gray, cv::COLOR_BGR2GRAY);
+  }
+  if (state.equalize) {
+    cv::equalizeHist(stream.gray, stream.gray);
+  }
+
+  // Detections are listed in cascade order, independent of which cascade finished first
+  stream.detections.clear();
+  if (state.tracking) {
+    track_or_detect(state, stream, classifiers, workers);
+    const cv::Rect frame{cv::Point{0, 0}, image_size};
+    for (const auto &t : stream.tracks) {
+      const cv::Rect box = to_frame(stream, cv::Rect(t.box)) & frame;
+      if (box.area() > 0) {
+        stream.detections.push_back({box, static_cast<uint32_t>(t.cascade)});
+      }
+    }
+    cv::swap(stream.gray, stream.previous_gray);
+  } else {
+    detect(state, stream, classifiers, workers);
+    for (size_t i = 0; i < stream.runs.size(); i++) {
+      for (const auto &detection : stream.runs[i].detections) {
+        stream.detections.push_back(
+            {to_frame(stream, detection), static_cast<uint32_t>(i)});
+      }
+    }
+  }
+  stream.objects.update(stream.detections);
+
+  return build_message(state, stream, image_size);
+}
+
+// Analyses a frame of a hosted stream on a host worker, with the current configuration.
+void analyse_hosted(hosted_streams &hosted, size_t index, size_t worker,
+                    const cv::Mat &frame, std::vector<nlohmann::json> &messages) {
+  const std::shared_ptr<struct state> state = std::atomic_load(&hosted.state);
+  stream_state &stream = hosted.streams[index];
+  if (stream.generation != state->generation) {
+    nlohmann::json flushed = rebind(*state, stream);
+    if (!flushed.is_null()) {
+      messages.push_back(std::move(flushed));
+    }
+  }
+  nlohmann::json message =
+      analyse(*state, stream, frame, state->worker_classifiers[worker], nullptr);
+  if (!message.is_null()) {
+    messages.push_back(std::move(message));
+  }
+}
+
+/*
+ * Publishes what the host streams found since the previous call, tagged with the stream.
+ * Only the SDK thread can publish, so this runs on every frame of the bot's input and
+ * every command; messages the host drops meanwhile are logged.
+ */
+void publish_stream_results(sv::bot_context &context, hosted_streams &hosted) {
+  hosted.host->take_results(hosted.results);
+  for (auto &result : hosted.results) {
+    result.message["stream"] = hosted.host->sources()[result.stream].id;
+    bot_message(context, sv::bot_message_kind::ANALYSIS, std::move(result.message));
+  }
+  const uint64_t dropped = hosted.host->dropped_results();
+  if (dropped != hosted.dropped_results) {
+    LOG_S(WARNING) << "Dropped " << dropped - hosted.dropped_results
+                   << " results of hosted streams, the input is too slow to publish them";
+    hosted.dropped_results = dropped;
+  }
+}
+
+/*
+ * Installs a new configuration. The host workers switch to it with their next frame, the
+ * bot's input right away. Results of a replaced host go out first; the old state and
+ * host are destroyed on the hot_swap thread.
+ */
+void replace_state(sv::bot_context &context, struct instance &instance,
+                   std::shared_ptr<configuration> &&next) {
+  if (instance.hosted) {
+    publish_stream_results(context, *instance.hosted);
+  }
+  if (next->hosted) {
+    std::atomic_store(&next->hosted->state, next->state);
+  }
+  std::swap(instance.state, next->state);
+  std::shared_ptr<hosted_streams> hosted = next->hosted;
+  next->hosted = instance.hosted;
+  std::atomic_store(&instance.hosted, std::move(hosted));
+  instance.configurations.retire(std::move(next));
+
+  nlohmann::json flushed = rebind(*instance.state, instance.input);
+  if (!flushed.is_null()) {
+    bot_message(context, sv::bot_message_kind::ANALYSIS, std::move(flushed));
+  }
+  instance.shedder.configure(instance.state->load_shedding);
+  LOG_S(INFO) << "Configuration replaced";
+}
+
+// Publishes a change of the load shedding level to the control channel. Control
+// messages need a "to" field, so the change is only logged until a configuration gave the
+// bot its id.
+void publish_load_change(sv::bot_context &context, struct instance &instance) {
+  nlohmann::json event;
+  if (!instance.shedder.take_change(event)) {
+    return;
+  }
+  if (instance.bot_id.empty()) {
+    LOG_S(INFO) << "Load shedding (no bot id yet, not published): " << event;
+    return;
+  }
+  LOG_S(INFO) << "Load shedding: " << event;
+  event["to"] = instance.bot_id;
+  bot_message(context, sv::bot_message_kind::CONTROL, std::move(event));
+}
 
-  for (auto &cascade : state->cascades) {
-    std::vector<cv::Rect> detections;
-    cascade.classifier.detectMultiScale(image, detections);
+void process_image(sv::bot_context &context, const cv::Mat &image) {
+  auto &instance = *static_cast<struct instance *>(context.instance_data);
+  instance.tracer.flush();
+  bot_common::tracing::span frame_span(instance.tracer, instance.frame_stage);
+  if (auto next = instance.configurations.take()) {
+    replace_state(context, instance, std::move(next));
+  }
+  struct state *state = instance.state.get();
+  stream_state &input = instance.input;
 
-    for (const auto &detection : detections) {
-      objects.emplace_back(
-          build_object(detection, state->detection_id++, image_size, cascade.tag));
+  if (instance.hosted) {
+    publish_stream_results(context, *instance.hosted);
+  }
+
+  const bool admitted = instance.shedder.admit();
+  publish_load_change(context, instance);
+  if (!admitted) {
+    if (input.batch && input.batch->due()) {
+      bot_message(context, sv::bot_message_kind::ANALYSIS, input.batch->take());
     }
+    return;
   }
+  bot_common::load_shedder::busy busy(instance.shedder);
+  set_shed_level(*state, input, instance.shedder.level());
 
-  if (objects.empty()) {
+  nlohmann::json message =
+      analyse(*state, input, image, state->classifiers, state->workers.get());
+  if (message.is_null()) {
     return;
   }
 
-  bot_message(context, sv::bot_message_kind::ANALYSIS,
-              build_analysis_message(std::move(objects)));
+  bot_message(context, sv::bot_message_kind::ANALYSIS, std::move(message));
+}
+
+// Sizes are given as [width, height] in pixels
+cv::Size parse_size(const nlohmann::json &size) {
+  check_config(size.is_array() && size.size() == 2 && size[0].is_number_unsigned()
+                   && size[1].is_number_unsigned(),
+               "size is not [width, height]: " + size.dump());
+  return cv::Size{size[0].get<int>(), size[1].get<int>()};
+}
+
+cv::CascadeClassifier load_classifier(cascade_cache &cache,
+                                      const std::string &cascade_file) {
+  cv::CascadeClassifier classifier;
+  check_config(cache.load("models/" + cascade_file, classifier),
+               "Can't load classifier " + cascade_file);
+  return classifier;
+}
+
+cascade load_cascade(const std::string &cascade_file, const nlohmann::json &settings) {
+  struct cascade cascade;
+  cascade.file = cascade_file;
+
+  if (settings.is_string()) {
+    cascade.tag = settings;
+  } else {
+    check_config(settings.is_object(),
+                 "bad settings for " + cascade_file + ": " + settings.dump());
+    check_config(settings.find("tag") != settings.end() && settings["tag"].is_string(),
+                 "no tag for " + cascade_file + ": " + settings.dump());
+    cascade.tag = settings["tag"];
+
+    if (settings.find("parent") != settings.end()) {
+      check_config(settings["parent"].is_string(),
+                   "parent is not a string: " + settings.dump());
+      cascade.parent_tag = settings["parent"];
+    }
+    if (settings.find("minRelativeSize") != settings.end()) {
+      check_config(settings["minRelativeSize"].is_number(),
+                   "bad minRelativeSize: " + settings.dump());
+      cascade.min_relative_size = settings["minRelativeSize"];
+    }
+    if (settings.find("maxRelativeSize") != settings.end()) {
+      check_config(settings["maxRelativeSize"].is_number(),
+                   "bad maxRelativeSize: " + settings.dump());
+      cascade.max_relative_size = settings["maxRelativeSize"];
+    }
+
+    if (settings.find("scaleFactor") != settings.end()) {
+      check_config(settings["scaleFactor"].is_number() && settings["scaleFactor"] > 1,
+                   "scaleFactor is not a number above 1: " + settings.dump());
+      cascade.scale_factor = settings["scaleFactor"];
+    }
+    if (settings.find("minNeighbors") != settings.end()) {
+      check_config(settings["minNeighbors"].is_number_unsigned(),
+                   "bad minNeighbors: " + settings.dump());
+      cascade.min_neighbors = settings["minNeighbors"];
+    }
+    if (settings.find("minSize") != settings.end()) {
+      cascade.min_size = parse_size(settings["minSize"]);
+    }
+    if (settings.find("maxSize") != settings.end()) {
+      cascade.max_size = parse_size(settings["maxSize"]);
+    }
+    if (settings.find("adaptive") != settings.end()) {
+      auto &adaptive = settings["adaptive"];
+      check_config(adaptive.is_object(), "adaptive is not an object: " + settings.dump());
+      cascade.adaptive = true;
+      if (adaptive.find("history") != adaptive.end()) {
+        check_config(adaptive["history"].is_number_unsigned(),
+                     "bad history: " + settings.dump());
+        cascade.search.history = adaptive["history"];
+      }
+      if (adaptive.find("widenInterval") != adaptive.end()) {
+        check_config(adaptive["widenInterval"].is_number_unsigned()
+                         && adaptive["widenInterval"] > 0,
+                     "bad widenInterval: " + settings.dump());
+        cascade.search.widen_interval = adaptive["widenInterval"];
+      }
+      if (adaptive.find("margin") != adaptive.end()) {
+        check_config(adaptive["margin"].is_number() && adaptive["margin"] >= 0
+                         && adaptive["margin"] < 1,
+                     "bad margin: " + settings.dump());
+        cascade.search.margin = adaptive["margin"];
+      }
+    }
+  }
+
+  return cascade;
+}
+
+output_settings parse_output(const nlohmann::json &output) {
+  check_config(output.is_object(), "output is not an object: " + output.dump());
+  output_settings settings;
+  if (output.find("mode") != output.end()) {
+    check_config(output["mode"] == "all" || output["mode"] == "delta",
+                 "mode is not \"all\" or \"delta\": " + output.dump());
+    settings.delta = output["mode"] == "delta";
+  }
+  if (output.find("moveThreshold") != output.end()) {
+    check_config(output["moveThreshold"].is_number() && output["moveThreshold"] >= 0,
+                 "bad moveThreshold: " + output.dump());
+    settings.move_threshold = output["moveThreshold"];
+  }
+  if (output.find("snapshotInterval") != output.end()) {
+    check_config(output["snapshotInterval"].is_number_unsigned()
+                     && output["snapshotInterval"] > 0,
+                 "snapshotInterval is not a positive integer: " + output.dump());
+    settings.snapshot_interval = output["snapshotInterval"];
+  }
+  if (output.find("minIou") != output.end()) {
+    check_config(output["minIou"].is_number() && output["minIou"] > 0
+                     && output["minIou"] <= 1,
+                 "bad minIou: " + output.dump());
+    settings.min_iou = output["minIou"];
+  }
+  if (output.find("maxMissed") != output.end()) {
+    check_config(output["maxMissed"].is_number_unsigned(),
+                 "bad maxMissed: " + output.dump());
+    settings.max_missed = output["maxMissed"];
+  }
+  if (output.find("encoding") != output.end()) {
+    auto &encoding = output["encoding"];
+    check_config(encoding == "json" || encoding == "cbor" || encoding == "msgpack",
+                 "encoding is not \"json\", \"cbor\" or \"msgpack\": " + output.dump());
+    settings.binary = encoding != "json";
+    settings.encoding = encoding == "msgpack" ? bot_common::binary_output::format::msgpack
+                                              : bot_common::binary_output::format::cbor;
+  }
+  if (output.find("batchFrames") != output.end()) {
+    check_config(output["batchFrames"].is_number_unsigned() && output["batchFrames"] > 0,
+                 "batchFrames is not a positive integer: " + output.dump());
+    settings.batch_frames = output["batchFrames"];
+  }
+  if (output.find("batchMs") != output.end()) {
+    check_config(output["batchMs"].is_number_unsigned(), "bad batchMs: " + output.dump());
+    settings.batch_delay = std::chrono::milliseconds(output["batchMs"].get<uint64_t>());
+  }
+  return settings;
+}
+
+/*
+ * Load shedding of the bot's own input, enabled by the presence of the settings (see
+ * load_shedder).
+ */
+bot_common::load_shedder::settings parse_load_shedding(const nlohmann::json &shedding) {
+  check_config(shedding.is_object(), "loadShedding is not an object: " + shedding.dump());
+  bot_common::load_shedder::settings settings;
+  settings.enabled = true;
+  if (shedding.find("frameRate") != shedding.end()) {
+    check_config(shedding["frameRate"].is_number() && shedding["frameRate"] >= 0,
+                 "bad frameRate: " + shedding.dump());
+    settings.frame_rate = shedding["frameRate"];
+  }
+  if (shedding.find("high") != shedding.end()) {
+    check_config(shedding["high"].is_number() && shedding["high"] > 0,
+                 "bad high: " + shedding.dump());
+    settings.high = shedding["high"];
+  }
+  if (shedding.find("low") != shedding.end()) {
+    check_config(shedding["low"].is_number() && shedding["low"] >= 0,
+                 "bad low: " + shedding.dump());
+    settings.low = shedding["low"];
+  }
+  check_config(settings.low < settings.high, "low is not below high: " + shedding.dump());
+  if (shedding.find("window") != shedding.end()) {
+    check_config(shedding["window"].is_number_unsigned() && shedding["window"] > 0,
+                 "window is not a positive integer: " + shedding.dump());
+    settings.window = shedding["window"];
+  }
+  if (shedding.find("hold") != shedding.end()) {
+    check_config(shedding["hold"].is_number_unsigned(), "bad hold: " + shedding.dump());
+    settings.hold = shedding["hold"];
+  }
+  return settings;
+}
+
+/*
+ * Resolves parent tags and groups cascades by their depth in the hierarchy.
+ */
+void build_levels(struct state &state) {
+  for (auto &cascade : state.cascades) {
+    if (cascade.parent_tag.empty()) {
+      continue;
+    }
+    for (size_t i = 0; i < state.cascades.size(); i++) {
+      if (state.cascades[i].tag == cascade.parent_tag) {
+        cascade.parents.push_back(i);
+      }
+    }
+    check_config(!cascade.parents.empty(), "no cascade tagged " + cascade.parent_tag);
+  }
+
+  std::vector<int> depth(state.cascades.size(), -1);
+  size_t assigned = 0;
+  for (int level = 0; assigned < state.cascades.size(); level++) {
+    std::vector<size_t> cascades;
+    for (size_t i = 0; i < state.cascades.size(); i++) {
+      const auto &parents = state.cascades[i].parents;
+      const bool ready =
+          depth[i] < 0 && std::all_of(parents.begin(), parents.end(), [&](size_t p) {
+            return depth[p] >= 0 && depth[p] < level;
+          });
+      if (ready) {
+        cascades.push_back(i);
+      }
+    }
+    check_config(!cascades.empty(), "cascade parents form a cycle");
+    for (size_t i : cascades) {
+      depth[i] = level;
+    }
+    assigned += cascades.size();
+    state.levels.push_back(std::move(cascades));
+  }
+}
+
+std::vector<cv::CascadeClassifier> load_classifiers(const struct state &state,
+                                                    cascade_cache &cache) {
+  std::vector<cv::CascadeClassifier> classifiers;
+  classifiers.reserve(state.cascades.size());
+  for (const auto &cascade : state.cascades) {
+    classifiers.push_back(load_classifier(cache, cascade.file));
+  }
+  return classifiers;
+}
+
+/*
+ * Starts host mode for a configuration: every source is analysed like the bot's own
+ * input, on the host workers, and its results are published with a "stream" field.
+ */
+std::shared_ptr<hosted_streams> start_host(const std::shared_ptr<struct state> &state) {
+  bot_common::stream_host::settings settings =
+      bot_common::stream_host::parse_settings(state->streams);
+  auto hosted = std::make_shared<hosted_streams>();
+  hosted->settings = state->streams;
+  hosted->streams.resize(settings.sources.size());
+  hosted->state = state;
+
+  hosted_streams *h = hosted.get();
+  hosted->host.reset(new bot_common::stream_host(
+      std::move(settings),
+      [h](size_t stream, size_t worker, const cv::Mat &frame,
+          std::vector<nlohmann::json> &messages) {
+        analyse_hosted(*h, stream, worker, frame, messages);
+      }));
+  LOG_S(INFO) << "Hosting " << hosted->host->sources().size() << " streams on "
+              << hosted->host->workers() << " threads";
+  return hosted;
 }
 
 /*
@@ -69,9 +918,178 @@ void process_image(sv::bot_context &context, const cv::Mat &image) {
  *   "frontalface_default.xml": "some face",
  *   "smile.xml": "some smile"
  * }
+ *
+ * To set options, the map goes to a "cascades" field and a tag may be replaced by an
+ * object with a "tag" field. A cascade with a "parent" tag only runs inside the
+ * detections of the cascades with that tag, looking for objects between
+ * "minRelativeSize" (default 0.1) and "maxRelativeSize" (default 1) of the parent size:
+ * {
+ *   "cascades": {
+ *     "frontalface_default.xml": {"tag": "some face"},
+ *     "smile.xml": {"tag": "some smile", "parent": "some face", "minRelativeSize": 0.2}
+ *   },
+ *   "equalize": true,  // equalize frame histogram before detection, default false
+ *   "threads": 2,      // threads running cascades, default one per cascade up to core count
+ *   "tracking": {      // detect-then-track mode, off by default
+ *     "keyframeInterval": 10,  // run cascades at least every 10 frames
+ *     "minConfidence": 0.5     // or when a track keeps less than half of its points
+ *   },
+ *   "output": {        // object ids and publishing, see output_settings
+ *     "mode": "delta",         // "all" (default) publishes every frame with objects
+ *     "moveThreshold": 0.1,    // delta mode: republish objects moved by 10% of size
+ *     "snapshotInterval": 30,  // delta mode: publish all objects every 30 frames
+ *     "minIou": 0.3,           // overlap needed to keep the id of an object
+ *     "maxMissed": 2,          // frames an object may go undetected and keep its id
+ *     "encoding": "cbor",      // "json" (default), or batches of "cbor" or "msgpack"
+ *     "batchFrames": 10,       // binary output: frames per batch at most
+ *     "batchMs": 500           // binary output: publish batches older than 500ms
+ *   },
+ *   "streams": {       // host mode, more streams analysed in the same process
+ *     "sources": [{"id": "lobby", "url": "rtsp://camera/stream"}],
+ *     "threads": 4,       // host threads, default one per available CPU
+ *     "maxPending": 2,    // frames waiting per stream before dropping, 0 is unlimited
+ *     "maxResults": 1000  // messages waiting for publication before dropping the oldest
+ *   },
+ *   "loadShedding": {  // degrade the analysis of the bot's input when it falls behind
+ *     "frameRate": 25,  // frames per second of the input, default 0 measures wall time
+ *     "high": 0.9,      // one level more above 90% load
+ *     "low": 0.5,       // one level less below 50% load
+ *     "window": 25,     // frames per load measurement
+ *     "hold": 4         // windows between a level change and a level less
+ *   }
+ * }
+ *
+ * Cascade settings also take detectMultiScale parameters, and top level cascades an
+ * adaptive search mode (see adaptive_search):
+ * "frontalface_default.xml": {
+ *   "tag": "some face",
+ *   "scaleFactor": 1.2, "minNeighbors": 3, "minSize": [40, 40], "maxSize": [200, 200],
+ *   "adaptive": {"history": 30, "widenInterval": 30, "margin": 0.5}
+ * }
+ *
+ * Throws config_error (or a json exception) if the configuration is invalid.
+ */
+std::shared_ptr<state> build_state(const nlohmann::json &body, instance &instance) {
+  check_config(body.is_object() && !body.empty(),
+               "Configuration was not provided: " + body.dump());
+  auto state = std::make_shared<struct state>();
+  state->tracer = &instance.tracer;
+  state->detect_stage = instance.detect_stage;
+  state->track_stage = instance.track_stage;
+
+  const bool has_options = body.find("cascades") != body.end();
+  auto &cascades = has_options ? body["cascades"] : body;
+  check_config(cascades.is_object(), "cascades is not an object: " + body.dump());
+  check_config(!cascades.empty(), "No cascades provided: " + body.dump());
+
+  state->cascades.reserve(cascades.size());
+  for (auto it = cascades.begin(); it != cascades.end(); it++) {
+    state->cascades.push_back(load_cascade(it.key(), it.value()));
+  }
+  build_levels(*state);
+
+  size_t threads = bot_common::worker_pool::workers_for(state->cascades.size()) + 1;
+  if (has_options) {
+    if (body.find("equalize") != body.end()) {
+      check_config(body["equalize"].is_boolean(),
+                   "equalize is not a boolean: " + body.dump());
+      state->equalize = body["equalize"];
+    }
+    if (body.find("threads") != body.end()) {
+      check_config(body["threads"].is_number_unsigned() && body["threads"] > 0,
+                   "threads is not a positive integer: " + body.dump());
+      threads = body["threads"];
+    }
+    if (body.find("output") != body.end()) {
+      state->output = parse_output(body["output"]);
+    }
+    if (body.find("tracking") != body.end()) {
+      auto &tracking = body["tracking"];
+      check_config(tracking.is_object(), "tracking is not an object: " + body.dump());
+      state->tracking = true;
+      if (tracking.find("keyframeInterval") != tracking.end()) {
+        check_config(tracking["keyframeInterval"].is_number_unsigned()
+                         && tracking["keyframeInterval"] > 0,
+                     "keyframeInterval is not a positive integer: " + body.dump());
+        state->keyframe_interval = tracking["keyframeInterval"];
+      }
+      if (tracking.find("minConfidence") != tracking.end()) {
+        check_config(tracking["minConfidence"].is_number(),
+                     "bad minConfidence: " + body.dump());
+        state->min_confidence = tracking["minConfidence"];
+      }
+    }
+    if (body.find("loadShedding") != body.end()) {
+      state->load_shedding = parse_load_shedding(body["loadShedding"]);
+    }
+  }
+  state->workers = std::make_unique<bot_common::worker_pool>(threads - 1);
+
+  state->classifiers = load_classifiers(*state, instance.cascades);
+  if (has_options && body.find("streams") != body.end()) {
+    state->streams = body["streams"];
+    const bot_common::stream_host::settings settings =
+        bot_common::stream_host::parse_settings(state->streams);
+    for (size_t i = 0; i < settings.threads; i++) {
+      state->worker_classifiers.push_back(load_classifiers(*state, instance.cascades));
+    }
+  }
+  state->generation = ++instance.generations;
+
+  return state;
+}
+
+/*
+ * Builds the state of a configuration. Host mode goes on with the current host if its
+ * streams settings are the same, otherwise a new host starts.
+ */
+std::shared_ptr<configuration> build_configuration(const nlohmann::json &body,
+                                                   instance &instance) {
+  auto built = std::make_shared<configuration>();
+  built->state = build_state(body, instance);
+  if (!built->state->streams.is_null()) {
+    std::shared_ptr<hosted_streams> current = std::atomic_load(&instance.hosted);
+    if (current && current->settings == built->state->streams) {
+      built->hosted = std::move(current);
+    } else {
+      built->hosted = start_host(built->state);
+    }
+  }
+  return built;
+}
+
+/*
+ * Builds a configuration sent while the bot runs, on the hot_swap thread. An invalid one
+ * is logged and dropped, frames go on with the current configuration.
+ */
+std::shared_ptr<configuration> reload_configuration(const nlohmann::json &body,
+                                                    instance &instance) {
+  try {
+    return build_configuration(body, instance);
+  } catch (const std::exception &e) {
+    LOG_S(ERROR) << "Invalid configuration, keeping the current one: " << e.what();
+    return nullptr;
+  }
+}
+
+/*
+ * The first configuration is built right away, the bot stops if it is invalid.
+ * Configurations sent later, e.g. on the control channel as
+ * {"to": "<bot id>", "action": "configure", "body": {...}}, replace it without a restart
+ * (see instance), or are ignored if invalid.
  */
 nlohmann::json process_command(sv::bot_context &context, const nlohmann::json &config) {
   CHECK_S(config.is_object()) << "config is not an object: " << config;
+  if (context.instance_data != nullptr) {
+    auto &instance = *static_cast<struct instance *>(context.instance_data);
+    if (instance.hosted) {
+      publish_stream_results(context, *instance.hosted);
+    }
+  }
+  if (config.find("ack") != config.end()) {
+    // Our own acknowledgement, back from the control channel
+    return nullptr;
+  }
   CHECK_S(config.find("action") != config.end()) << "no action in config: " << config;
 
   auto &action = config["action"];
@@ -80,31 +1098,32 @@ nlohmann::json process_command(sv::bot_context &context, const nlohmann::json &c
   if (action == "configure") {
     CHECK_S(config.find("body") != config.end()) << "no body in config: " << config;
     auto &body = config["body"];
-    CHECK_S(body.is_object()) << "body is not an object: " << body;
-    CHECK_GT_S(body.size(), 0) << "Configuration was not provided: " << config;
-
-    CHECK_S(context.instance_data == nullptr) << "state should be null";
 
-    std::unique_ptr<struct state> state = std::make_unique<struct state>();
-
-    for (auto it = body.begin(); it != body.end(); it++) {
-      CHECK_S(it.value().is_string()) << "value is not a string: " << config;
-
-      std::string cascade_file = it.key();
-      std::string cascade_tag = it.value();
-
-      struct cascade cascade;
-
-      if (!cascade.classifier.load("models/" + cascade_file)) {
-        ABORT_S() << "Can't load classifier " << cascade_file;
+    if (context.instance_data == nullptr) {
+      auto *instance = new struct instance(context);
+      std::shared_ptr<configuration> first;
+      try {
+        first = build_configuration(body, *instance);
+      } catch (const std::exception &e) {
+        ABORT_S() << "Invalid configuration: " << e.what();
       }
-
-      cascade.tag = cascade_tag;
-      state->cascades.push_back(std::move(cascade));
+      instance->state = std::move(first->state);
+      instance->hosted = std::move(first->hosted);
+      rebind(*instance->state, instance->input);
+      instance->shedder.configure(instance->state->load_shedding);
+      context.instance_data = instance;
+      LOG_S(INFO) << "Bot is initialized";
+    } else {
+      // Frames go on with the current configuration until the new one is built
+      static_cast<struct instance *>(context.instance_data)->configurations.request(body);
+      LOG_S(INFO) << "Reconfiguring: " << body;
+    }
+    if (config.find("to") != config.end()) {
+      if (config["to"].is_string()) {
+        static_cast<struct instance *>(context.instance_data)->bot_id = config["to"];
+      }
+      return {{"ack", true}, {"to", config["to"]}, {"action", "configure"}};
     }
-
-    context.instance_data = state.release();
-    LOG_S(INFO) << "Bot is initialized";
   }
 
   return nullptr;
@@ -112,8 +1131,10 @@ nlohmann::json process_command(sv::bot_context &context, const nlohmann::json &c
 
 }  // namespace haar_cascades_bot
 
+#ifndef BOT_BENCH
 int main(int argc, char *argv[]) {
   sv::opencv_bot_register(
       {&haar_cascades_bot::process_image, &haar_cascades_bot::process_command});
   return sv::opencv_bot_main(argc, argv);
 }
+#endif
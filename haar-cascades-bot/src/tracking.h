@@ -0,0 +1,135 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+namespace haar_cascades_bot {
+
+/*
+ * Detection followed between keyframes with pyramidal Lucas-Kanade optical flow.
+ */
+struct track {
+  cv::Rect2f box;
+  // Index of the cascade which made the detection
+  size_t cascade;
+  // Corner points inside the box, in frame coordinates
+  std::vector<cv::Point2f> points;
+  // Number of points found when the track was started
+  size_t initial_points{0};
+};
+
+namespace tracking_detail {
+
+constexpr int max_points_per_track = 30;
+constexpr int min_points_per_track = 4;
+// Forward-backward error (in pixels) above which a tracked point is dropped
+constexpr float max_forward_backward_error = 1.0f;
+
+inline float median(std::vector<float> &values) {
+  auto middle = values.begin() + values.size() / 2;
+  std::nth_element(values.begin(), middle, values.end());
+  return *middle;
+}
+
+}  // namespace tracking_detail
+
+/*
+ * Picks the points to follow inside every track box.
+ */
+inline void start_tracks(const cv::Mat &gray, std::vector<track> &tracks) {
+  const cv::Rect frame{0, 0, gray.cols, gray.rows};
+  std::vector<cv::Point2f> corners;
+  for (auto &t : tracks) {
+    t.points.clear();
+    const cv::Rect roi = cv::Rect(t.box) & frame;
+    if (roi.area() > 0) {
+      cv::goodFeaturesToTrack(gray(roi), corners, tracking_detail::max_points_per_track,
+                              0.01, 3);
+      for (const auto &corner : corners) {
+        t.points.emplace_back(corner.x + roi.x, corner.y + roi.y);
+      }
+    }
+    t.initial_points = t.points.size();
+  }
+}
+
+/*
+ * Moves every track from previous_gray to gray. Boxes follow the median motion of their
+ * points and are scaled by the median change of point distances to the box center.
+ * Returns the lowest track confidence, i.e. the fraction of its initial points still
+ * reliably tracked, or 1 if there are no tracks.
+ */
+inline double update_tracks(const cv::Mat &previous_gray, const cv::Mat &gray,
+                            std::vector<track> &tracks) {
+  using namespace tracking_detail;
+
+  std::vector<cv::Point2f> points;
+  for (const auto &t : tracks) {
+    points.insert(points.end(), t.points.begin(), t.points.end());
+  }
+  if (points.empty()) {
+    return tracks.empty() ? 1.0 : 0.0;
+  }
+
+  std::vector<cv::Point2f> moved;
+  std::vector<cv::Point2f> back;
+  std::vector<uchar> status;
+  std::vector<uchar> back_status;
+  std::vector<float> error;
+  cv::calcOpticalFlowPyrLK(previous_gray, gray, points, moved, status, error);
+  cv::calcOpticalFlowPyrLK(gray, previous_gray, moved, back, back_status, error);
+
+  double min_confidence = 1.0;
+  size_t offset = 0;
+  std::vector<size_t> kept;
+  std::vector<float> dx, dy, scales;
+  for (auto &t : tracks) {
+    kept.clear();
+    dx.clear();
+    dy.clear();
+    for (size_t i = offset; i < offset + t.points.size(); i++) {
+      if (status[i] == 0 || back_status[i] == 0
+          || cv::norm(back[i] - points[i]) > max_forward_backward_error) {
+        continue;
+      }
+      kept.push_back(i);
+      dx.push_back(moved[i].x - points[i].x);
+      dy.push_back(moved[i].y - points[i].y);
+    }
+    offset += t.points.size();
+
+    const double confidence =
+        t.initial_points > 0 && kept.size() >= static_cast<size_t>(min_points_per_track)
+            ? static_cast<double>(kept.size()) / t.initial_points
+            : 0.0;
+    min_confidence = std::min(min_confidence, confidence);
+    if (confidence == 0) {
+      t.points.clear();
+      continue;
+    }
+
+    const cv::Point2f center{t.box.x + t.box.width / 2, t.box.y + t.box.height / 2};
+    const cv::Point2f moved_center = center + cv::Point2f{median(dx), median(dy)};
+    scales.clear();
+    for (size_t i : kept) {
+      const double distance = cv::norm(points[i] - center);
+      if (distance > 1) {
+        scales.push_back(static_cast<float>(cv::norm(moved[i] - moved_center) / distance));
+      }
+    }
+    const float scale = scales.empty() ? 1.0f : median(scales);
+    const float width = t.box.width * scale;
+    const float height = t.box.height * scale;
+    t.box = cv::Rect2f{moved_center.x - width / 2, moved_center.y - height / 2, width, height};
+
+    t.points.clear();
+    for (size_t i : kept) {
+      t.points.push_back(moved[i]);
+    }
+  }
+
+  return min_confidence;
+}
+
+}  // namespace haar_cascades_bot
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "background_kernels.h"
+
+namespace motion_detector_bot {
+
+/*
+ * Background model of a tile. apply() classifies the pixels of a frame as background or
+ * foreground, in an 8-bit mask of the frame size where foreground is non-zero (KNN and
+ * MOG2 mark shadows with 127), and learns from the frame.
+ *
+ * - knn: OpenCV's BackgroundSubtractorKNN, the most robust and the most expensive.
+ * - mog2: OpenCV's BackgroundSubtractorMOG2, a mixture of gaussians per pixel.
+ * - average, median: running average or approximate median of the luma (see
+ *   background_kernels.h) on a frame downscaled by 2, several times cheaper per pixel.
+ *   Good enough for scenes with a stable background, like most indoor cameras.
+ */
+enum class engine_kind { knn, mog2, average, median };
+
+class background_engine {
+ public:
+  virtual ~background_engine() = default;
+  virtual void apply(const cv::Mat &image, cv::Mat &mask) = 0;
+};
+
+inline const char *engine_name(engine_kind kind) {
+  switch (kind) {
+    case engine_kind::knn:
+      return "knn";
+    case engine_kind::mog2:
+      return "mog2";
+    case engine_kind::average:
+      return "average";
+    case engine_kind::median:
+      return "median";
+  }
+  return "";
+}
+
+// Returns false if name isn't an engine.
+inline bool parse_engine_kind(const std::string &name, engine_kind &kind) {
+  for (const engine_kind k : {engine_kind::knn, engine_kind::mog2, engine_kind::average,
+                              engine_kind::median}) {
+    if (name == engine_name(k)) {
+      kind = k;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Whether the engine only models luma, then frames are converted before blurring.
+inline bool engine_is_luma(engine_kind kind) {
+  return kind == engine_kind::average || kind == engine_kind::median;
+}
+
+// Gaussians per pixel of the MOG2 model, OpenCV's default
+constexpr int mog2_mixtures = 5;
+// The average engine moves 1/2^average_shift of the way to every frame
+constexpr int average_shift = 5;
+// The luma engines model a frame downscaled by luma_model_downscale
+constexpr int luma_model_downscale = 2;
+
+/*
+ * Model memory of an engine for a frame of `pixels` pixels, of `channels` channels for
+ * the OpenCV engines. OpenCV's KNN model stores 3 lists of `samples` samples of
+ * channels + 1 bytes per pixel, plus 6 bytes of bookkeeping; MOG2 stores a weight, a
+ * variance and a mean per channel for every gaussian, as floats, and a mode count.
+ */
+inline size_t engine_model_bytes(engine_kind kind, int channels, int samples,
+                                 size_t pixels) {
+  const size_t model_pixels = pixels / (luma_model_downscale * luma_model_downscale);
+  switch (kind) {
+    case engine_kind::knn:
+      return pixels * (static_cast<size_t>(samples) * 3 * (channels + 1) + 6);
+    case engine_kind::mog2:
+      return pixels * (mog2_mixtures * (channels + 2) * sizeof(float) + 1);
+    case engine_kind::average:
+      return model_pixels * (sizeof(int16_t) + 1);
+    case engine_kind::median:
+      return model_pixels * 2;
+  }
+  return 0;
+}
+
+class knn_engine : public background_engine {
+ public:
+  // Takes effect when the model is initialized by the first frame
+  explicit knn_engine(int samples)
+      : _subtractor(cv::createBackgroundSubtractorKNN(500, 500.0, true)) {
+    _subtractor->setNSamples(samples);
+  }
+
+  void apply(const cv::Mat &image, cv::Mat &mask) override {
+    _subtractor->apply(image, mask);
+  }
+
+ private:
+  cv::Ptr<cv::BackgroundSubtractorKNN> _subtractor;
+};
+
+class mog2_engine : public background_engine {
+ public:
+  mog2_engine() : _subtractor(cv::createBackgroundSubtractorMOG2(500, 16, true)) {
+    _subtractor->setNMixtures(mog2_mixtures);
+  }
+
+  void apply(const cv::Mat &image, cv::Mat &mask) override {
+    _subtractor->apply(image, mask);
+  }
+
+ private:
+  cv::Ptr<cv::BackgroundSubtractorMOG2> _subtractor;
+};
+
+/*
+ * Running average or median of the luma, at 1/luma_model_downscale of the frame size.
+ * The mask is scaled back up to the frame size. The first frame (or a frame of another
+ * size) starts a new model and has no foreground.
+ */
+class luma_engine : public background_engine {
+ public:
+  luma_engine(engine_kind kind, int threshold)
+      : _median(kind == engine_kind::median), _threshold(threshold) {}
+
+  void apply(const cv::Mat &image, cv::Mat &mask) override {
+    const cv::Mat *luma = &image;
+    if (image.channels() != 1) {
+      cv::cvtColor(image, _luma, cv::COLOR_BGR2GRAY);
+      luma = &_luma;
+    }
+    const cv::Size size{std::max(1, luma->cols / luma_model_downscale),
+                        std::max(1, luma->rows / luma_model_downscale)};
+    cv::resize(*luma, _small, size, 0, 0, cv::INTER_AREA);
+
+    if (_background.size() != size) {
+      if (_median) {
+        _small.copyTo(_background);
+      } else {
+        _small.convertTo(_background, CV_16S, 1 << average_fraction_bits);
+      }
+      _small_mask.create(size, CV_8UC1);
+      _small_mask.setTo(0);
+    } else {
+      for (int y = 0; y < size.height; y++) {
+        const uint8_t *row = _small.ptr<uint8_t>(y);
+        uint8_t *mask_row = _small_mask.ptr<uint8_t>(y);
+        if (_median) {
+          update_running_median(row, _background.ptr<uint8_t>(y), mask_row, size.width,
+                                _threshold);
+        } else {
+          update_running_average(row, _background.ptr<int16_t>(y), mask_row, size.width,
+                                 average_shift, _threshold);
+        }
+      }
+    }
+    cv::resize(_small_mask, mask, image.size(), 0, 0, cv::INTER_NEAREST);
+  }
+
+ private:
+  const bool _median;
+  const int _threshold;
+  cv::Mat _luma;
+  cv::Mat _small;
+  cv::Mat _background;
+  cv::Mat _small_mask;
+};
+
+/*
+ * Builds an engine. samples only applies to knn, threshold (in luma levels) to the luma
+ * engines.
+ */
+inline std::unique_ptr<background_engine> make_engine(engine_kind kind, int samples,
+                                                      int threshold) {
+  switch (kind) {
+    case engine_kind::knn:
+      return std::unique_ptr<background_engine>(new knn_engine(samples));
+    case engine_kind::mog2:
+      return std::unique_ptr<background_engine>(new mog2_engine());
+    case engine_kind::average:
+    case engine_kind::median:
+      return std::unique_ptr<background_engine>(new luma_engine(kind, threshold));
+  }
+  return nullptr;
+}
+
+}  // namespace motion_detector_bot
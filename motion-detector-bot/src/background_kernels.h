@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace motion_detector_bot {
+
+/*
+ * Per-pixel background models over rows of 8-bit luma, in the style of
+ * bot_common/pixel_kernels.h: compiled for AVX2 when built with -mavx2 and for SSE2 on
+ * any x86-64, other targets use the scalar loops. Every kernel compares a row with its
+ * background, writes 255 to mask where they differ by more than threshold luma levels
+ * and 0 elsewhere, then moves the background towards the row.
+ */
+
+// Fractional bits of the running average, 255 << 7 still fits a signed 16-bit lane
+constexpr int average_fraction_bits = 7;
+
+/*
+ * Exponential running average, background += (luma - background) / 2^shift, kept in
+ * fixed point with average_fraction_bits fractional bits. shift is 1 to 8.
+ */
+inline void update_running_average(const uint8_t *luma, int16_t *background,
+                                   uint8_t *mask, size_t n, int shift, int threshold) {
+  const int fixed_threshold = threshold << average_fraction_bits;
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i vthreshold = _mm256_set1_epi16(static_cast<int16_t>(fixed_threshold));
+  const __m128i vshift = _mm_cvtsi32_si128(shift);
+  for (; i + 32 <= n; i += 32) {
+    __m256i difference[2];
+    for (int half = 0; half < 2; half++) {
+      const __m256i x = _mm256_slli_epi16(
+          _mm256_cvtepu8_epi16(
+              _mm_loadu_si128(reinterpret_cast<const __m128i *>(luma + i + 16 * half))),
+          average_fraction_bits);
+      __m256i *b = reinterpret_cast<__m256i *>(background + i + 16 * half);
+      const __m256i vb = _mm256_loadu_si256(b);
+      const __m256i d = _mm256_sub_epi16(x, vb);
+      _mm256_storeu_si256(b, _mm256_add_epi16(vb, _mm256_sra_epi16(d, vshift)));
+      difference[half] = _mm256_cmpgt_epi16(_mm256_abs_epi16(d), vthreshold);
+    }
+    // packs works within 128-bit lanes, the permutation restores the pixel order
+    const __m256i packed = _mm256_permute4x64_epi64(
+        _mm256_packs_epi16(difference[0], difference[1]), 0xD8);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(mask + i), packed);
+  }
+#elif defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i vthreshold = _mm_set1_epi16(static_cast<int16_t>(fixed_threshold));
+  const __m128i vshift = _mm_cvtsi32_si128(shift);
+  for (; i + 16 <= n; i += 16) {
+    const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(luma + i));
+    const __m128i words[2] = {_mm_unpacklo_epi8(bytes, zero),
+                              _mm_unpackhi_epi8(bytes, zero)};
+    __m128i difference[2];
+    for (int half = 0; half < 2; half++) {
+      const __m128i x = _mm_slli_epi16(words[half], average_fraction_bits);
+      __m128i *b = reinterpret_cast<__m128i *>(background + i + 8 * half);
+      const __m128i vb = _mm_loadu_si128(b);
+      const __m128i d = _mm_sub_epi16(x, vb);
+      _mm_storeu_si128(b, _mm_add_epi16(vb, _mm_sra_epi16(d, vshift)));
+      // No abs_epi16 before SSSE3
+      const __m128i magnitude = _mm_max_epi16(d, _mm_sub_epi16(zero, d));
+      difference[half] = _mm_cmpgt_epi16(magnitude, vthreshold);
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(mask + i),
+                     _mm_packs_epi16(difference[0], difference[1]));
+  }
+#endif
+  for (; i < n; i++) {
+    const int d = (luma[i] << average_fraction_bits) - background[i];
+    background[i] = static_cast<int16_t>(background[i] + (d >> shift));
+    mask[i] = std::abs(d) > fixed_threshold ? 255 : 0;
+  }
+}
+
+/*
+ * Approximate running median: the background moves one luma level towards the row per
+ * frame, so it follows the median of the recent values and ignores short-lived changes
+ * like passing objects, which an average smears into the background.
+ */
+inline void update_running_median(const uint8_t *luma, uint8_t *background, uint8_t *mask,
+                                  size_t n, int threshold) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi8(1);
+  const __m256i vthreshold = _mm256_set1_epi8(static_cast<char>(threshold));
+  for (; i + 32 <= n; i += 32) {
+    const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(luma + i));
+    __m256i *b = reinterpret_cast<__m256i *>(background + i);
+    const __m256i vb = _mm256_loadu_si256(b);
+    const __m256i above = _mm256_subs_epu8(x, vb);
+    const __m256i below = _mm256_subs_epu8(vb, x);
+    const __m256i unchanged = _mm256_cmpeq_epi8(
+        _mm256_subs_epu8(_mm256_or_si256(above, below), vthreshold), zero);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(mask + i),
+                        _mm256_xor_si256(unchanged, _mm256_set1_epi8(-1)));
+    _mm256_storeu_si256(b, _mm256_subs_epu8(
+                               _mm256_adds_epu8(vb, _mm256_min_epu8(above, one)),
+                               _mm256_min_epu8(below, one)));
+  }
+#elif defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi8(1);
+  const __m128i vthreshold = _mm_set1_epi8(static_cast<char>(threshold));
+  for (; i + 16 <= n; i += 16) {
+    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(luma + i));
+    __m128i *b = reinterpret_cast<__m128i *>(background + i);
+    const __m128i vb = _mm_loadu_si128(b);
+    const __m128i above = _mm_subs_epu8(x, vb);
+    const __m128i below = _mm_subs_epu8(vb, x);
+    const __m128i unchanged =
+        _mm_cmpeq_epi8(_mm_subs_epu8(_mm_or_si128(above, below), vthreshold), zero);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(mask + i),
+                     _mm_xor_si128(unchanged, _mm_set1_epi8(-1)));
+    _mm_storeu_si128(b, _mm_subs_epu8(_mm_adds_epu8(vb, _mm_min_epu8(above, one)),
+                                      _mm_min_epu8(below, one)));
+  }
+#endif
+  for (; i < n; i++) {
+    const int d = luma[i] - background[i];
+    mask[i] = std::abs(d) > threshold ? 255 : 0;
+    background[i] = static_cast<uint8_t>(background[i] + (d > 0) - (d < 0));
+  }
+}
+
+}  // namespace motion_detector_bot
@@ -1,19 +1,31 @@
 #include <prometheus/counter.h>
 #include <prometheus/counter_builder.h>
 #include <prometheus/family.h>
-#include <prometheus/histogram.h>
-#include <prometheus/histogram_builder.h>
+#include <prometheus/gauge.h>
+#include <prometheus/gauge_builder.h>
 #include <satorivideo/opencv/opencv_bot.h>
 #include <satorivideo/opencv/opencv_utils.h>
 #include <satorivideo/video_bot.h>
+#include <atomic>
 #include <cstdlib>
-// Boost timer library
-#include <boost/timer/timer.hpp>
+#include <memory>
+#include <mutex>
+#include <thread>
 // GNU scientific library
 #include <gsl/gsl>
 // JSON for Modern C++
 #include <json.hpp>
 #include <opencv2/opencv.hpp>
+#include <bot_common/binary_output.h>
+#include <bot_common/load_shedder.h>
+#include <bot_common/object_tracker.h>
+#include <bot_common/pixel_kernels.h>
+#include <bot_common/stream_host.h>
+#include <bot_common/tracing.h>
+#include <bot_common/worker_pool.h>
+#include "background_engines.h"
+#include "motion_output.h"
+#include "tiles.h"
 
 #define LOGURU_WITH_STREAMS 1
 // Loguru for Modern C++
@@ -22,65 +34,6 @@
 using namespace std;
 namespace sv = satori::video;
 namespace motion_detector_bot {
-namespace {
-    /*
-    * Publishes the results of analyzing a frame to the analysis channel
-    * Adds meta-data fields to each message
-    */
-    void publish_contours_analysis(sv::bot_context &context, const cv::Size &original_size,
-                                   const std::vector<std::vector<cv::Point>> &contours) {
-      // Instantiates a JSON array
-      nlohmann::json rects = nlohmann::json::array();
-      // Iterates over the input vector
-      for (const auto &contour : contours) {
-        auto rect = boundingRect(contour);
-        // Instantiates a JSON object to hold the input vector
-        nlohmann::json obj = nlohmann::json::object();
-        // Sets the JSON object meta-data
-        obj["id"] = 1;
-        obj["color"] = "green";
-        // Scales the input vector
-        obj["rect"] = sv::opencv::to_json(sv::opencv::to_fractional(rect, original_size));
-        // Adds the resulting JSON object to an array of objects
-        rects.emplace_back(std::move(obj));
-      }
-      // Instantiates a JSON object for the message
-      nlohmann::json analysis_message = nlohmann::json::object();
-      // Sets the key for the message to "detected_objects" and the value to the array of objects
-      analysis_message["detected_objects"] = rects;
-      /*
-      * Publishes the message to the analysis channel
-      */
-      sv::bot_message(context, sv::bot_message_kind::ANALYSIS, std::move(analysis_message));
-    }
-    /*
-    * Defines a constant for initializing the latency buckets for a Prometheus histogram. For example, the first
-    * bucket is 0 to 0.1 seconds, the second bucket is .1 to .2 seconds, and so forth. The last bucket is 900 seconds
-    * and above.
-    */
-    constexpr std::initializer_list<double> latency_buckets = {
-        0,  0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.9, 1,  2,  3,
-        4,  5,   6,   7,   8,   9,   10,  20,  30,  40,  50, 60, 70,
-        80, 90,  100, 200, 300, 400, 500, 600, 700, 800, 900};
-    /*
-    * Uses Prometheus to time the duration of an image processing operation.
-    * To reduce memory usage, latency_reporter() does its work during its destructor.
-    */
-    class latency_reporter {
-        // Constructor. Initializes the histogram object
-    public:
-        explicit latency_reporter(prometheus::Histogram &hist) : _hist(hist) {}
-        /*
-        * Destructor. Just before cleanup, records the elapsed time since initialization.
-        * Timer returns milliseconds, so divide by 1 million to get seconds
-        */
-        ~latency_reporter() { _hist.Observe(_timer.elapsed().wall / 1e6); }
-    
-    private:
-        prometheus::Histogram &_hist;
-        boost::timer::cpu_timer _timer;
-    };
-    } // end namespace
     /*
     *  Moves configuration parameters from a configuration message to the bot context.
     *
@@ -88,11 +41,65 @@ namespace {
     *
     *  merge_json() sets parameters.feature_size_value to the value of the featureSize property in the message.
     *  to_json() returns a JSON property with key "featureSize" and value parameters.feature_size_value.
+    *
+    *  analysisScale (0 < analysisScale <= 1) sets the size of the frame the motion analysis runs on, relative to
+    *  the original frame. For example, 0.5 analyzes a 960x540 copy of a 1080p frame. featureSize stays in
+    *  original frame pixels.
+    *
+    *  tileColumns and tileRows split the analysed frame into a grid of tiles with their own background models,
+    *  processed in parallel. tileOverlap (in original frame pixels) extends every tile into its neighbours so
+    *  that objects on tile seams are detected. With the default 1x1 grid everything runs on the calling thread.
+    *
+    *  staticThreshold enables the static scene fast path: when the mean absolute difference between the luma of
+    *  two consecutive, heavily downsampled frames is below it, the frame is skipped without running the
+    *  background subtractor. staticRefreshFrames forces a full update after that many skipped frames in a row,
+    *  so that the background model follows slow changes like lighting. 0 disables the fast path.
+    *
+    *  Motion boxes keep their id across frames while they overlap a box of the previous frame by at least
+    *  minIou (intersection over union), or went undetected for at most maxMissed frames. outputMode "delta"
+    *  only publishes boxes which appeared, disappeared or moved by more than moveThreshold of their size,
+    *  with a snapshot of all boxes every snapshotInterval frames. outputMode "all" publishes every frame.
+    *
+    *  encoding "cbor" or "msgpack" publishes the boxes of up to batchFrames frames or batchMs milliseconds in
+    *  one compact binary message instead of a JSON message per frame (see binary_output.h).
+    *
+    *  memoryBudgetMB caps the memory of the background models, in MiB (see plan_background_model). 0, the
+    *  default, doesn't limit it.
+    *
+    *  loadShedding degrades the analysis while frames take longer than the frame interval (1 / frameRate, or
+    *  the wall time without a frame rate) for more than loadHigh of the time, and restores it below loadLow
+    *  (see load_shedder.h). Level 1 skips every other frame, level 2 halves the analysis scale and level 3
+    *  halves it again.
+    *
+    *  backgroundEngine picks the background model of the tiles, "knn" (the default), "mog2", "average" or
+    *  "median" (see background_engines.h). foregroundThreshold is the luma difference, in levels, above which
+    *  the "average" and "median" engines take a pixel for foreground.
     */
     struct parameters {
         uint32_t feature_size_value{5};
+        double analysis_scale{1.0};
+        uint32_t tile_columns{1};
+        uint32_t tile_rows{1};
+        uint32_t tile_overlap{32};
+        double static_threshold{0};
+        uint32_t static_refresh_frames{25};
+        bool delta_output{false};
+        double move_threshold{0.1};
+        uint32_t snapshot_interval{30};
+        double min_iou{0.3};
+        uint32_t max_missed{2};
+        std::string encoding{"json"};
+        uint32_t batch_frames{10};
+        uint32_t batch_ms{500};
+        uint32_t memory_budget_mb{0};
+        bool load_shedding{false};
+        double frame_rate{0};
+        double load_high{0.9};
+        double load_low{0.5};
+        engine_kind background_engine{engine_kind::knn};
+        uint32_t foreground_threshold{20};
         /*
-        * Copies the feature size from the parameters object to feature_size_value.
+        * Copies the feature size, analysis scale and tiling from the parameters object.
         */
         void merge_json(const nlohmann::json &params) {
           if (!params.is_object()) {
@@ -108,20 +115,345 @@ namespace {
               this->feature_size_value = feature_size_value;
             }
           }
+          /*
+          * Copies the analysis scale from the message to the local variable.
+          */
+          if (params.find("analysisScale") != params.end()) {
+            auto &analysis_scale = params["analysisScale"];
+            if (analysis_scale.is_number() && analysis_scale > 0 && analysis_scale <= 1) {
+              this->analysis_scale = analysis_scale;
+            } else {
+              LOG_S(ERROR) << "merge_json: Ignoring bad analysisScale: " << analysis_scale;
+            }
+          }
+          /*
+          * Copies the tile grid from the message to the local variables.
+          */
+          merge_unsigned(params, "tileColumns", tile_columns, 1, 16);
+          merge_unsigned(params, "tileRows", tile_rows, 1, 16);
+          merge_unsigned(params, "tileOverlap", tile_overlap, 0, 1024);
+          /*
+          * Copies the static scene fast path settings from the message to the local variables.
+          */
+          if (params.find("staticThreshold") != params.end()) {
+            auto &static_threshold = params["staticThreshold"];
+            if (static_threshold.is_number() && static_threshold >= 0) {
+              this->static_threshold = static_threshold;
+            } else {
+              LOG_S(ERROR) << "merge_json: Ignoring bad staticThreshold: " << static_threshold;
+            }
+          }
+          merge_unsigned(params, "staticRefreshFrames", static_refresh_frames, 1, 100000);
+          /*
+          * Copies the object ids and output mode settings from the message to the local variables.
+          */
+          if (params.find("outputMode") != params.end()) {
+            auto &output_mode = params["outputMode"];
+            if (output_mode == "all" || output_mode == "delta") {
+              this->delta_output = output_mode == "delta";
+            } else {
+              LOG_S(ERROR) << "merge_json: Ignoring bad outputMode: " << output_mode;
+            }
+          }
+          merge_fraction(params, "moveThreshold", move_threshold, 0, 10);
+          merge_unsigned(params, "snapshotInterval", snapshot_interval, 1, 100000);
+          merge_fraction(params, "minIou", min_iou, 0.01, 1);
+          merge_unsigned(params, "maxMissed", max_missed, 0, 1000);
+          /*
+          * Copies the binary output settings from the message to the local variables.
+          */
+          if (params.find("encoding") != params.end()) {
+            auto &encoding = params["encoding"];
+            if (encoding == "json" || encoding == "cbor" || encoding == "msgpack") {
+              this->encoding = encoding.get<std::string>();
+            } else {
+              LOG_S(ERROR) << "merge_json: Ignoring bad encoding: " << encoding;
+            }
+          }
+          merge_unsigned(params, "batchFrames", batch_frames, 1, 1000);
+          merge_unsigned(params, "batchMs", batch_ms, 0, 60000);
+          /*
+          * Copies the background model memory budget from the message to the local variable.
+          */
+          merge_unsigned(params, "memoryBudgetMB", memory_budget_mb, 0, 65536);
+          /*
+          * Copies the load shedding settings from the message to the local variables.
+          */
+          if (params.find("loadShedding") != params.end()) {
+            auto &load_shedding = params["loadShedding"];
+            if (load_shedding.is_boolean()) {
+              this->load_shedding = load_shedding;
+            } else {
+              LOG_S(ERROR) << "merge_json: Ignoring bad loadShedding: " << load_shedding;
+            }
+          }
+          merge_fraction(params, "frameRate", frame_rate, 0, 1000);
+          merge_fraction(params, "loadHigh", load_high, 0.1, 10);
+          merge_fraction(params, "loadLow", load_low, 0, 10);
+          /*
+          * Copies the background engine settings from the message to the local variables.
+          */
+          if (params.find("backgroundEngine") != params.end()) {
+            auto &engine = params["backgroundEngine"];
+            if (!engine.is_string() || !parse_engine_kind(engine.get<std::string>(), this->background_engine)) {
+              LOG_S(ERROR) << "merge_json: Ignoring bad backgroundEngine: " << engine;
+            }
+          }
+          merge_unsigned(params, "foregroundThreshold", foreground_threshold, 1, 254);
+          if (load_low >= load_high) {
+            LOG_S(ERROR) << "merge_json: loadLow " << load_low << " isn't below loadHigh " << load_high
+                         << ", using " << load_high / 2;
+            load_low = load_high / 2;
+          }
+        }
+
+        /*
+        * Returns the object tracking and output mode settings.
+        */
+        output_settings output() const {
+          output_settings settings;
+          settings.delta = delta_output;
+          settings.move_threshold = move_threshold;
+          settings.snapshot_interval = snapshot_interval;
+          settings.min_iou = min_iou;
+          settings.max_missed = max_missed;
+          return settings;
+        }
+
+        /*
+        * Returns the load shedder settings.
+        */
+        bot_common::load_shedder::settings shedding_settings() const {
+          bot_common::load_shedder::settings settings;
+          settings.enabled = load_shedding;
+          settings.frame_rate = frame_rate;
+          settings.high = load_high;
+          settings.low = load_low;
+          return settings;
+        }
+
+        static void merge_fraction(const nlohmann::json &params, const char *key, double &value,
+                                   double min, double max) {
+          if (params.find(key) == params.end()) {
+            return;
+          }
+          auto &new_value = params[key];
+          if (new_value.is_number() && new_value >= min && new_value <= max) {
+            value = new_value;
+          } else {
+            LOG_S(ERROR) << "merge_json: Ignoring bad " << key << ": " << new_value;
+          }
+        }
+
+        static void merge_unsigned(const nlohmann::json &params, const char *key, uint32_t &value,
+                                 uint32_t min, uint32_t max) {
+          if (params.find(key) == params.end()) {
+            return;
+          }
+          auto &new_value = params[key];
+          if (new_value.is_number_unsigned() && new_value >= min && new_value <= max) {
+            value = new_value;
+          } else {
+            LOG_S(ERROR) << "merge_json: Ignoring bad " << key << ": " << new_value;
+          }
         }
         
         /*
-        * Returns the field "featureSize" with value set to the new feature size.
+        * Returns the fields "featureSize" and "analysisScale" with values set to the new parameters.
         * The API publishes this message to the control channel.
         */
-        nlohmann::json to_json() const { return {{"featureSize", feature_size_value}}; }
+        nlohmann::json to_json() const {
+          return {{"featureSize", feature_size_value},
+                  {"analysisScale", analysis_scale},
+                  {"tileColumns", tile_columns},
+                  {"tileRows", tile_rows},
+                  {"tileOverlap", tile_overlap},
+                  {"staticThreshold", static_threshold},
+                  {"staticRefreshFrames", static_refresh_frames},
+                  {"outputMode", delta_output ? "delta" : "all"},
+                  {"moveThreshold", move_threshold},
+                  {"snapshotInterval", snapshot_interval},
+                  {"minIou", min_iou},
+                  {"maxMissed", max_missed},
+                  {"encoding", encoding},
+                  {"batchFrames", batch_frames},
+                  {"batchMs", batch_ms},
+                  {"memoryBudgetMB", memory_budget_mb},
+                  {"loadShedding", load_shedding},
+                  {"frameRate", frame_rate},
+                  {"loadHigh", load_high},
+                  {"loadLow", load_low},
+                  {"backgroundEngine", engine_name(background_engine)},
+                  {"foregroundThreshold", foreground_threshold}};
+        }
+    };
+    /*
+    * Part of the analysed frame with its own background model. The region includes the overlap with
+    * neighbouring tiles. boxes receives the bounding boxes found in the tile, in frame coordinates.
+    * Intermediate images and contours are kept between frames to reuse their memory.
+    */
+    struct tile {
+        cv::Rect region;
+        std::unique_ptr<background_engine> engine;
+        cv::Mat gaussian_blurred_image;
+        cv::Mat morphed_image;
+        std::vector<std::vector<cv::Point>> contours;
+        std::vector<cv::Vec4i> contours_topology_hierarchy;
+        std::vector<cv::Rect> boxes;
+    };
+    /*
+    * Engine, size and precision of the background models (see engine_model_bytes). samples only applies to
+    * the KNN engine, whose history length doesn't change its size, it only sets how often samples are replaced.
+    */
+    struct model_plan {
+        engine_kind engine{engine_kind::knn};
+        double scale{1.0};
+        int channels{3};
+        int samples{7};
+        size_t bytes{0};
+    };
+    constexpr int default_model_samples = 7;
+    constexpr int min_model_samples = 3;
+    constexpr double min_model_scale = 0.05;
+
+    /*
+    * Pixels of the tiles of a frame analysed at scale, overlaps included. Sizes are rounded like cv::resize does.
+    */
+    size_t model_pixels(const cv::Size &original_size, double scale, const parameters &params) {
+      const cv::Size size{std::max(1, cvRound(original_size.width * scale)),
+                          std::max(1, cvRound(original_size.height * scale))};
+      size_t pixels = 0;
+      for (const auto &region : make_tile_regions(size, params.tile_columns, params.tile_rows,
+                                                  cvRound(params.tile_overlap * scale))) {
+        pixels += region.area();
+      }
+      return pixels;
+    }
+    /*
+    * Picks the largest background model fitting memoryBudgetMB, giving up precision before resolution: colour
+    * samples first (motion shows as well in luma), then KNN samples per pixel down to 3, and last the analysis
+    * scale. Without a budget, the model is the full colour one at analysisScale, or the luma one for luma engines.
+    * If even the smallest model doesn't fit, the returned plan is the smallest one.
+    */
+    model_plan plan_background_model(const cv::Size &original_size, const parameters &params) {
+      model_plan plan;
+      plan.engine = params.background_engine;
+      plan.scale = params.analysis_scale;
+      if (engine_is_luma(plan.engine)) {
+        plan.channels = 1;
+      }
+      const size_t budget = static_cast<size_t>(params.memory_budget_mb) << 20;
+      auto fits = [&]() {
+        plan.bytes = engine_model_bytes(plan.engine, plan.channels, plan.samples,
+                                        model_pixels(original_size, plan.scale, params));
+        return budget == 0 || plan.bytes <= budget;
+      };
+      if (fits()) {
+        return plan;
+      }
+      plan.channels = 1;
+      if (plan.engine == engine_kind::knn) {
+        for (plan.samples = default_model_samples; plan.samples >= min_model_samples; plan.samples--) {
+          if (fits()) {
+            return plan;
+          }
+        }
+        plan.samples = min_model_samples;
+      } else if (fits()) {
+        return plan;
+      }
+      while (!fits() && plan.scale > min_model_scale) {
+        // The model grows with the square of the scale, tile overlaps make it a bit more
+        const double shrink = std::min(0.95, std::sqrt(static_cast<double>(budget) / plan.bytes));
+        plan.scale = std::max(min_model_scale, plan.scale * shrink);
+      }
+      return plan;
+    }
+    /*
+    * Analysis state of a video stream: the bot's own input, or one of the streams of host mode (see
+    * stream_host.h). Every stream has its own background models, tracked objects and output batch.
+    */
+    struct stream_state {
+        /*
+        * Parameters the stream runs with, copied from the bot's parameters (params_source) when new ones
+        * arrive, so that host workers never read parameters a command is changing
+        */
+        parameters params;
+        std::shared_ptr<const parameters> params_source;
+        
+        /*
+        * Background model plan and the frame size and load shedding level it was made for. Replanned when the
+        * frame size or the level changes, or new parameters arrive.
+        */
+        model_plan plan;
+        cv::Size plan_frame_size;
+        uint32_t plan_shed_level{0};
+        
+        /*
+        * Tiles of the analysed frame and the layout they were built for. Rebuilt (losing the background
+        * models) when the frame size or the tiling parameters change.
+        */
+        std::vector<tile> tiles;
+        cv::Size tiles_frame_size;
+        uint32_t tiles_columns{0};
+        uint32_t tiles_rows{0};
+        int tiles_overlap{0};
+        int tiles_samples{0};
+        int tiles_channels{0};
+        engine_kind tiles_engine{engine_kind::knn};
+        uint32_t tiles_threshold{0};
+        std::unique_ptr<bot_common::worker_pool> workers;
+        /*
+        * Hosted streams run their tiles on their host worker, one after the other: the host workers already
+        * keep the cores busy, and a tile pool per stream would add threads for every stream.
+        */
+        bool hosted{false};
+        // Memory of the background models of the tiles, this stream's part of the background_model_bytes gauge
+        size_t model_bytes{0};
+        
+        /*
+        * Downsampled luma of the current and the previous frame, used by the static scene fast path, and the
+        * number of frames skipped since the background model was last updated
+        */
+        cv::Mat gate_small_image;
+        cv::Mat gate_luma;
+        cv::Mat previous_gate_luma;
+        uint32_t frames_skipped_in_row{0};
+        
+        /*
+        * Per-frame buffers, kept to reuse their memory. The structuring element is only rebuilt when its size
+        * changes. Once warmed up, the bot's own per-frame code doesn't allocate (see motion_output.h), but
+        * OpenCV's filters, background subtractors and findContours allocate scratch memory on every call, and
+        * publishing a JSON message copies it since bot_message() takes it by value.
+        */
+        cv::Mat scaled_image;
+        cv::Mat luma_image;
+        cv::Mat structuring_element;
+        int structuring_element_size{0};
+        
+        /*
+        * Tracked objects and output of the stream. The binary output batch is rebuilt when the binary output
+        * parameters change, those it was built with are kept here.
+        */
+        motion_output output;
+        uint32_t batch_frames{0};
+        uint32_t batch_ms{0};
+    };
+    /*
+    * Streams of host mode and the host analysing them. The host is declared last, so that its workers stop
+    * before the streams they analyse go away.
+    */
+    struct hosted_streams {
+        std::vector<stream_state> streams;
+        std::unique_ptr<bot_common::stream_host> host;
     };
     /*
     * Sets up storage in the bot context as members of the struct
     * The video SDK API defines the members "metrics" and "registry"; see video_bot.h
     *
-    * This struct defines counters, buckets, and timers for Prometheus, sets up a member that
-    * stores the featureSize configuration (params), and adds a BackgroundSubtractor instance.
+    * This struct defines counters and stage timers for Prometheus, sets up a member that
+    * stores the featureSize configuration (params), and holds the streams the bot analyses. Metrics, stage
+    * timers and parameters are shared by all streams, Prometheus only takes one registration of a metric.
     *
     */
     struct state {
@@ -130,106 +462,471 @@ namespace {
         */
         explicit state(sv::bot_context &context)
         /*
-        * Initializes Prometheus counters and histograms in the bot context metrics registry
+        * Initializes Prometheus counters and the stage timers in the bot context metrics registry. Stage
+        * durations are reported in seconds.
         */
             :
             frames_counter(prometheus::BuildCounter()
                                .Name("frames")
                                .Register(context.metrics.registry)
                                .Add({})),
+            frames_skipped_counter(prometheus::BuildCounter()
+                                       .Name("frames_skipped")
+                                       .Register(context.metrics.registry)
+                                       .Add({})),
             contours_counter(prometheus::BuildCounter()
                                  .Name("contours")
                                  .Register(context.metrics.registry)
                                  .Add({})),
-            blur_time(prometheus::BuildHistogram()
-                          .Name("motion_detector_blur_times_millis")
-                          .Register(context.metrics.registry)
-                          .Add({}, std::vector<double>(latency_buckets))),
-            extract_time(prometheus::BuildHistogram()
-                             .Name("motion_detector_extract_times_millis")
-                             .Register(context.metrics.registry)
-                             .Add({}, std::vector<double>(latency_buckets))),
-            morph_time(prometheus::BuildHistogram()
-                           .Name("motion_detector_morph_times_millis")
-                           .Register(context.metrics.registry)
-                           .Add({}, std::vector<double>(latency_buckets))),
-            contours_time(prometheus::BuildHistogram()
-                              .Name("motion_detector_contours_times_millis")
-                              .Register(context.metrics.registry)
-                              .Add({}, std::vector<double>(latency_buckets)))
+            model_bytes_gauge(prometheus::BuildGauge()
+                                  .Name("background_model_bytes")
+                                  .Register(context.metrics.registry)
+                                  .Add({})),
+            shedder(context.metrics.registry, "motion_detector", 3),
+            tracer(context.metrics.registry),
+            frame_stage(tracer.add_stage("frame", "motion_detector_frame_seconds")),
+            scale_stage(tracer.add_stage("scale", "motion_detector_scale_seconds")),
+            blur_stage(tracer.add_stage("blur", "motion_detector_blur_seconds")),
+            extract_stage(tracer.add_stage("extract", "motion_detector_extract_seconds")),
+            morph_stage(tracer.add_stage("morph", "motion_detector_morph_seconds")),
+            contours_stage(tracer.add_stage("contours", "motion_detector_contours_seconds"))
         {}
         
         /*
-        * Stores parameters received in process_command
+        * Parameters received in process_command. Replaced as a whole with std::atomic_store, host workers take
+        * them with std::atomic_load.
         */
-        parameters params;
+        std::shared_ptr<const parameters> params{std::make_shared<parameters>()};
         
-        cv::Ptr<cv::BackgroundSubtractorKNN> background_subtractor{
-            cv::createBackgroundSubtractorKNN(500, 500.0, true)
-        };
+        /*
+        * The bot's own input, and the analysis messages of its current frame
+        */
+        stream_state input;
+        std::vector<nlohmann::json> messages;
         
         /*
-        * Intermediate members that store Prometheus metrics
+        * Intermediate members that store Prometheus metrics, updated by every stream
         */
         prometheus::Counter &frames_counter;
+        prometheus::Counter &frames_skipped_counter;
         prometheus::Counter &contours_counter;
-        prometheus::Histogram &blur_time;
-        prometheus::Histogram &extract_time;
-        prometheus::Histogram &morph_time;
-        prometheus::Histogram &contours_time;
+        // Memory of the background models of all tiles of all streams
+        prometheus::Gauge &model_bytes_gauge;
+        
+        /*
+        * Degrades the analysis of the bot's input while the bot can't keep up with the frames. Hosted streams
+        * drop frames on their own instead (see stream_host.h).
+        */
+        bot_common::load_shedder shedder;
+        /*
+        * Id of the bot, from the "to" field of the last command message. Empty until the first one arrives.
+        */
+        std::string bot_id;
+        
+        /*
+        * Stage timers. Spans recorded on the tile workers and the host workers are reported with the next frame
+        * of the bot's input.
+        */
+        bot_common::tracing::tracer tracer;
+        const uint32_t frame_stage;
+        const uint32_t scale_stage;
+        const uint32_t blur_stage;
+        const uint32_t extract_stage;
+        const uint32_t morph_stage;
+        const uint32_t contours_stage;
+        
+        /*
+        * Host mode: more streams, analysed on the host workers, with the "streams" parameter they were started
+        * with. Results wait in the host until the SDK calls the bot. Declared last, so that the host workers
+        * stop before the members they use go away.
+        */
+        nlohmann::json host_settings;
+        std::vector<bot_common::stream_host::result> host_results;
+        uint64_t host_dropped_results{0};
+        /*
+        * Batches in progress of the streams of replaced hosts, stopped on threads of their own (see
+        * retire_host), waiting to be published like the results of the running host
+        */
+        std::mutex retired_mutex;
+        std::vector<nlohmann::json> retired_messages;
+        std::vector<nlohmann::json> retired_taken;
+        std::unique_ptr<hosted_streams> hosted;
     };
     /*
-    * Invoked each time the API decodes a frame. The API passes in the bot context and an OpenCV Mat object.
-    * **Note:** Log statements in process_image() can cause performance degradation.
+    * Makes sure the binary output batch matches the parameters. A batch in progress is added to messages first.
     */
-    void process_image(sv::bot_context &context, const cv::Mat &original_image) {
-      /*
-      * Points to the instance data area of the bot context. The default value is nullptr.
-      */
-      auto *s = (state *)context.instance_data;
-      s->frames_counter.Increment();
+    void update_batch(stream_state &s, std::vector<nlohmann::json> &messages) {
+      namespace bo = bot_common::binary_output;
+      std::unique_ptr<bo::batcher> &batch = s.output.batch;
+      const bool binary = s.params.encoding != "json";
+      const bo::format format = s.params.encoding == "msgpack" ? bo::format::msgpack : bo::format::cbor;
+      if (batch && binary && batch->encoding() == format && s.batch_frames == s.params.batch_frames
+          && s.batch_ms == s.params.batch_ms) {
+        return;
+      }
+      if (batch && batch->frames() > 0) {
+        messages.push_back(batch->take());
+      }
+      batch.reset(binary ? new bo::batcher(format, s.params.batch_frames,
+                                             std::chrono::milliseconds(s.params.batch_ms))
+                           : nullptr);
+      s.batch_frames = s.params.batch_frames;
+      s.batch_ms = s.params.batch_ms;
+    }
+    /*
+    * Publishes a change of the load shedding level to the control channel. Control messages need a "to" field,
+    * so until a command message gave the bot its id, the change is only logged.
+    */
+    void publish_load_change(sv::bot_context &context, state &s) {
+      nlohmann::json event;
+      if (!s.shedder.take_change(event)) {
+        return;
+      }
+      if (s.bot_id.empty()) {
+        LOG_S(INFO) << "Load shedding (no bot id yet, not published): " << event;
+        return;
+      }
+      LOG_S(INFO) << "Load shedding: " << event;
+      event["to"] = s.bot_id;
+      sv::bot_message(context, sv::bot_message_kind::CONTROL, std::move(event));
+    }
+    /*
+    * Width of the luma image compared by the static scene fast path
+    */
+    constexpr int gate_width = 64;
+    /*
+    * Static scene fast path. Compares a heavily downsampled luma copy of the frame with the one of the
+    * previous frame and returns true if the frame can skip the expensive stages.
+    */
+    bool is_static_frame(stream_state &s, const cv::Mat &original_image) {
+      const int gate_height = std::max(1, original_image.rows * gate_width / original_image.cols);
+      cv::resize(original_image, s.gate_small_image, cv::Size(gate_width, gate_height), 0, 0,
+                 cv::INTER_AREA);
+      cv::cvtColor(s.gate_small_image, s.gate_luma, cv::COLOR_BGR2GRAY);
+
+      bool is_static = false;
+      if (s.previous_gate_luma.size() == s.gate_luma.size()
+          && s.frames_skipped_in_row < s.params.static_refresh_frames) {
+        const size_t pixels = s.gate_luma.total();
+        const uint64_t sad =
+            bot_common::sum_abs_diff(s.gate_luma.data, s.previous_gate_luma.data, pixels);
+        is_static = sad < s.params.static_threshold * pixels;
+      }
+      cv::swap(s.gate_luma, s.previous_gate_luma);
+
+      s.frames_skipped_in_row = is_static ? s.frames_skipped_in_row + 1 : 0;
+      return is_static;
+    }
+    /*
+    * Makes sure the tiles of a stream match the analysed frame size and the tiling parameters.
+    */
+    void update_tiles(state &s, stream_state &a, const cv::Size &analysis_size, int overlap) {
+      if (a.tiles_frame_size == analysis_size && a.tiles_columns == a.params.tile_columns
+          && a.tiles_rows == a.params.tile_rows && a.tiles_overlap == overlap
+          && a.tiles_samples == a.plan.samples && a.tiles_channels == a.plan.channels
+          && a.tiles_engine == a.plan.engine && a.tiles_threshold == a.params.foreground_threshold) {
+        return;
+      }
+      const auto regions = make_tile_regions(analysis_size, a.params.tile_columns,
+                                             a.params.tile_rows, overlap);
+      a.tiles.clear();
+      a.tiles.resize(regions.size());
+      size_t model_bytes = 0;
+      for (size_t i = 0; i < regions.size(); i++) {
+        a.tiles[i].region = regions[i];
+        a.tiles[i].engine = make_engine(a.plan.engine, a.plan.samples, a.params.foreground_threshold);
+        model_bytes += engine_model_bytes(a.plan.engine, a.plan.channels, a.plan.samples, regions[i].area());
+      }
+      // The gauge sums the models of all streams, every stream adds the change of its own
+      s.model_bytes_gauge.Increment(static_cast<double>(model_bytes) - static_cast<double>(a.model_bytes));
+      a.model_bytes = model_bytes;
+      a.tiles_frame_size = analysis_size;
+      a.tiles_columns = a.params.tile_columns;
+      a.tiles_rows = a.params.tile_rows;
+      a.tiles_overlap = overlap;
+      a.tiles_samples = a.plan.samples;
+      a.tiles_channels = a.plan.channels;
+      a.tiles_engine = a.plan.engine;
+      a.tiles_threshold = a.params.foreground_threshold;
+
+      const size_t workers = a.hosted ? 0 : bot_common::worker_pool::workers_for(a.tiles.size());
+      if (!a.workers || a.workers->size() != workers) {
+        a.workers.reset(new bot_common::worker_pool(workers));
+      }
+      LOG_S(INFO) << "Analysing " << analysis_size << " frames in " << a.tiles.size() << " tiles on "
+                  << workers + 1 << " threads";
+    }
+    /*
+    * Runs the motion detection pipeline on one tile of the analysed frame.
+    * Called concurrently for different tiles, so it only writes to the tile itself.
+    */
+    void detect_motion(state &s, tile &t, const cv::Mat &analysis_image, const cv::Mat &element) {
+      {
+        bot_common::tracing::span span(s.tracer, s.blur_stage);
+        // Filters read the pixels around the region from the full frame, so tiles have no artificial borders
+        cv::GaussianBlur(analysis_image(t.region), t.gaussian_blurred_image, cv::Size(5, 5), 0);
+      }
+      {
+        bot_common::tracing::span span(s.tracer, s.extract_stage);
+        t.engine->apply(t.gaussian_blurred_image, t.gaussian_blurred_image);
+      }
+      {
+        bot_common::tracing::span span(s.tracer, s.morph_stage);
+        cv::morphologyEx(t.gaussian_blurred_image, t.morphed_image, cv::MORPH_OPEN, element);
+      }
+      {
+        bot_common::tracing::span span(s.tracer, s.contours_stage);
+        // Keeps the capacity of the contour vectors, but copies the image and allocates its own storage
+        cv::findContours(t.morphed_image, t.contours, t.contours_topology_hierarchy, CV_RETR_EXTERNAL,
+                         CV_CHAIN_APPROX_SIMPLE, t.region.tl());
+      }
+      t.boxes.clear();
+      for (const auto &contour : t.contours) {
+        t.boxes.push_back(cv::boundingRect(contour));
+      }
+    }
+    /*
+    * Makes sure the stream runs with the current parameters. The background model is then replanned with the
+    * next frame, and rebuilt if the plan changes.
+    */
+    void update_params(stream_state &a, const std::shared_ptr<const parameters> &params) {
+      if (a.params_source == params) {
+        return;
+      }
+      a.params = *params;
+      a.params_source = params;
+      a.plan_frame_size = cv::Size();
+    }
+    /*
+    * Runs the motion analysis of a frame of a stream at a load shedding level and adds the analysis messages
+    * to publish to messages. Runs on the SDK thread for the bot's input and on the host workers for hosted
+    * streams, so it only writes to the stream and to metrics.
+    */
+    void analyse(state &s, stream_state &a, const cv::Mat &original_image, uint32_t shed_level,
+                 std::vector<nlohmann::json> &messages) {
+      if (a.params.static_threshold > 0 && is_static_frame(a, original_image)) {
+        s.frames_skipped_counter.Increment();
+        // A batch still goes out on time when the scene stays static
+        if (a.output.batch && a.output.batch->due()) {
+          messages.push_back(a.output.batch->take());
+        }
+        return;
+      }
       
       /*
       * Sets or declares control variables used by the OpenCV contour detection algorithm
       */
       cv::Size original_image_size{original_image.cols, original_image.rows};
-      cv::Mat gaussian_blurred_image;
-      cv::Mat morphed_image;
-      {
-        latency_reporter reporter(s->blur_time);
-        cv::GaussianBlur(original_image, gaussian_blurred_image, cv::Size(5, 5), 0);
+      if (original_image_size != a.plan_frame_size || shed_level != a.plan_shed_level) {
+        /*
+        * Load shedding levels 2 and 3 analyse smaller frames. Changing the analysis size rebuilds the
+        * background models, the hysteresis of the load shedder keeps that rare.
+        */
+        parameters planned = a.params;
+        if (shed_level >= 2) {
+          const double shed_scale = planned.analysis_scale * (shed_level >= 3 ? 0.25 : 0.5);
+          planned.analysis_scale = std::min(planned.analysis_scale, std::max(min_model_scale, shed_scale));
+        }
+        a.plan = plan_background_model(original_image_size, planned);
+        a.plan_frame_size = original_image_size;
+        a.plan_shed_level = shed_level;
+        const size_t budget = static_cast<size_t>(a.params.memory_budget_mb) << 20;
+        LOG_S(budget > 0 && a.plan.bytes > budget ? WARNING : INFO)
+            << "Background model: " << engine_name(a.plan.engine) << ", scale " << a.plan.scale << ", "
+            << a.plan.channels << " channels, " << a.plan.samples << " samples, " << (a.plan.bytes >> 20)
+            << " MiB";
       }
-      {
-        latency_reporter reporter(s->extract_time);
-        s->background_subtractor->apply(gaussian_blurred_image, gaussian_blurred_image);
+      const double analysis_scale = a.plan.scale;
+      /*
+      * Motion boxes don't need full-resolution precision, so the pipeline runs on a downscaled copy
+      * when analysis_scale < 1. INTER_AREA averages the dropped pixels instead of aliasing them.
+      */
+      if (analysis_scale < 1.0) {
+        bot_common::tracing::span span(s.tracer, s.scale_stage);
+        cv::resize(original_image, a.scaled_image, cv::Size(), analysis_scale, analysis_scale,
+                   cv::INTER_AREA);
+      }
+      const cv::Mat &scaled_image = analysis_scale < 1.0 ? a.scaled_image : original_image;
+      // Luma models take single channel frames, which also makes the blur cheaper
+      if (a.plan.channels == 1) {
+        bot_common::tracing::span span(s.tracer, s.scale_stage);
+        cv::cvtColor(scaled_image, a.luma_image, cv::COLOR_BGR2GRAY);
       }
+      const cv::Mat &analysis_image = a.plan.channels == 1 ? a.luma_image : scaled_image;
+      update_tiles(s, a, analysis_image.size(), cvRound(a.params.tile_overlap * analysis_scale));
       /*
       * Note: getStructuredElement() uses the feature_size_value variable stored in the instance_data member of
       * the bot context. You can change this variable dynamically by publishing a new value to the control channel.
       * To learn more, see the code for process_command())
+      * The feature size is given in original frame pixels, so it is scaled down with the frame.
       */
-      {
-        latency_reporter reporter(s->morph_time);
-        cv::Mat element = cv::getStructuringElement(
-            cv::MORPH_RECT, cv::Size(s->params.feature_size_value, s->params.feature_size_value));
-        cv::morphologyEx(gaussian_blurred_image, morphed_image, cv::MORPH_OPEN, element);
+      const int feature_size = std::max(1, cvRound(a.params.feature_size_value * analysis_scale));
+      if (feature_size != a.structuring_element_size) {
+        a.structuring_element =
+            cv::getStructuringElement(cv::MORPH_RECT, cv::Size(feature_size, feature_size));
+        a.structuring_element_size = feature_size;
+      }
+      const cv::Mat &element = a.structuring_element;
+      /*
+      * Tiles are processed in parallel, each one writing only its own boxes
+      */
+      a.workers->parallel_for(a.tiles.size(), [&](size_t i) {
+        detect_motion(s, a.tiles[i], analysis_image, element);
+      });
+      /*
+      * Merges the boxes of the tiles, tracks them and queues the results for the analysis channel.
+      */
+      update_batch(a, messages);
+      const bool publish = update_output(
+          a.output, a.params.output(), a.tiles.size(),
+          [&](size_t i) -> const std::vector<cv::Rect> & { return a.tiles[i].boxes; }, analysis_scale,
+          original_image_size);
+      s.contours_counter.Increment(a.output.boxes.size());
+      if (publish) {
+        messages.push_back(take_message(a.output));
       }
-      std::vector<std::vector<cv::Point>> contours;
-      std::vector<cv::Vec4i> contours_topology_hierarchy;
+    }
+    /*
+    * Analyses a frame of a hosted stream, on a host worker.
+    */
+    void analyse_hosted(state &s, hosted_streams &h, size_t stream, const cv::Mat &frame,
+                        std::vector<nlohmann::json> &messages) {
+      bot_common::tracing::span frame_span(s.tracer, s.frame_stage);
+      s.frames_counter.Increment();
+      stream_state &a = h.streams[stream];
+      update_params(a, std::atomic_load(&s.params));
+      analyse(s, a, frame, 0, messages);
+    }
+    /*
+    * Publishes the results of the hosted streams with the id of their stream. Bots can only publish from the
+    * SDK callbacks, so this runs with every frame of the bot's input and every command.
+    */
+    void publish_stream_results(sv::bot_context &context, state &s) {
       {
-        latency_reporter reporter(s->contours_time);
-        cv::findContours(morphed_image, contours, contours_topology_hierarchy, CV_RETR_EXTERNAL,
-                         CV_CHAIN_APPROX_SIMPLE);
+        std::lock_guard<std::mutex> lock(s.retired_mutex);
+        s.retired_taken.swap(s.retired_messages);
+      }
+      for (auto &message : s.retired_taken) {
+        sv::bot_message(context, sv::bot_message_kind::ANALYSIS, std::move(message));
+      }
+      s.retired_taken.clear();
+      bot_common::stream_host &host = *s.hosted->host;
+      host.take_results(s.host_results);
+      for (auto &result : s.host_results) {
+        result.message["stream"] = host.sources()[result.stream].id;
+        sv::bot_message(context, sv::bot_message_kind::ANALYSIS, std::move(result.message));
+      }
+      const uint64_t dropped = host.dropped_results();
+      if (dropped != s.host_dropped_results) {
+        LOG_S(WARNING) << "Dropped " << dropped - s.host_dropped_results
+                       << " results of hosted streams, the input is too slow to publish them";
+        s.host_dropped_results = dropped;
+      }
+    }
+    /*
+    * Stops a replaced host and its streams on a thread of their own: capture threads can be blocked reading
+    * their source for a long time, which must not hold up the SDK thread. The batches in progress of the
+    * streams are then published with the next frame or command, with the results of the running host.
+    */
+    void retire_host(state &s, std::unique_ptr<hosted_streams> old) {
+      state *shared = &s;
+      std::thread([shared](std::unique_ptr<hosted_streams> h) {
+        const std::vector<bot_common::stream_host::source> sources = h->host->sources();
+        h->host.reset();
+        std::lock_guard<std::mutex> lock(shared->retired_mutex);
+        for (size_t i = 0; i < h->streams.size(); i++) {
+          const auto &batch = h->streams[i].output.batch;
+          if (batch && batch->frames() > 0) {
+            nlohmann::json message = batch->take();
+            message["stream"] = sources[i].id;
+            shared->retired_messages.push_back(std::move(message));
+          }
+          shared->model_bytes_gauge.Decrement(static_cast<double>(h->streams[i].model_bytes));
+        }
+        LOG_S(INFO) << "Replaced host stopped";
+      }, std::move(old)).detach();
+    }
+    /*
+    * Starts host mode with the "streams" parameter, or restarts it when the parameter changes. The streams of
+    * a restarted host start over, their batches in progress are published once the old host stopped (see
+    * retire_host). Bad settings are logged and leave the current host running.
+    */
+    void update_host(sv::bot_context &context, state &s, const nlohmann::json &streams) {
+      if (s.hosted && streams == s.host_settings) {
+        return;
       }
-      if (contours.empty()) {
+      bot_common::stream_host::settings settings;
+      try {
+        settings = bot_common::stream_host::parse_settings(streams);
+      } catch (const std::exception &e) {
+        LOG_S(ERROR) << "update_host: Ignoring bad streams: " << e.what();
         return;
       }
+      if (s.hosted) {
+        publish_stream_results(context, s);
+        LOG_S(INFO) << "Restarting host mode";
+        retire_host(s, std::move(s.hosted));
+      }
+      std::unique_ptr<hosted_streams> hosted(new hosted_streams());
+      hosted->streams.resize(settings.sources.size());
+      for (auto &a : hosted->streams) {
+        a.hosted = true;
+      }
+      s.host_settings = streams;
+      s.host_dropped_results = 0;
+      state *shared = &s;
+      hosted_streams *h = hosted.get();
+      hosted->host.reset(new bot_common::stream_host(
+          std::move(settings), [shared, h](size_t stream, size_t /*worker*/, const cv::Mat &frame,
+                                           std::vector<nlohmann::json> &messages) {
+            analyse_hosted(*shared, *h, stream, frame, messages);
+          }));
+      s.hosted = std::move(hosted);
+      LOG_S(INFO) << "Hosting " << s.hosted->host->sources().size() << " streams on "
+                  << s.hosted->host->workers() << " threads";
+    }
+    /*
+    * Invoked each time the API decodes a frame. The API passes in the bot context and an OpenCV Mat object.
+    * **Note:** Log statements in process_image() can cause performance degradation.
+    */
+    void process_image(sv::bot_context &context, const cv::Mat &original_image) {
+      /*
+      * Points to the instance data area of the bot context. The default value is nullptr.
+      */
+      auto *s = (state *)context.instance_data;
+      /*
+      * Reports the stage timings of the previous frame, then times this one
+      */
+      s->tracer.flush();
+      bot_common::tracing::span frame_span(s->tracer, s->frame_stage);
+      s->frames_counter.Increment();
+      if (s->hosted) {
+        publish_stream_results(context, *s);
+      }
+      update_params(s->input, s->params);
+      
+      /*
+      * Skipped frames still count in the load, as frames the bot had time for
+      */
+      const bool admitted = s->shedder.admit();
+      publish_load_change(context, *s);
+      if (!admitted) {
+        const auto &batch = s->input.output.batch;
+        if (batch && batch->due()) {
+          sv::bot_message(context, sv::bot_message_kind::ANALYSIS, batch->take());
+        }
+        return;
+      }
+      bot_common::load_shedder::busy busy(s->shedder);
       
-      s->contours_counter.Increment(contours.size());
+      s->messages.clear();
+      analyse(*s, s->input, original_image, s->shedder.level(), s->messages);
       /*
       * Publishes the results to the analysis channel.
       */
-      publish_contours_analysis(context, original_image_size, contours);
+      for (auto &message : s->messages) {
+        sv::bot_message(context, sv::bot_message_kind::ANALYSIS, std::move(message));
+      }
       
     } // end process_image
   /*
@@ -237,7 +934,7 @@ namespace {
   *
   * This example bot expects a message that has the form
   * {
-  *   "params": { "featureSize": &lt;size&gt; }
+  *   "params": { "featureSize": &lt;size&gt;, "analysisScale": &lt;scale&gt; }
   * }
   */
   nlohmann::json process_command(sv::bot_context &context, const nlohmann::json &command_message) {
@@ -255,6 +952,9 @@ namespace {
       LOG_S(INFO) << "process_command: Bot configuration initialized";
       return nullptr;
     }
+    if (s->hosted) {
+      publish_stream_results(context, *s);
+    }
     // The received message should be a JSON object
     if (!command_message.is_object()) {
       LOG_S(ERROR) << "process_command: Command message isn't a JSON object, message= " << command_message;
@@ -291,10 +991,22 @@ namespace {
     // Gets the configuration parameters from the message
     auto &params = command_message["params"];
     LOG_S(INFO) << "process_command: Received config parameters: " << command_message;
-    // Moves the parameters to the context
-    s->params.merge_json(params);
+    // Moves the parameters to the context. Streams pick them up with their next frame (see update_params)
+    parameters merged = *s->params;
+    merged.merge_json(params);
+    std::atomic_store(&s->params, std::shared_ptr<const parameters>(std::make_shared<parameters>(merged)));
+    s->shedder.configure(merged.shedding_settings());
+    /*
+    * Optional host mode: "streams": {"sources": [{"id": "lobby", "url": "rtsp://..."}], "threads": 4,
+    * "maxPending": 2, "maxResults": 1000} analyses more streams with the same parameters (see stream_host.h)
+    */
+    if (params.is_object() && params.find("streams") != params.end()) {
+      update_host(context, *s, params["streams"]);
+    }
     // Gets the bot id from the command_message
     std::string bot_id = command_message["to"];
+    // Kept for the load shedding events (see publish_load_change)
+    s->bot_id = bot_id;
     /*
     * Returns an acknowledgement ("ack") message to the SDK, which publishes it back to the control channel.
     * The ack is JSON that contains:
@@ -313,14 +1025,18 @@ namespace {
     return_object.insert(to_object.begin(), to_object.end());
 
     // Inserts the received configuration parameters object field
-    nlohmann::json config_object = s->params.to_json();
+    nlohmann::json config_object = s->params->to_json();
     return_object.insert(config_object.begin(), config_object.end());
+    if (s->hosted) {
+      return_object["streams"] = s->host_settings;
+    }
 
     LOG_S(INFO) << "Return ack message: " << return_object.dump();
     // Returns the ack
     return return_object;
   }
 } // end motion_detector_bot namespace
+#ifndef BOT_BENCH
 /*
 * Motion detector bot program
 */
@@ -335,4 +1051,4 @@ int main(int argc, char *argv[]) {
   // Starts the main processing loop
   return sv::opencv_bot_main(argc, argv);
 }
-
+#endif
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <bot_common/binary_output.h>
+#include <bot_common/object_tracker.h>
+#include <satorivideo/opencv/opencv_utils.h>
+#include <cstdint>
+#include <json.hpp>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include <opencv2/core.hpp>
+
+#include "tiles.h"
+
+namespace motion_detector_bot {
+
+/*
+ * Per-frame bookkeeping of a stream once its tiles found their motion boxes: the boxes
+ * of the tiles are merged, matched to the objects of the previous frames, and the objects
+ * to report are added to the binary output batch or written to the JSON message.
+ *
+ * Nothing here allocates once warmed up (see test/steady_state_allocations_test.cpp). The
+ * JSON message is updated in place: objects leaving it are kept aside and reused by the
+ * next ones. Publishing it still copies it, as bot_message() takes it by value.
+ */
+
+// Tag of the motion boxes in binary output
+const std::string motion_tag = "motion";
+
+struct output_settings {
+  bool delta{false};
+  double move_threshold{0.1};
+  uint32_t snapshot_interval{30};
+  double min_iou{0.3};
+  uint32_t max_missed{2};
+};
+
+struct motion_output {
+  tile_box_merger box_merger;
+  // Motion boxes of the current frame, in analysed frame coordinates
+  std::vector<cv::Rect> boxes;
+  // The same in original frame coordinates, the objects they were matched to and the
+  // objects selected for publication
+  std::vector<bot_common::object_tracker::detection> detections;
+  bot_common::object_tracker objects;
+  std::vector<size_t> published_objects;
+
+  // Binary output batch, null with JSON output
+  std::unique_ptr<bot_common::binary_output::batcher> batch;
+  bot_common::binary_output::frame encoded_frame;
+
+  // JSON output message of the current frame, with the fields of delta mode if delta
+  nlohmann::json message;
+  bool message_delta{false};
+  // Objects of earlier messages, reused by the next ones
+  std::vector<nlohmann::json> spare_objects;
+};
+
+namespace motion_output_detail {
+
+/*
+ * Keys, built once: a std::string key longer than the small string buffer allocates, and
+ * json::operator[] takes its key by value, so fields are looked up in the object_t map.
+ */
+const std::string detected_objects_key = "detected_objects";
+const std::string snapshot_key = "snapshot";
+const std::string removed_key = "removed";
+const std::string id_key = "id";
+const std::string color_key = "color";
+const std::string rect_key = "rect";
+
+// Writes a tracked object into a detected object of the message, {"id", "color", "rect"}.
+// The color is a display hint. The id stays the same while the object moves.
+inline void write_object(nlohmann::json &json, const bot_common::object_tracker::object &o,
+                         const cv::Size &original_size) {
+  namespace svo = satori::video::opencv;
+  // Scales the box to fractions of the frame size
+  const cv::Rect2f rect = svo::to_fractional(o.rect, original_size);
+  if (!json.is_object()) {
+    json = {{color_key, "green"}};
+  }
+  auto &fields = json.get_ref<nlohmann::json::object_t &>();
+  fields[id_key] = o.id;
+  nlohmann::json &values = fields[rect_key];
+  if (values.is_array() && values.size() == 4) {
+    values[0] = rect.x;
+    values[1] = rect.y;
+    values[2] = rect.width;
+    values[3] = rect.height;
+  } else {
+    values = svo::to_json(rect);
+  }
+}
+
+}  // namespace motion_output_detail
+
+/*
+ * Selects the tracked objects to publish for the current frame. Returns false if there is
+ * nothing to publish. In "all" mode, every object seen in the frame is published. In
+ * "delta" mode, only the objects which appeared or moved, and the ids of the objects which
+ * disappeared; every snapshot_interval frames all objects are published with "snapshot".
+ */
+inline bool select_objects(motion_output &out, const output_settings &settings,
+                           bool &snapshot) {
+  if (settings.delta) {
+    return out.objects.changes(settings.move_threshold, settings.snapshot_interval, snapshot,
+                               out.published_objects);
+  }
+  const auto &tracked = out.objects.objects();
+  out.published_objects.clear();
+  for (size_t i = 0; i < tracked.size(); i++) {
+    if (tracked[i].missed == 0) {
+      out.published_objects.push_back(i);
+    }
+  }
+  return !out.published_objects.empty();
+}
+
+/*
+ * Writes the selected objects into the JSON message:
+ * {"detected_objects": [...]}, plus "snapshot" and "removed" (possibly empty) in delta
+ * mode.
+ */
+inline void write_message(motion_output &out, bool delta, bool snapshot,
+                          const cv::Size &original_size) {
+  namespace detail = motion_output_detail;
+  if (!out.message.is_object() || out.message_delta != delta) {
+    out.message = {{detail::detected_objects_key, nlohmann::json::array()}};
+    if (delta) {
+      out.message[detail::removed_key] = nlohmann::json::array();
+    }
+    out.message_delta = delta;
+  }
+  auto &fields = out.message.get_ref<nlohmann::json::object_t &>();
+  auto &objects = fields[detail::detected_objects_key].get_ref<nlohmann::json::array_t &>();
+  const size_t count = out.published_objects.size();
+  while (objects.size() > count) {
+    out.spare_objects.push_back(std::move(objects.back()));
+    objects.pop_back();
+  }
+  while (objects.size() < count) {
+    if (out.spare_objects.empty()) {
+      objects.emplace_back();
+    } else {
+      objects.push_back(std::move(out.spare_objects.back()));
+      out.spare_objects.pop_back();
+    }
+  }
+  const auto &tracked = out.objects.objects();
+  for (size_t i = 0; i < count; i++) {
+    detail::write_object(objects[i], tracked[out.published_objects[i]], original_size);
+  }
+  if (delta) {
+    fields[detail::snapshot_key] = snapshot;
+    const auto &removed = out.objects.removed();
+    fields[detail::removed_key].get_ref<nlohmann::json::array_t &>().assign(removed.begin(),
+                                                                           removed.end());
+  }
+}
+
+/*
+ * Merges the boxes the tiles found in a frame analysed at analysis_scale (tile_boxes(i)
+ * returns the boxes of tile i), tracks them and prepares the output of the frame. Returns
+ * true if there is a message to publish, see take_message().
+ */
+template <typename TileBoxes>
+bool update_output(motion_output &out, const output_settings &settings, size_t tiles,
+                   TileBoxes &&tile_boxes, double analysis_scale,
+                   const cv::Size &original_size) {
+  /*
+   * Tiles found their boxes in parallel, merging them in tile order keeps the result
+   * independent of thread scheduling.
+   */
+  if (tiles == 1) {
+    const std::vector<cv::Rect> &boxes = tile_boxes(0);
+    out.boxes.assign(boxes.begin(), boxes.end());
+  } else {
+    out.box_merger.clear();
+    for (size_t i = 0; i < tiles; i++) {
+      out.box_merger.add(i, tile_boxes(i));
+    }
+    out.box_merger.merge(out.boxes);
+  }
+  /*
+   * Contours are found on a frame downscaled by analysis_scale, so bounding boxes are
+   * mapped back to the original frame coordinates before matching them with the objects
+   * of the previous frames
+   */
+  out.detections.clear();
+  for (const auto &r : out.boxes) {
+    const cv::Rect rect{cvRound(r.x / analysis_scale), cvRound(r.y / analysis_scale),
+                        cvRound(r.width / analysis_scale),
+                        cvRound(r.height / analysis_scale)};
+    out.detections.push_back({rect, 0});
+  }
+  out.objects.configure(settings.min_iou, settings.max_missed);
+  out.objects.update(out.detections);
+
+  bool snapshot = false;
+  const bool publish = select_objects(out, settings, snapshot);
+  if (!out.batch) {
+    if (publish) {
+      write_message(out, settings.delta, snapshot, original_size);
+    }
+    return publish;
+  }
+  if (publish) {
+    const auto &tracked = out.objects.objects();
+    auto &frame = out.encoded_frame;
+    frame.timestamp_ms = bot_common::binary_output::now_ms();
+    frame.size = original_size;
+    frame.objects.clear();
+    for (size_t i : out.published_objects) {
+      frame.objects.push_back({tracked[i].id, tracked[i].rect, &motion_tag});
+    }
+    frame.delta = settings.delta;
+    frame.snapshot = snapshot;
+    frame.removed = out.objects.removed();
+    out.batch->add(frame);
+  }
+  return out.batch->due();
+}
+
+/*
+ * The message update_output() prepared: the due batch with binary output, a copy of the
+ * JSON message otherwise.
+ */
+inline nlohmann::json take_message(motion_output &out) {
+  return out.batch ? out.batch->take() : out.message;
+}
+
+}  // namespace motion_detector_bot
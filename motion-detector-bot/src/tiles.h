@@ -0,0 +1,104 @@
+#pragma once
+
+#include <algorithm>
+#include <numeric>
+#include <vector>
+#include <opencv2/core.hpp>
+
+namespace motion_detector_bot {
+
+/*
+ * Splits a frame into a grid of columns x rows tiles. Each tile is extended by `overlap`
+ * pixels on every side (clipped to the frame), so that an object on a seam is seen whole
+ * by at least one of the tiles or in part by both.
+ */
+inline std::vector<cv::Rect> make_tile_regions(const cv::Size &frame_size, int columns,
+                                               int rows, int overlap) {
+  std::vector<cv::Rect> regions;
+  const cv::Rect frame{cv::Point{0, 0}, frame_size};
+  for (int row = 0; row < rows; row++) {
+    for (int column = 0; column < columns; column++) {
+      const int x0 = frame_size.width * column / columns;
+      const int x1 = frame_size.width * (column + 1) / columns;
+      const int y0 = frame_size.height * row / rows;
+      const int y1 = frame_size.height * (row + 1) / rows;
+      regions.emplace_back(
+          cv::Rect{x0 - overlap, y0 - overlap, x1 - x0 + 2 * overlap, y1 - y0 + 2 * overlap}
+          & frame);
+    }
+  }
+  return regions;
+}
+
+/*
+ * Merges boxes found by different tiles that touch or intersect into one box, since
+ * they are parts (or duplicates from the overlap) of the same object.
+ * Boxes are added per tile in frame coordinates. Boxes of the same tile are never merged
+ * with each other, so a single tile gives the same result as untiled detection. The
+ * output order only depends on the input order.
+ * Buffers are kept between frames, so merging doesn't allocate once warmed up.
+ */
+class tile_box_merger {
+ public:
+  void clear() {
+    _boxes.clear();
+    _tile_of_box.clear();
+  }
+
+  void add(size_t tile, const std::vector<cv::Rect> &boxes) {
+    for (const auto &box : boxes) {
+      _boxes.push_back(box);
+      _tile_of_box.push_back(tile);
+    }
+  }
+
+  void merge(std::vector<cv::Rect> &merged) {
+    // Union-find, every group is rooted at its smallest index
+    _parent.resize(_boxes.size());
+    std::iota(_parent.begin(), _parent.end(), 0);
+
+    for (size_t i = 0; i < _boxes.size(); i++) {
+      // Inflated by one pixel so that boxes touching on a seam are merged too
+      const cv::Rect inflated{_boxes[i].x - 1, _boxes[i].y - 1, _boxes[i].width + 2,
+                              _boxes[i].height + 2};
+      for (size_t j = i + 1; j < _boxes.size(); j++) {
+        if (_tile_of_box[i] == _tile_of_box[j] || (inflated & _boxes[j]).area() == 0) {
+          continue;
+        }
+        const size_t a = find(i);
+        const size_t b = find(j);
+        if (a != b) {
+          _parent[std::max(a, b)] = std::min(a, b);
+        }
+      }
+    }
+
+    merged.clear();
+    _merged_index.resize(_boxes.size());
+    for (size_t i = 0; i < _boxes.size(); i++) {
+      const size_t root = find(i);
+      if (root == i) {
+        _merged_index[i] = merged.size();
+        merged.push_back(_boxes[i]);
+      } else {
+        auto &box = merged[_merged_index[root]];
+        box = box | _boxes[i];
+      }
+    }
+  }
+
+ private:
+  size_t find(size_t i) {
+    while (_parent[i] != i) {
+      i = _parent[i] = _parent[_parent[i]];
+    }
+    return i;
+  }
+
+  std::vector<cv::Rect> _boxes;
+  std::vector<size_t> _tile_of_box;
+  std::vector<size_t> _parent;
+  std::vector<size_t> _merged_index;
+};
+
+}  // namespace motion_detector_bot
@@ -0,0 +1,126 @@
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "background_kernels.h"
+
+namespace mdb = motion_detector_bot;
+
+/*
+ * Compares the background kernels, as vectorized for the instruction set this file is
+ * built for, with straightforward scalar versions. CMakeLists.txt builds it for the
+ * default target (SSE2 on x86-64), for AVX2 and without SIMD.
+ */
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition, ...)                                  \
+  do {                                                         \
+    if (!(condition)) {                                        \
+      std::fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);     \
+      std::fprintf(stderr, __VA_ARGS__);                       \
+      std::fputc('\n', stderr);                                \
+      failures++;                                              \
+    }                                                          \
+  } while (false)
+
+void reference_average(const std::vector<uint8_t> &luma, std::vector<int16_t> &background,
+                       std::vector<uint8_t> &mask, int shift, int threshold) {
+  for (size_t i = 0; i < luma.size(); i++) {
+    const int d = luma[i] * (1 << mdb::average_fraction_bits) - background[i];
+    // Arithmetic shift, rounding towards minus infinity like the vector shifts
+    background[i] = static_cast<int16_t>(background[i] + (d >> shift));
+    mask[i] = std::abs(d) > threshold * (1 << mdb::average_fraction_bits) ? 255 : 0;
+  }
+}
+
+void reference_median(const std::vector<uint8_t> &luma, std::vector<uint8_t> &background,
+                      std::vector<uint8_t> &mask, int threshold) {
+  for (size_t i = 0; i < luma.size(); i++) {
+    const int d = luma[i] - background[i];
+    mask[i] = std::abs(d) > threshold ? 255 : 0;
+    if (d > 0) {
+      background[i]++;
+    } else if (d < 0) {
+      background[i]--;
+    }
+  }
+}
+
+// Row lengths around the 16 and 32 pixel vector widths, and frame widths
+const size_t lengths[] = {0, 1, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100, 320, 959};
+const int thresholds[] = {0, 1, 5, 20, 127, 128, 254, 255};
+constexpr int frames = 6;
+
+void test_running_average(std::mt19937 &rng) {
+  for (size_t n : lengths) {
+    for (int shift = 1; shift <= 8; shift++) {
+      for (int threshold : thresholds) {
+        std::vector<uint8_t> luma(n), mask(n), expected_mask(n);
+        std::vector<int16_t> background(n);
+        for (auto &b : background) {
+          // Any background the kernel can reach, fractional bits included
+          b = static_cast<int16_t>(rng() % (256 << mdb::average_fraction_bits));
+        }
+        std::vector<int16_t> expected = background;
+        for (int frame = 0; frame < frames; frame++) {
+          for (auto &l : luma) {
+            l = static_cast<uint8_t>(rng());
+          }
+          mdb::update_running_average(luma.data(), background.data(), mask.data(), n,
+                                      shift, threshold);
+          reference_average(luma, expected, expected_mask, shift, threshold);
+          CHECK(background == expected && mask == expected_mask,
+                "running average differs: %zu pixels, shift %d, threshold %d", n, shift,
+                threshold);
+        }
+      }
+    }
+  }
+}
+
+void test_running_median(std::mt19937 &rng) {
+  for (size_t n : lengths) {
+    for (int threshold : thresholds) {
+      std::vector<uint8_t> luma(n), mask(n), expected_mask(n), background(n);
+      for (auto &b : background) {
+        b = static_cast<uint8_t>(rng());
+      }
+      std::vector<uint8_t> expected = background;
+      for (int frame = 0; frame < frames; frame++) {
+        for (size_t i = 0; i < n; i++) {
+          // Mostly close to the background, so that both sides of the threshold show up
+          luma[i] = frame % 2 == 0 ? static_cast<uint8_t>(rng())
+                                   : static_cast<uint8_t>(background[i] + rng() % 7 - 3);
+        }
+        mdb::update_running_median(luma.data(), background.data(), mask.data(), n,
+                                   threshold);
+        reference_median(luma, expected, expected_mask, threshold);
+        CHECK(background == expected && mask == expected_mask,
+              "running median differs: %zu pixels, threshold %d", n, threshold);
+      }
+    }
+  }
+}
+
+}  // namespace
+
+int main() {
+#if defined(__AVX2__) && defined(__GNUC__)
+  if (!__builtin_cpu_supports("avx2")) {
+    std::fprintf(stderr, "AVX2 is not supported, skipped\n");
+    return 0;
+  }
+#endif
+  std::mt19937 rng(42);
+  test_running_average(rng);
+  test_running_median(rng);
+  if (failures > 0) {
+    std::fprintf(stderr, "%d failures\n", failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,140 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+#include <bot_common/binary_output.h>
+#include <bot_common/worker_pool.h>
+
+#include "motion_output.h"
+
+/*
+ * Checks that the per-frame code of the motion detector which doesn't call into OpenCV
+ * stops allocating once warmed up: the tile workers and update_output(), which the bot
+ * runs on every analysed frame to merge the tile boxes, track and select objects, and
+ * write the JSON message or add the frame to a binary output batch. The tiles find
+ * synthetic boxes, and operator new counts calls.
+ *
+ * Not covered, because they allocate by design: OpenCV's filters, background
+ * subtractors and findContours (internal scratch memory), and take_message(), which
+ * copies the JSON message for bot_message() or builds the envelope of a binary batch.
+ */
+
+namespace {
+
+std::atomic<bool> counting{false};
+std::atomic<size_t> allocations{0};
+
+}  // namespace
+
+void *operator new(size_t size) {
+  if (counting.load(std::memory_order_relaxed)) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (void *p = std::malloc(size == 0 ? 1 : size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+namespace bo = bot_common::binary_output;
+namespace mdb = motion_detector_bot;
+
+constexpr size_t tiles = 4;
+// The scene repeats every `period` frames, so warming up for a period reaches the
+// largest number of boxes and objects
+constexpr int period = 40;
+
+// Boxes found by a tile in a frame: objects moving across the seams between tiles,
+// appearing and disappearing, so that ids are created and removed.
+void tile_boxes(int frame, size_t tile, std::vector<cv::Rect> &boxes) {
+  boxes.clear();
+  const int phase = frame % period;
+  const int column = static_cast<int>(tile % 2);
+  const int row = static_cast<int>(tile / 2);
+  for (int i = 0; i < 3 + phase % 4; i++) {
+    const cv::Rect box{100 + 40 * i + 3 * phase, 80 + 50 * i + 2 * phase, 30, 20};
+    const cv::Rect region{column * 320 - 8, row * 240 - 8, 336, 256};
+    const cv::Rect clipped = box & region;
+    if (clipped.area() > 0 && (i + phase / 10) % 3 != 0) {
+      boxes.push_back(clipped);
+    }
+  }
+}
+
+struct pipeline {
+  bot_common::worker_pool workers{tiles - 1};
+  std::vector<std::vector<cv::Rect>> tile_results{tiles};
+  mdb::output_settings settings;
+  mdb::motion_output output;
+  size_t messages{0};
+
+  pipeline(bool delta, bool binary) {
+    settings.delta = delta;
+    settings.snapshot_interval = 10;
+    if (binary) {
+      output.batch.reset(new bo::batcher(bo::format::cbor, 8, std::chrono::hours(1)));
+    }
+  }
+
+  void process(int frame) {
+    workers.parallel_for(tiles, [&](size_t i) { tile_boxes(frame, i, tile_results[i]); });
+    const bool publish = mdb::update_output(
+        output, settings, tiles,
+        [&](size_t i) -> const std::vector<cv::Rect> & { return tile_results[i]; }, 0.5,
+        cv::Size(1280, 960));
+    if (publish) {
+      // Publishing copies the JSON message or builds the envelope of a batch
+      const bool was_counting = counting;
+      counting = false;
+      mdb::take_message(output);
+      messages++;
+      counting = was_counting;
+    }
+  }
+};
+
+}  // namespace
+
+int main() {
+  int failures = 0;
+  for (bool binary : {false, true}) {
+    for (bool delta : {false, true}) {
+      pipeline p(delta, binary);
+      int frame = 0;
+      for (; frame < 2 * period; frame++) {
+        p.process(frame);
+      }
+      p.messages = 0;
+      allocations = 0;
+      counting = true;
+      for (; frame < 12 * period; frame++) {
+        p.process(frame);
+      }
+      counting = false;
+      const char *mode = binary ? (delta ? "binary delta" : "binary full")
+                                : (delta ? "JSON delta" : "JSON full");
+      if (p.messages == 0) {
+        std::fprintf(stderr, "%s output: no message was published\n", mode);
+        failures++;
+      }
+      if (allocations != 0) {
+        std::fprintf(stderr, "%s output: %zu allocations in %d steady-state frames\n", mode,
+                     allocations.load(), 10 * period);
+        failures++;
+      }
+    }
+  }
+  return failures > 0 ? 1 : 0;
+}